@@ -0,0 +1,55 @@
+#ifndef ANNOTATE_H
+#define ANNOTATE_H
+
+#include "bitboard.h"
+
+/// How much worse a played move scores than the engine's best move.
+enum AnnotateFlag {
+  ANNOTATE_NONE,
+  ANNOTATE_INACCURACY,
+  ANNOTATE_MISTAKE,
+  ANNOTATE_BLUNDER,
+};
+
+/**
+ * @brief Annotate a finished game, printing one line per ply with the score
+ * of the played move, the engine's best move and a blunder flag.
+ *
+ * The game is walked backwards from the final position so that the search of
+ * each position reuses the transposition and history tables filled by the
+ * position after it. The played move is scored by the same search as the
+ * best move, so both are compared at the same depth.
+ *
+ * @param bbs: An existing ChessBitboards object (engine_setup() must have
+ * been called).
+ * @param game: Either a UCI position command (i.e., "position startpos moves
+ * e2e4 e7e5") or PGN movetext (tags, comments and move numbers are allowed;
+ * a [FEN "..."] tag sets the starting position).
+ * @param depth: The search depth (half-moves) used for every position.
+ * @return 0 on success, -1 if a move could not be parsed or is illegal.
+ */
+int annotate_game(ChessBitboards *bbs, const char *game, unsigned int depth);
+
+/**
+ * @brief Read a game from a file and annotate it with annotate_game().
+ *
+ * @param bbs: An existing ChessBitboards object (engine_setup() must have
+ * been called).
+ * @param path: The path of the file holding the game.
+ * @param depth: The search depth (half-moves) used for every position.
+ * @return 0 on success, -1 on failure.
+ */
+int annotate_file(ChessBitboards *bbs, const char *path, unsigned int depth);
+
+/**
+ * @brief Annotate a short game with a known blunder and check the flags: the
+ * blunder must be flagged, and the moves that follow the engine's own line
+ * must not be.
+ *
+ * @param bbs: An existing ChessBitboards object (engine_setup() must have
+ * been called).
+ * @return true if the flags are as expected.
+ */
+bool annotate_verify(ChessBitboards *bbs);
+
+#endif // ANNOTATE_H
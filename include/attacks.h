@@ -0,0 +1,106 @@
+#ifndef ATTACKS_H
+#define ATTACKS_H
+
+#include "bitboard.h"
+
+//
+// Set-wise Attacks
+// Attack sets of whole bitboards of pieces at once, without a per-piece loop
+// or table lookups. Sliders use Kogge-Stone occluded fills, one per direction.
+
+#define FILE_A_MASK (BITBOARD)0x8080808080808080ULL
+#define FILE_B_MASK (BITBOARD)0x4040404040404040ULL
+#define FILE_G_MASK (BITBOARD)0x0202020202020202ULL
+#define FILE_H_MASK (BITBOARD)0x0101010101010101ULL
+
+/// How the slider fills are computed.
+enum AttackBackend {
+  ATTACKS_SCALAR,  // one direction at a time, available everywhere
+  ATTACKS_AVX2,    // four directions per vector, x86-64 CPUs with AVX2 only
+  ATTACKS_SIMD128, // two directions per vector, WASM builds with -msimd128
+};
+
+/**
+ * @brief Determine if an attack backend can be used by this build and CPU.
+ *
+ * @param backend: The backend in question.
+ * @return true if attacks_set_backend(backend) can be used.
+ */
+bool attacks_backend_supported(enum AttackBackend backend);
+
+/**
+ * @brief Use a backend for the slider fills.
+ *
+ * @param backend: The backend to switch to.
+ * @return false if the backend is not supported (the current one is kept),
+ * true otherwise.
+ */
+bool attacks_set_backend(enum AttackBackend backend);
+
+/**
+ * @brief Get the attack backend in use.
+ *
+ * @return The current AttackBackend.
+ */
+enum AttackBackend attacks_backend();
+
+/**
+ * @brief Use the fastest supported attack backend (called by engine_setup()).
+ */
+void attacks_setup();
+
+/**
+ * @brief Squares attacked by a set of sliders.
+ *
+ * @param straight: Pieces that move along ranks and files (rooks, queens).
+ * @param diagonal: Pieces that move along diagonals (bishops, queens).
+ * @param empty: The empty squares.
+ * @return Every square attacked by at least one of the pieces.
+ */
+BITBOARD attacks_sliders(BITBOARD straight, BITBOARD diagonal, BITBOARD empty);
+
+/**
+ * @brief Squares attacked by a set of knights.
+ *
+ * @param knights: The knights.
+ * @return Every square attacked by at least one of the knights.
+ */
+BITBOARD attacks_knights(BITBOARD knights);
+
+/**
+ * @brief Squares attacked by a set of kings.
+ *
+ * @param kings: The kings.
+ * @return Every square attacked by at least one of the kings.
+ */
+BITBOARD attacks_kings(BITBOARD kings);
+
+/**
+ * @brief Squares attacked by a set of pawns.
+ *
+ * @param pawns: The pawns.
+ * @param color: The color of the pawns.
+ * @return Every square attacked by at least one of the pawns.
+ */
+BITBOARD attacks_pawns(BITBOARD pawns, enum PieceColor color);
+
+/**
+ * @brief Squares attacked by all pieces of a color.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @param color: The attacking color.
+ * @return The attack map of the color.
+ */
+BITBOARD attacks_by_color(const ChessBitboards *bbs, enum PieceColor color);
+
+/**
+ * @brief Mobility of a color: the number of squares its knights, bishops,
+ * rooks and queens attack that are not occupied by its own pieces.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @param color: The color in question.
+ * @return The number of squares.
+ */
+int attacks_mobility(const ChessBitboards *bbs, enum PieceColor color);
+
+#endif // ATTACKS_H
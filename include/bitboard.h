@@ -2,6 +2,7 @@
 #define BITBOARD_H
 
 #include <stdbool.h>
+#include <stddef.h>
 typedef unsigned long long BITBOARD;
 
 // TODO: port all relevant code to use this macro
@@ -14,6 +15,16 @@ typedef unsigned long long BITBOARD;
     lsb_index;                                                                 \
   })
 
+/// Compile a hot function for baseline x86-64, x86-64-v3 (AVX2, BMI2, POPCNT)
+/// and x86-64-v4 (AVX-512). The dynamic loader picks the variant for the CPU
+/// once, through an ifunc, so one binary runs at full speed everywhere.
+#if defined(__x86_64__) && defined(__GNUC__) && defined(__linux__)
+#define HOT_KERNEL                                                             \
+  __attribute__((target_clones("default", "arch=x86-64-v3", "arch=x86-64-v4")))
+#else
+#define HOT_KERNEL
+#endif
+
 enum PieceType { EMPTY, PAWN, BISHOP, KNIGHT, ROOK, QUEEN, KING };
 
 enum PieceColor {
@@ -22,74 +33,255 @@ enum PieceColor {
   BLACK = -1,
 }; // TODO: maybe use the values... I don't know yet
 
-typedef struct {
-  // White bitboards
-  BITBOARD white_pawns;
-  BITBOARD white_bishops;
-  BITBOARD white_knights;
-  BITBOARD white_rooks;
-  BITBOARD white_queens;
-  BITBOARD white_king;
-
-  // Black bitboards
-  BITBOARD black_pawns;
-  BITBOARD black_bishops;
-  BITBOARD black_knights;
-  BITBOARD black_rooks;
-  BITBOARD black_queens;
-  BITBOARD black_king;
-
-  // Cumulative bitboards
-  BITBOARD white_pieces;
-  BITBOARD black_pieces;
+/// Map a PieceColor to a 0 (white) / 1 (black) array index.
+#define COLOR_INDEX(color) ((color) == BLACK)
+
+/// Mailbox piece codes: the PieceType in bits 0-2, bit 3 set for black pieces.
+/// An empty square is 0.
+#define PIECE_CODE(type, color) ((type) | ((color) == BLACK ? 8 : 0))
+#define PIECE_CODE_TYPE(code) ((enum PieceType)((code) & 7))
+#define PIECE_CODE_COLOR_INDEX(code) ((code) >> 3)
+
+/// Slot of a PieceType other than EMPTY in ChessBitboards::pieces.
+#define PIECE_SLOT(type) ((type) - PAWN)
+
+/// Accumulator width per side of the NNUE_EVAL network (see nnue.h).
+#define NNUE_HALF_DIMS 32
+
+/**
+ * @brief The state of a position. Kept compact (3 cache lines, 5 with
+ * NNUE_EVAL) and free of pointers so that it can be copied cheaply; see
+ * BoardTables for the precomputed lookup tables.
+ */
+typedef struct __attribute__((aligned(64))) {
+  // Piece bitboards by [COLOR_INDEX(color)][PIECE_SLOT(type)]
+  BITBOARD pieces[2][6];
+
+  // Cumulative bitboards by COLOR_INDEX(color) (empty squares are ~all_pieces)
+  BITBOARD occupancy[2];
   BITBOARD all_pieces;
-  BITBOARD empty_squares;
 
-  // Precomputation tables
+  // Zobrist hash of the piece placement (side to move is not included)
+  unsigned long long hash;
+  // Zobrist hash of the pawns alone (keys of ZOBRIST_PIECES), for the pawn
+  // hash table
+  unsigned long long pawn_hash;
+
+  // Sums of the middlegame and endgame piece-square scores and the game phase
+  // (see eval.h), kept up to date like the hash.
+  int mg_score;
+  int eg_score;
+  int phase;
+
+  // Mailbox: the piece code (see PIECE_CODE) on each square, two squares to
+  // a byte (see BB_CODE_AT), kept in sync with the bitboards above.
+  unsigned char board[32];
+
+#ifdef NNUE_EVAL
+  // First layer sums of the network by COLOR_INDEX(color) of the side whose
+  // view they take, and whether one must be rebuilt before it is used.
+  unsigned char nnue_dirty[2];
+  short nnue_accumulator[2][NNUE_HALF_DIMS] __attribute__((aligned(64)));
+#endif
+} ChessBitboards;
+
+#ifdef NNUE_EVAL
+_Static_assert(sizeof(ChessBitboards) <= 320,
+               "ChessBitboards must fit in 5 cache lines");
+#else
+_Static_assert(sizeof(ChessBitboards) <= 192,
+               "ChessBitboards must fit in 3 cache lines");
+#endif
+
+/// The piece code on a square of a position's mailbox.
+#define BB_CODE_AT(bbs, sq)                                                    \
+  (((bbs)->board[(sq) / 2] >> (4 * ((sq) % 2))) & 15)
+/// Replace the piece code on a square of a position's mailbox.
+#define BB_SET_CODE(bbs, sq, code)                                             \
+  ((bbs)->board[(sq) / 2] =                                                    \
+       ((bbs)->board[(sq) / 2] & (0xF0 >> (4 * ((sq) % 2)))) |                 \
+       ((code) << (4 * ((sq) % 2))))
+
+/**
+ * @brief Magic bitboard lookup data of one slider on one square, packed in 32
+ * bytes so that a lookup reads its metadata from a single cache line. Magics
+ * are "black": they index by ((occupied | ~mask) * magic) >> shift.
+ */
+typedef struct __attribute__((aligned(32))) {
+  BITBOARD mask;           // relevant blocker squares
+  BITBOARD magic;
+  const BITBOARD *attacks; // this square's table in the slider arena
+  unsigned int shift;
+} MagicEntry;
+
+/// The squares of one line (file, rank, diagonal or anti-diagonal) through a
+/// square, split at the square. Used by the table-free slider backend.
+typedef struct {
+  BITBOARD lower; // squares with a lower index than the square
+  BITBOARD upper; // squares with a higher index
+} LineMask;
+
+/// Line indices of BoardTables.lines.
+enum LineType { LINE_FILE, LINE_RANK, LINE_DIAGONAL, LINE_ANTI_DIAGONAL };
+
+/// Number of entries of the PEXT slider tables: every square of both sliders
+/// indexed by its blocker mask bits, back to back (rooks 102400, bishops
+/// 5248). The magic tables need MagicInfo.ARENA_SIZE entries instead.
+#define PEXT_ARENA_SIZE (102400 + 5248)
+
+/**
+ * @brief Precomputed lookup tables shared by every position.
+ */
+typedef struct {
   BITBOARD knight_moves[64];
   BITBOARD king_moves[64];
-  BITBOARD black_pawn_moves[64];
-  BITBOARD rook_blocker_masks[64];
-  BITBOARD bishop_blocker_masks[64];
-  BITBOARD white_pawn_captures[64];
-  BITBOARD black_pawn_captures[64];
-  // To be initialized outside of the init function:
-  BITBOARD **rook_move_table;   // Should point to a BITBOARD [64]
-  BITBOARD **bishop_move_table; // Should point to a BITBOARD [64]
-} ChessBitboards;
+  BITBOARD pawn_captures[2][64]; // by COLOR_INDEX(color)
+  // Masks filled by bb_init_tables(), the rest in engine_setup():
+  MagicEntry rook_magics[64];
+  MagicEntry bishop_magics[64];
+  LineMask lines[64][4]; // by LineType
+} BoardTables;
+
+/// The lookup tables. Filled once by bb_init_tables() and engine_setup(), and
+/// only read afterwards.
+extern BoardTables BB_TABLES;
 
 void bb_print(BITBOARD bb);
 void bb_pretty_print(BITBOARD bb);
 
-BITBOARD init_white_pawns(char *board_str);
-BITBOARD init_white_bishops(char *board_str);
-BITBOARD init_white_knights(char *board_str);
-BITBOARD init_white_rooks(char *board_str);
-BITBOARD init_white_queens(char *board_str);
-BITBOARD init_white_king(char *board_str);
+/**
+ * @brief Set up a position from the piece placement field of a FEN string, in
+ * a single pass over the field. The bitboards, the mailbox, both hashes and
+ * the piece-square scores are filled as each piece is read; the lookup tables
+ * are never touched.
+ *
+ * @param bbs: The ChessBitboards object to fill (any previous contents are
+ * discarded).
+ * @param board_str: A FEN string, or only its piece placement field. Reading
+ * stops at the first space or at the end of the string.
+ */
+void bb_init_chess_boards(ChessBitboards *bbs, const char *board_str);
+
+/**
+ * @brief Compute the position-independent lookup tables (knight, king and
+ * pawn capture moves, slider blocker and line masks) into `tables`.
+ *
+ * @param tables: The tables to fill. The slider entries only get their masks.
+ */
+void bb_compute_tables(BoardTables *tables);
+
+/**
+ * @brief Compute the position-independent lookup tables in BB_TABLES (knight,
+ * king and pawn capture moves, slider blocker masks). Only the first call does
+ * any work.
+ */
+void bb_init_tables();
 
-BITBOARD init_black_pawns(char *board_str);
-BITBOARD init_black_bishops(char *board_str);
-BITBOARD init_black_knights(char *board_str);
-BITBOARD init_black_rooks(char *board_str);
-BITBOARD init_black_queens(char *board_str);
-BITBOARD init_black_king(char *board_str);
+//
+// Zobrist Hashing
+
+/// Random keys per [color index][piece type][square], so that any mailbox
+/// code indexes them. Keys of the EMPTY slot are 0.
+extern unsigned long long ZOBRIST_PIECES[2][8][64];
+/// Key XORed into a position hash when black is to move.
+extern unsigned long long ZOBRIST_BLACK_TO_MOVE;
+
+/**
+ * @brief Compute the Zobrist hash of the piece placement from scratch.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @return The hash of the position (side to move not included).
+ */
+unsigned long long bb_compute_hash(ChessBitboards *bbs);
 
-BITBOARD init_white_pieces(ChessBitboards *bbs);
-BITBOARD init_black_pieces(ChessBitboards *bbs);
-BITBOARD init_all_pieces(ChessBitboards *bbs);
-BITBOARD init_empty_squares(ChessBitboards *bbs);
+/**
+ * @brief Compute the Zobrist hash of the pawns of both colors from scratch.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @return The pawn hash of the position (0 without pawns).
+ */
+unsigned long long bb_compute_pawn_hash(ChessBitboards *bbs);
+
+//
+// FEN
+// bb_parse_fen() reads all six fields of a FEN in one pass, without
+// allocating, and rejects malformed input with a FenError. The fields after
+// the piece placement go to a FenState next to the position. The engine does
+// not play castling or en passant yet, so those rights are only kept to be
+// written back by bb_write_fen().
 
-void bb_init_chess_boards(ChessBitboards *bbs, char *board_str);
+/// Castling rights, bits of FenState::castling.
+enum CastlingRight {
+  CASTLE_WHITE_KING = 1,
+  CASTLE_WHITE_QUEEN = 2,
+  CASTLE_BLACK_KING = 4,
+  CASTLE_BLACK_QUEEN = 8,
+};
+
+/// The fields of a FEN besides the piece placement.
+typedef struct {
+  enum PieceColor turn;         // side to move
+  unsigned char castling;       // CastlingRight bits
+  signed char en_passant;       // square passed by a double pawn push, or -1
+  unsigned int halfmove_clock;  // half-moves since a capture or pawn move
+  unsigned int fullmove_number; // starts at 1, incremented after black moves
+} FenState;
+
+/// Why bb_parse_fen() rejected a FEN.
+enum FenError {
+  FEN_OK,
+  FEN_BAD_PLACEMENT,  // not 8 ranks of 8 squares, or an unknown character
+  FEN_BAD_PIECES,     // not one king per side, or a pawn on a back rank
+  FEN_BAD_TURN,       // side to move other than "w" or "b"
+  FEN_BAD_CASTLING,   // not "-" or a subset of "KQkq"
+  FEN_BAD_EN_PASSANT, // not "-" or a square behind the side that just moved
+  FEN_BAD_CLOCKS,     // halfmove clock without a fullmove number, or too long
+};
+
+/// Buffer size that fits any FEN written by bb_write_fen().
+#define FEN_BUFFER_SIZE 128
+
+/**
+ * @brief Set up a position and its FenState from a FEN string, in a single
+ * pass over the string. The move clocks may be left out, as in EPD records;
+ * they then default to 0 and 1. A FEN may also end after the side to move,
+ * with no castling rights and no en passant target.
+ *
+ * @param bbs: The ChessBitboards object to fill. Its contents are undefined
+ * if the FEN is rejected.
+ * @param state: Filled with the other fields (left untouched on errors).
+ * @param fen: The FEN string. Leading blanks are skipped.
+ * @param end: If not NULL, set to the first character after the last field
+ * read (i.e., the operations of an EPD record). Only set on success.
+ * @return FEN_OK, or the first problem found.
+ */
+enum FenError bb_parse_fen(ChessBitboards *bbs, FenState *state,
+                           const char *fen, const char **end);
+
+/**
+ * @brief Describe a FenError.
+ *
+ * @param error: The error in question.
+ * @return A short lowercase description (i.e., "bad castling rights").
+ */
+const char *bb_fen_error_string(enum FenError error);
+
+/**
+ * @brief Write a position and its FenState as a FEN, the inverse of
+ * bb_parse_fen().
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @param state: The other fields of the FEN.
+ * @param out: A buffer of at least FEN_BUFFER_SIZE bytes, receiving the FEN
+ * and a terminating null character.
+ * @return The length of the FEN.
+ */
+size_t bb_write_fen(const ChessBitboards *bbs, const FenState *state,
+                    char *out);
 
 void set_bit(BITBOARD *bb, unsigned int pos);
 void clear_bit(BITBOARD *bb, unsigned int pos);
 void toggle_bit(BITBOARD *bb, unsigned int pos);
 bool is_occupied(BITBOARD bb, unsigned int pos);
 
-//
-// Magic Bitboards
-void compute_and_export_magics(BITBOARD *blocker_masks,
-                               const unsigned int MAX_INDICES, char *filename);
-
 #endif // BITBOARD_H
@@ -11,8 +11,10 @@ typedef struct {
   enum PieceColor color;
 } Piece;
 
+#define RANK_1_MASK (BITBOARD)0xFF
 #define RANK_2_MASK (BITBOARD)0xFF << 8
 #define RANK_7_MASK (BITBOARD)0xFF << 48
+#define RANK_8_MASK (BITBOARD)0xFF << 56
 
 // Given a moves vector, get the "from" or "to" positions.
 #define GET_FROM_POS(move) (move & ((1U << 6) - 1))
@@ -29,6 +31,20 @@ typedef struct {
  */
 typedef uint16_t move_info_t;
 
+/**
+ * @brief Everything needed to take back a move, filled by engine_make().
+ */
+typedef struct {
+  unsigned char moving;         // piece code of the moving piece
+  unsigned char captured;       // piece code of the captured piece (0 if none)
+  unsigned char promotion;      // piece code the pawn promoted to (0 if none)
+  unsigned long long hash;      // hash of the position before the move
+  unsigned long long pawn_hash; // pawn hash of the position before the move
+  int mg_score;                 // piece-square scores before the move
+  int eg_score;
+  int phase;                    // game phase before the move
+} UndoInfo;
+
 typedef struct {
   // NOTE: According to sources, 218 is the max number of moves, but I will use
   // 256 just in case :)
@@ -38,82 +54,308 @@ typedef struct {
 
 /**
  * @brief Setup the engine, including precomputation of move lookup tables.
+ * Uses the PEXT slider backend when the CPU supports it, magics otherwise,
+ * and obstruction difference in TABLE_FREE_SLIDERS builds.
  *
- * @param bbs: A ChessBitboards object that has been initialized using
- * bb_init_chess_boards()
- * @param rook_move_table: rook move lookup table (2D array)
- * @param bishop_move_table: bishop move lookup table (2D array)
  * @param magic_info: MagicInfo object that is initiated in init_magic_info().
- * @note the tables should be setup as BITBOARD *table[64];
+ * With GENERATED_TABLES, the tables were built from the same magics at
+ * compile time.
+ * @note This fills the global BB_TABLES, so it only needs to be called once.
+ */
+void engine_setup(MagicInfo *magic_info);
+
+/// How slider (rook/bishop/queen) moves are looked up.
+enum SliderBackend {
+  SLIDERS_MAGIC,       // magic multiply and shift, available everywhere
+  SLIDERS_PEXT,        // BMI2 pext index, x86-64 CPUs with BMI2 only
+  SLIDERS_OBSTRUCTION, // obstruction difference on line masks, no tables
+};
+
+/**
+ * @brief Determine if the CPU can run the PEXT slider backend (x86-64 with
+ * BMI2).
+ *
+ * @return true if engine_set_slider_backend(SLIDERS_PEXT) can be used.
+ */
+bool engine_pext_supported();
+
+/**
+ * @brief Name the instruction set level the HOT_KERNEL functions run at on
+ * this CPU.
+ *
+ * @return "x86-64-v4", "x86-64-v3" or "x86-64" on x86-64 Linux, "generic"
+ * elsewhere.
+ */
+const char *engine_cpu_level();
+
+/**
+ * @brief Get the number of slider arena entries the tables of a backend need.
+ *
+ * @param magic_info: The magics (only used by the magic backend).
+ * @param backend: The slider backend.
+ * @return MagicInfo.ARENA_SIZE for magics, PEXT_ARENA_SIZE for PEXT and 0 for
+ * obstruction difference.
+ */
+unsigned int engine_arena_size(const MagicInfo *magic_info,
+                               enum SliderBackend backend);
+
+/**
+ * @brief Build all lookup tables for a slider backend at runtime. Magic
+ * tables are placed at the MagicInfo offsets, PEXT tables back to back.
+ *
+ * @param tables: The tables to fill.
+ * @param arena: engine_arena_size() entries to hold the slider tables.
+ * @param magic_info: The magics (ignored by the PEXT backend).
+ * @param backend: The backend to build the slider tables for.
+ */
+void engine_build_tables(BoardTables *tables, BITBOARD *arena,
+                         const MagicInfo *magic_info,
+                         enum SliderBackend backend);
+
+/**
+ * @brief Switch the lookup tables to a backend and use it for move
+ * generation. With GENERATED_TABLES this only copies the small per-square
+ * tables; the slider arenas are linked in read-only.
+ *
+ * @param backend: The backend to switch to.
+ * @return false if the backend is not supported on this CPU or in this build
+ * (the current one is kept), true otherwise.
  */
-void engine_setup(ChessBitboards *bbs, BITBOARD **rook_move_table,
-                  BITBOARD **bishop_move_table, MagicInfo *magic_info);
+bool engine_set_slider_backend(enum SliderBackend backend);
 
 /**
- * @brief Perform cleanup on the engine. This includes freeing allocated
- * resources in the lookup tables.
+ * @brief Get the slider backend in use.
  *
- * @param rook_move_table: rook move lookup table (2D array)
- * @param bishop_move_table: bishop move lookup table (2D array)
+ * @return The current SliderBackend.
  */
-void engine_cleanup(BITBOARD **rook_move_table, BITBOARD **bishop_move_table);
+enum SliderBackend engine_slider_backend();
+
+/**
+ * @brief Check the tables linked in at build time against the ones built at
+ * runtime from the MagicInfo given to engine_setup().
+ *
+ * @return true if they match, or if the engine was built without
+ * GENERATED_TABLES.
+ */
+bool engine_verify_tables();
+
+/**
+ * @brief Use the lookup tables of the current backend from a file mapped
+ * read-only, so that every engine process on a host shares one physical copy.
+ * If the file is missing, or was written by another version or from other
+ * magics, it is built and written first.
+ *
+ * @param path: The path of the table file.
+ * @return false if the file could neither be mapped nor written, or if the
+ * backend uses no tables (the current tables are kept), true otherwise.
+ */
+bool engine_map_tables(const char *path);
+
+/**
+ * @brief Perform cleanup on the engine. The slider tables live in an arena
+ * allocated for the backend or in a mapped table file; the entries are
+ * detached from them, the arena is freed and the file is unmapped.
+ */
+void engine_cleanup();
 
 /**
  * @brief Computes all pseudo-legal moves given the current board.
  *
  * @param bbs: An initialized ChessBitboards object.
- * @param magic: An initialized MagicInfo object.
  * @param moves: The array to assign moves.
  * @param color: The color to generate moves from.
  * @return A Vec of MoveInfo values.
  */
-void engine_generate_pseudolegal_moves(ChessBitboards *bbs, MagicInfo *magic,
-                                       MoveArray *moves, enum PieceColor color);
+void engine_generate_pseudolegal_moves(ChessBitboards *bbs, MoveArray *moves,
+                                       enum PieceColor color);
+//
+// Batched Move Generation
+// Many positions laid out as a structure of arrays, so that the pawn and king
+// targets of eight positions fit in one vector register.
+
+/// Number of positions in a PositionBatch.
+#define POSITION_BATCH_SIZE 64
+
+/// The bitboards of up to POSITION_BATCH_SIZE positions, lane by lane.
+typedef struct __attribute__((aligned(64))) {
+  BITBOARD pieces[2][6][POSITION_BATCH_SIZE];
+  BITBOARD occupancy[2][POSITION_BATCH_SIZE];
+  BITBOARD all_pieces[POSITION_BATCH_SIZE];
+  unsigned int len;
+} PositionBatch;
+
+/**
+ * @brief Empty a batch.
+ *
+ * @param batch: The batch to clear.
+ */
+void engine_batch_clear(PositionBatch *batch);
+
+/**
+ * @brief Add a position to a batch.
+ *
+ * @param batch: The batch.
+ * @param bbs: The position to add (copied into the next lane).
+ * @return false if the batch is full, true otherwise.
+ */
+bool engine_batch_add(PositionBatch *batch, const ChessBitboards *bbs);
+
+/**
+ * @brief Computes the pseudo-legal moves of every position in a batch, all
+ * with the same color to move. moves[i] gets the same moves as
+ * engine_generate_pseudolegal_moves() gives for position i, although not
+ * necessarily in the same order.
+ *
+ * @param batch: The positions.
+ * @param moves: batch->len arrays to assign the moves.
+ * @param color: The color to generate moves for.
+ */
+void engine_generate_batch(const PositionBatch *batch, MoveArray *moves,
+                           enum PieceColor color);
+
+/**
+ * @brief Name the kernel engine_generate_batch() uses on this CPU.
+ *
+ * @return "avx512" with AVX-512 VBMI2, "scalar" otherwise.
+ */
+const char *engine_batch_kernel();
 /**
  * @brief Determine if a color is in check.
  *
  * @param bbs: An existing ChessBitboards object.
- * @param magic: An initialized MagicInfo object.
  * @param color: The color in question.
  * @return Will return true if the color in question is in check, and false
  * otherwise.
  */
-bool engine_color_in_check(ChessBitboards *bbs, MagicInfo *magic_info,
-                           enum PieceColor color);
+bool engine_color_in_check(ChessBitboards *bbs, enum PieceColor color);
 
 /**
  * @brief Determine if a color is in checkmate or stalemate.
  *
  * @param bbs: An existing ChessBitboards object.
- * @param magic: An initialized MagicInfo object.
  * @param color: The color in question.
  * @return 1 if checkmate, 2 if stalemate, 0 otherwise.
  */
-int engine_check_game_over(ChessBitboards *bbs, MagicInfo *magic,
-                           enum PieceColor color);
+int engine_check_game_over(ChessBitboards *bbs, enum PieceColor color);
+
+/**
+ * @brief Get the Piece at a certain square position.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @param pos: The square position.
+ * @return The Piece at position `pos`.
+ */
+Piece engine_piece_at(ChessBitboards *bbs, unsigned int pos);
 
 /**
  * @brief Make a move and update all relevant bitboards in bbs.
  *
  * @param bbs: An existing ChessBitboards object.
- * @param from_pos: Where the piece to move originates.
- * @param to_pos: Where the piece to move lands.
- * @return The captured piece.
+ * @param move: The move to make. Promotions are taken from its flags.
+ * @param undo: Filled with what engine_unmake() needs to take the move back.
  */
-Piece engine_move(ChessBitboards *bbs, unsigned int from_pos,
-                  unsigned int to_pos);
+void engine_make(ChessBitboards *bbs, move_info_t move, UndoInfo *undo);
 
 /**
- * @brief Replace the piece that may have been captured.
+ * @brief Take back a move made with engine_make().
+ *
+ * @param bbs: The ChessBitboards object the move was made on.
+ * @param move: The move to take back.
+ * @param undo: The record filled by engine_make().
+ */
+void engine_unmake(ChessBitboards *bbs, move_info_t move,
+                   const UndoInfo *undo);
+
+/**
+ * @brief Copy a position and make a move on the copy (copy-make). No undo
+ * record is written: the original position is the way back.
+ *
+ * @param from: The position before the move; left unchanged.
+ * @param to: Set to the position after the move (must not be `from`).
+ * @param move: The move to make. Promotions are taken from its flags.
+ */
+void engine_make_copy(const ChessBitboards *from, ChessBitboards *to,
+                      move_info_t move);
+
+/**
+ * @brief Count the leaf nodes of the legal move tree (perft).
  *
  * @param bbs: An existing ChessBitboards object.
- * @param captured: The captured piece to be re-placed back.
- * @param captured_pos: The position which the piece was captured at.
+ * @param depth: The number of half-moves to expand.
+ * @param color: The color to move.
+ * @return The number of leaf nodes at `depth`.
+ */
+unsigned long long engine_perft(ChessBitboards *bbs, unsigned int depth,
+                                enum PieceColor color);
+
+/// Outcome of engine_bench().
+typedef struct {
+  const char *backend; // name of the slider backend
+  unsigned long long nodes;
+  double ms;
+  double nps;
+} BenchResult;
+
+/**
+ * @brief Time perft over the standard perft test positions with a slider
+ * backend. The current backend is restored afterwards.
+ *
+ * @param depth: The perft depth.
+ * @param backend: The slider backend to run with.
+ * @param result: Filled with the backend name, nodes, time and speed.
+ * @return false if the backend is not supported, true otherwise.
  */
-void engine_undo_capture(ChessBitboards *bbs, Piece *captured,
-                         unsigned int captured_pos);
+bool engine_bench(unsigned int depth, enum SliderBackend backend,
+                  BenchResult *result);
 
-void engine_undo_promotion(ChessBitboards *bbs, unsigned int pos, enum PieceColor color);
+/// What engine_bench_movegen() measured.
+typedef struct {
+  unsigned int positions;
+  unsigned long long moves; // per round
+  double single_ms;         // engine_generate_pseudolegal_moves() per position
+  double batch_ms;          // engine_generate_batch(), filling included
+} MovegenBenchResult;
+
+/**
+ * @brief Time move generation for the positions two half-moves into the
+ * standard perft test positions, one position at a time and in batches.
+ *
+ * @param rounds: The number of times every position is generated.
+ * @param result: Filled with the position and move counts and both times.
+ * @return false if the two generators disagree on a move list, true
+ * otherwise.
+ */
+bool engine_bench_movegen(unsigned int rounds, MovegenBenchResult *result);
+
+/// What engine_bench_eval() measured.
+typedef struct {
+  unsigned int positions;
+  double single_ms; // eval_compute() and eval_tapered() per position
+  double batch_ms;  // eval_batch() over all of them
+} EvalBenchResult;
+
+/**
+ * @brief Time the piece-square evaluation of the positions two half-moves
+ * into the standard perft test positions, one position at a time and with
+ * eval_batch().
+ *
+ * @param rounds: The number of times every position is evaluated.
+ * @param result: Filled with the position count and both times.
+ * @return false if the two disagree on a score, true otherwise.
+ */
+bool engine_bench_eval(unsigned int rounds, EvalBenchResult *result);
+
+/// Buffer size that fits the chess notation of any move ("a7a8q" and a null
+/// character).
+#define MOVE_NOTATION_SIZE 6
+
+/**
+ * @brief Write a move in chess notation (i.e., e2e4) without allocating.
+ *
+ * @param move: The MoveInfo value.
+ * @param notation: A buffer of at least MOVE_NOTATION_SIZE bytes.
+ */
+void engine_move_notation(move_info_t move, char *notation);
 
 /**
  * @brief Returns a String of the move in chess notation (i.e., e2e4)
@@ -124,4 +366,17 @@ void engine_undo_promotion(ChessBitboards *bbs, unsigned int pos, enum PieceColo
  */
 String move_info_to_chess_notation(move_info_t move);
 
+/**
+ * @brief Convert a move in chess notation (i.e., e2e4, a7a8q) to the matching
+ * pseudo-legal move of `color`, including its flags.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @param notation: The move in long algebraic notation.
+ * @param color: The color making the move.
+ * @param move: Set to the matching move on success.
+ * @return true if the notation matches a pseudo-legal move, false otherwise.
+ */
+bool engine_parse_move(ChessBitboards *bbs, const char *notation,
+                       enum PieceColor color, move_info_t *move);
+
 #endif // ENGINE_H
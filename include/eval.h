@@ -0,0 +1,130 @@
+#ifndef EVAL_H
+#define EVAL_H
+
+#include "bitboard.h"
+#include <stddef.h>
+
+//
+// Piece-Square Scores
+// Material plus a bonus for the square of every piece, with a middlegame and
+// an endgame half. Every ChessBitboards keeps the sums of both halves and the
+// game phase, updated by engine_make()/engine_unmake(), so a static
+// evaluation only blends two integers.
+
+/// Game phase of the starting position (4 minor pieces, 2 rooks and a queen
+/// per side); the phase counts down to 0 as pieces come off the board.
+#define PHASE_MAX 24
+
+/// Middlegame and endgame scores by [piece code][square] (see PIECE_CODE),
+/// positive for white pieces and negative for black ones. The rows of EMPTY
+/// and the unused codes are 0.
+extern int EVAL_MG[16][64];
+extern int EVAL_EG[16][64];
+
+/// Game phase weight by piece code.
+extern const int EVAL_PHASE[16];
+
+/// Material value by piece type. Both kings are always on the board, so the
+/// king is worth nothing here.
+extern const int EVAL_PIECE_VALUES[8];
+
+/**
+ * @brief Fill EVAL_MG and EVAL_EG from the piece-square tables. Only the first
+ * call does any work.
+ */
+void eval_init();
+
+/**
+ * @brief Compute the piece-square scores and the game phase of a position
+ * from scratch into bbs->mg_score, bbs->eg_score and bbs->phase.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ */
+void eval_compute(ChessBitboards *bbs);
+
+/**
+ * @brief Blend the middlegame and endgame scores of a position by its game
+ * phase.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @return The tapered score, positive when white is better.
+ */
+int eval_tapered(const ChessBitboards *bbs);
+
+//
+// Pawn Structure
+// Passed, isolated and doubled pawns only change when a pawn moves or is
+// captured, so their score is cached by the pawn hash of the position
+// (ChessBitboards::pawn_hash) together with bitboards derived from the pawns.
+
+/// Number of entries in the pawn hash table (a power of two).
+#define PAWN_TABLE_SIZE 16384
+
+/// One cached pawn structure, one cache line.
+typedef struct __attribute__((aligned(64))) {
+  unsigned long long key;   // pawn hash of the structure
+  int mg_score;             // pawn structure score, positive for white
+  int eg_score;
+  BITBOARD passed[2];       // passed pawns by color index
+  BITBOARD attack_spans[2]; // squares the pawns can attack as they advance
+} PawnEntry;
+
+/**
+ * @brief Find the pawn structure of a position in the pawn hash table,
+ * evaluating and storing it on a miss.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @return The entry of the position's pawns (valid until the next probe).
+ */
+const PawnEntry *eval_probe_pawns(const ChessBitboards *bbs);
+
+/**
+ * @brief The tapered pawn score of a position: its cached pawn structure plus
+ * the pawn shields in front of both kings.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @return The score, positive when white is better.
+ */
+int eval_pawns(const ChessBitboards *bbs);
+
+//
+// Batch Evaluation
+// Piece-square scores of many positions at once, for bulk labelling, straight
+// from packed positions: every piece adds one table entry holding both its
+// middlegame and endgame score.
+
+/// A position packed for bulk work (24 bytes): the occupied squares and their
+/// piece codes (see PIECE_CODE), 4 bits each from the lowest square up.
+typedef struct {
+  BITBOARD occupancy;
+  unsigned char codes[16];
+} PackedPosition;
+
+/**
+ * @brief Pack a position for eval_batch().
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @param packed: Filled with the packed position.
+ * @return false if the position has more than 32 pieces, true otherwise.
+ */
+bool eval_pack(const ChessBitboards *bbs, PackedPosition *packed);
+
+/**
+ * @brief Set the number of threads eval_batch() may use.
+ *
+ * @param threads: The thread count, 0 for one per online CPU (the default).
+ */
+void eval_set_batch_threads(unsigned int threads);
+
+/**
+ * @brief The tapered piece-square score (see eval_tapered()) of many
+ * positions. Large batches are split across threads by chunks.
+ *
+ * @param in: The packed positions.
+ * @param out: Filled with one score per position, positive when white is
+ * better.
+ * @param n: The number of positions.
+ */
+void eval_batch(const PackedPosition *in, int *out, size_t n);
+
+#endif // EVAL_H
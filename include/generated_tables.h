@@ -0,0 +1,19 @@
+#ifndef GENERATED_TABLES_H
+#define GENERATED_TABLES_H
+
+#include "bitboard.h"
+
+//
+// Lookup tables emitted by tools/gen_tables.c (see the attack_tables target in
+// the Makefile). They are const, so they live in read-only memory: nothing is
+// computed at startup and the pages are shared between engine processes.
+
+/// Tables for the magic slider backend.
+extern const BoardTables GENERATED_MAGIC_TABLES;
+
+#if defined(__x86_64__)
+/// Tables for the PEXT slider backend.
+extern const BoardTables GENERATED_PEXT_TABLES;
+#endif
+
+#endif // GENERATED_TABLES_H
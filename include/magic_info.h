@@ -10,10 +10,16 @@ typedef struct {
   unsigned int ROOK_SHIFTS[64];
   unsigned long long BISHOP_MAGICS[64];
   unsigned int BISHOP_SHIFTS[64];
+  // Start of each square's table in the slider arena (see engine_setup())
+  unsigned int ROOK_OFFSETS[64];
+  unsigned int BISHOP_OFFSETS[64];
+  // Entries of the slider arena the tables reach into
+  unsigned int ARENA_SIZE;
 } MagicInfo;
 
 /**
- * @brief Initialize the *_MAGICS and *_SHIFTS arrays.
+ * @brief Initialize the *_MAGICS, *_SHIFTS and *_OFFSETS arrays and the arena
+ * size.
  */
 MagicInfo init_magic_info();
 
@@ -0,0 +1,154 @@
+#ifndef NNUE_H
+#define NNUE_H
+
+#include "bitboard.h"
+
+//
+// Efficiently Updatable Neural Network
+// An optional evaluator, compiled in with NNUE_EVAL (`make NNUE=1`). The
+// first layer (the feature transformer) has one input per piece on a square,
+// seen from each side: for that side, the board is flipped so it plays up the
+// board and mirrored so its king stands on the e-h files. Each ChessBitboards
+// keeps both sides' sums of the first layer (the accumulators), which
+// engine_make()/engine_unmake() update by the rows of the few pieces that
+// moved. Only a king crossing between the d- and e-files changes a side's
+// view of every piece; its accumulator is then marked dirty and rebuilt
+// lazily, the next time the position is evaluated.
+//
+// Layers, all integer:
+//   768 -> NNUE_HALF_DIMS per side (int16 weights), clipped to [0, 127]
+//   2 * NNUE_HALF_DIMS -> NNUE_HIDDEN (int8 weights), shifted, clipped
+//   NNUE_HIDDEN -> 1 (int8 weights), scaled to centipawns
+
+#ifdef NNUE_EVAL
+
+/// Inputs per side: [own, their pieces][PieceType - 1][square].
+#define NNUE_FEATURES 768
+/// Neurons of the second layer.
+#define NNUE_HIDDEN 8
+
+/// How the accumulators and layers are computed.
+enum NnueBackend {
+  NNUE_SCALAR,  // available everywhere
+  NNUE_AVX2,    // x86-64 CPUs with AVX2 only
+  NNUE_SIMD128, // WASM builds with -msimd128
+};
+
+/**
+ * @brief Determine if an NNUE backend can be used by this build and CPU.
+ *
+ * @param backend: The backend in question.
+ * @return true if nnue_set_backend(backend) can be used.
+ */
+bool nnue_backend_supported(enum NnueBackend backend);
+
+/**
+ * @brief Use a backend for the accumulator updates and the inference.
+ *
+ * @param backend: The backend to switch to.
+ * @return false if the backend is not supported (the current one is kept),
+ * true otherwise.
+ */
+bool nnue_set_backend(enum NnueBackend backend);
+
+/**
+ * @brief Get the NNUE backend in use.
+ *
+ * @return The current NnueBackend.
+ */
+enum NnueBackend nnue_backend();
+
+/**
+ * @brief Use the fastest supported NNUE backend (called by engine_setup()).
+ */
+void nnue_setup();
+
+/**
+ * @brief Load a network from a file written by nnue_save(). Positions set up
+ * before the call keep accumulators of the previous network.
+ *
+ * @param path: The network file.
+ * @return false if the file is missing or does not match this build's layer
+ * sizes (the current network is kept), true otherwise.
+ */
+bool nnue_load(const char *path);
+
+/**
+ * @brief Write the current network to a file.
+ *
+ * @param path: The network file.
+ * @return true on success.
+ */
+bool nnue_save(const char *path);
+
+/**
+ * @brief Load the bundled test network: it counts material only (pawn 100,
+ * minor pieces 300, rook 500, queen 900), up to a difference of 1270.
+ */
+void nnue_load_test_net();
+
+/**
+ * @brief Determine if a network has been loaded.
+ *
+ * @return true if nnue_evaluate() should be used for static evaluation.
+ */
+bool nnue_loaded();
+
+/**
+ * @brief Rebuild both accumulators of a position from scratch.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ */
+void nnue_refresh(ChessBitboards *bbs);
+
+/**
+ * @brief Update the accumulators for a move whose pieces have already been
+ * moved on the bitboards (called by engine_make()).
+ *
+ * @param bbs: The ChessBitboards object the move was made on.
+ * @param moving: Piece code of the moving piece.
+ * @param captured: Piece code of the captured piece (0 if none).
+ * @param placed: Piece code that lands on `to_pos` (differs on promotions).
+ * @param from_pos: The square the piece left.
+ * @param to_pos: The square the piece landed on.
+ */
+void nnue_make(ChessBitboards *bbs, unsigned char moving,
+               unsigned char captured, unsigned char placed,
+               unsigned int from_pos, unsigned int to_pos);
+
+/**
+ * @brief Reverse nnue_make() before the pieces are moved back (called by
+ * engine_unmake()). The dirty flags are restored by the caller.
+ *
+ * @param bbs, moving, captured, placed, from_pos, to_pos: As passed to
+ * nnue_make().
+ */
+void nnue_unmake(ChessBitboards *bbs, unsigned char moving,
+                 unsigned char captured, unsigned char placed,
+                 unsigned int from_pos, unsigned int to_pos);
+
+/**
+ * @brief Evaluate a position with the loaded network, rebuilding dirty
+ * accumulators first.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @return The score, positive when white is better.
+ */
+int nnue_evaluate(ChessBitboards *bbs);
+
+/**
+ * @brief Walk the legal move tree of a position and check that the
+ * incrementally updated accumulators match rebuilt ones, and that every
+ * supported backend gives the same score.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @param depth: The number of half-moves to expand.
+ * @param color: The color to move.
+ * @return true if everything matched.
+ */
+bool nnue_verify(ChessBitboards *bbs, unsigned int depth,
+                 enum PieceColor color);
+
+#endif // NNUE_EVAL
+
+#endif // NNUE_H
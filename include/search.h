@@ -3,22 +3,143 @@
 
 #include "bitboard.h"
 #include "engine.h"
+#include <stddef.h>
+
+/// Score of a checkmate (adjusted by remaining depth, so faster mates score
+/// higher). Positive when white mates.
+#define MATE_SCORE 9999900
+
+/// Deepest search supported; also the size of the per-ply position stack.
+#define MAX_SEARCH_DEPTH 64
 
 typedef struct {
   move_info_t best_move;
   int eval;
 } EvalResult;
 
+/// Evaluation cache counters (see search_eval_cache_stats()).
+typedef struct {
+  unsigned long long probes;
+  unsigned long long hits;
+} EvalCacheStats;
+
+/// A progress report of search_iterative(): after a completed depth, or on
+/// the timer while one is searched.
+typedef struct {
+  unsigned int depth;    // depth being searched, or completed
+  unsigned int seldepth; // deepest ply reached so far, at least depth
+  bool complete;         // the depth is done; score and pv are set
+  int score;             // from the side to move's view
+  int mate;              // moves to mate when the score is one (negative when
+                         // the side to move gets mated), 0 otherwise
+  unsigned long long nodes;
+  unsigned long long nps;
+  unsigned long long time_ms;
+  unsigned int hashfull;       // transposition table use, in permill
+  move_info_t currmove;        // root move being searched (timer reports)
+  unsigned int currmovenumber; // 1-based number of currmove
+  move_info_t pv[MAX_SEARCH_DEPTH];
+  unsigned int pv_len;
+} SearchInfo;
+
+/// Receives the reports of search_iterative().
+typedef void (*SearchInfoCallback)(const SearchInfo *info, void *data);
+
+/**
+ * @brief Allocate the transposition table and the evaluation cache, and reset
+ * the history table.
+ *
+ * @param tt_size_mb: The transposition table size in megabytes (rounded down
+ * to a power of two number of entries).
+ * @param eval_cache_kb: The evaluation cache size in kilobytes (rounded down
+ * to a power of two number of entries); 0 disables the cache.
+ */
+void search_init(size_t tt_size_mb, size_t eval_cache_kb);
+
+/**
+ * @brief Clear the transposition table, the evaluation cache and the history
+ * table (i.e., for a new game).
+ */
+void search_clear();
+
+/**
+ * @brief Free the transposition table and the evaluation cache.
+ */
+void search_cleanup();
+
+/**
+ * @brief Set the positions of the game before the root that the search treats
+ * as drawn by repetition.
+ *
+ * @param keys: Node keys of the positions (bbs->hash, XORed with
+ * ZOBRIST_BLACK_TO_MOVE when black is to move). Not copied: they must stay
+ * valid until the next call.
+ * @param len: The number of keys, 0 to detect no repetitions.
+ */
+void search_set_history(const unsigned long long *keys, size_t len);
+
 /**
  * @brief Perform a Minimax search of a certain depth.
  *
  * @param bbs: An existing ChessBitboards object.
- * @param magic: An existing MagicInfo object.
  * @param depth: The number of half-moves to search.
  * @param turn: the color whose turn it is to move.
  * @return An EvalResult with the best move and its evaluation value.
+ * NOTE: The transposition and history tables are kept between calls, so
+ * searching related positions one after another is cheaper.
  */
-EvalResult search(ChessBitboards *bbs, MagicInfo *magic, unsigned int depth,
+EvalResult search(ChessBitboards *bbs, unsigned int depth,
                   enum PieceColor turn);
 
+/**
+ * @brief Perform a Minimax search of a certain depth like search(), and also
+ * score one root move at the same depth as the others.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @param depth: The number of half-moves to search.
+ * @param turn: the color whose turn it is to move.
+ * @param move: A legal move of the position.
+ * @param move_eval: Set to the exact evaluation of `move`.
+ * @return An EvalResult with the best move and its evaluation value.
+ * NOTE: Transposition table entries of earlier searches only supply their
+ * moves here. Without a quiescence search, a deeper score swings with the
+ * parity of its depth, and the position after `move` is typically the root of
+ * the previous search; its scores would not compare with the other moves'.
+ */
+EvalResult search_scoring_move(ChessBitboards *bbs, unsigned int depth,
+                               enum PieceColor turn, move_info_t move,
+                               int *move_eval);
+
+/**
+ * @brief Search with iterative deepening: every depth from 1 up to `depth`,
+ * each starting from the transposition table the one before filled. Progress
+ * is reported after each completed depth, and on a timer in between.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @param depth: The last depth to search.
+ * @param turn: the color whose turn it is to move.
+ * @param interval_ms: Time between two timer reports (0 for none).
+ * @param callback: Called with every report.
+ * @param data: Passed to the callback.
+ * @return The EvalResult of the last depth.
+ */
+EvalResult search_iterative(ChessBitboards *bbs, unsigned int depth,
+                            enum PieceColor turn, unsigned int interval_ms,
+                            SearchInfoCallback callback, void *data);
+
+/**
+ * @brief Estimate how full the transposition table is.
+ *
+ * @return The share of the first thousand entries stored by the running (or
+ * last) search, in permill.
+ */
+unsigned int search_hashfull();
+
+/**
+ * @brief Get the evaluation cache counters of the last search().
+ *
+ * @return The number of cached evaluations looked up and found.
+ */
+EvalCacheStats search_eval_cache_stats();
+
 #endif // SEARCH_H
@@ -2,26 +2,24 @@
 #define UCI_H
 
 #include "bitboard.h"
-#include "magic_info.h"
 #include "utils.h"
+#include <stdio.h>
 
-void handle_uci_init(char *response, const int MAX_RESPONSE);
-void handle_position(Vec *tokens, ChessBitboards *bbs, char *response,
-                     const int MAX_RESPONSE);
-void handle_go(Vec *tokens, ChessBitboards *bbs, MagicInfo *magic,
-               char *response, const int MAX_RESPONSE);
+void handle_uci_init(FILE *out);
+void handle_position(const char *args, ChessBitboards *bbs, FILE *out);
+void handle_go(const char *args, ChessBitboards *bbs, FILE *out);
+void handle_bench(const char *args, FILE *out);
 
 /**
- * @brief Process a UCI command from a String object.
+ * @brief Process a UCI command line. The line is split into words in place,
+ * without copying it or allocating.
  *
- * @param cmd: The UCI command as a String
+ * @param cmd: The UCI command line (any length, a trailing newline is allowed).
  * @param bbs: An existing ChessBitboards reference.
- * @param magic: An existing MagicInfo reference.
- * @param response: The buffer to write the response.
- * @param MAX_RESPONSE: The max size of the response buffer.
+ * @param out: The stream the response is written to, line by line as it is
+ * produced (not flushed).
  * @return Returns -1 to simulate a "break" if in a loop, returns 0 otherwise.
  */
-int process_uci_command(String *cmd, ChessBitboards *bbs, MagicInfo *magic,
-                        char *response, const int MAX_RESPONSE);
+int process_uci_command(const char *cmd, ChessBitboards *bbs, FILE *out);
 
 #endif // UCI_H
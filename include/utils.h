@@ -18,6 +18,13 @@ typedef struct {
   size_t cap;
 } Vec;
 
+/// A read-only view of part of a string, i.e. one word of a line. It is not
+/// null-terminated and owns nothing.
+typedef struct {
+  const char *data;
+  size_t len;
+} StrView;
+
 typedef struct {
   String *board_str;
   Vec *moves;  
@@ -47,6 +54,11 @@ void str_free(String *str);
 /// Read a string from stdin to an existing String object
 void str_read_from_stdin(String *str, unsigned long maxlen);
 
+/// Read a whole line (of any length) from a file into a String, without the
+/// newline. The String's buffer, of capacity *cap, is reused and only grows
+/// when a longer line comes in. Returns false at the end of the file.
+bool str_read_line(String *str, size_t *cap, FILE *file);
+
 /// Check if a String equals a string literal
 bool str_eq(char *str, const char *other); 
 
@@ -56,6 +68,13 @@ void str_strip(String *str);
 /// Split a string into tokens (whitespace-separated words)
 Vec str_split(String *str);
 
+/// Get the next whitespace-separated word of a string as a view into it and
+/// advance *cursor past the word. Returns false when no word is left.
+bool str_next_word(const char **cursor, StrView *word);
+
+/// Check if a StrView equals a string literal
+bool strview_eq(StrView view, const char *other);
+
 /// Replace a String's contents with another string.
 /// This is useful if a string is intended to be mutable.
 void str_replace(String *str, char *new_str, size_t maxlen);
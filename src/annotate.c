@@ -0,0 +1,521 @@
+#include "annotate.h"
+#include "bitboard.h"
+#include "engine.h"
+#include "search.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_FEN "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
+
+#define MAX_TOKEN 128
+#define MAX_FEN 128
+
+// Centipawn losses (from the mover's point of view) for each flag
+#define INACCURACY_LOSS 50
+#define MISTAKE_LOSS 100
+#define BLUNDER_LOSS 300
+
+// Scores are capped before computing losses so a missed mate is a large but
+// finite loss.
+#define LOSS_SCORE_CAP 10000
+
+// annotate_verify(): a game whose twentieth ply (10...Qxb2) loses the queen
+// for a pawn, and the search depth that must see it
+#define VERIFY_GAME                                                            \
+  "1. d4 d5 2. c4 e6 3. Nc3 Nf6 4. Bg5 Be7 5. e3 Nbd7 6. Nf3 Ne4 7. Bxe7 "     \
+  "Qxe7 8. Nxe4 dxe4 9. Nd2 Qb4 10. Qc2 Qxb2 11. Qxb2 *"
+#define VERIFY_DEPTH 4
+#define VERIFY_BLUNDER_PLY 20
+
+typedef struct {
+  const char *start;
+  size_t len;
+} Token;
+
+typedef struct {
+  move_info_t move;
+  UndoInfo undo;
+  enum PieceColor turn;
+  int played_score; // score after the played move
+  move_info_t best_move;
+  int best_score; // score of the position before the move
+} AnnotatedPly;
+
+/// Append a token to a growing array of tokens.
+void __push_token(Token **tokens, size_t *len, size_t *cap, const char *start,
+                  size_t token_len) {
+  if (*len == *cap) {
+    *cap = *cap ? *cap * 2 : 64;
+    *tokens = (Token *)realloc(*tokens, *cap * sizeof(Token));
+    if (!*tokens) {
+      fprintf(stderr, "Cannot allocate annotation tokens.\n");
+      exit(1);
+    }
+  }
+  (*tokens)[(*len)++] = (Token){.start = start, .len = token_len};
+}
+
+/// Advance past whitespace.
+const char *__skip_space(const char *p) {
+  while (*p && isspace((unsigned char)*p)) {
+    p++;
+  }
+  return p;
+}
+
+/// Length of the whitespace-delimited word at p.
+size_t __word_len(const char *p) {
+  size_t len = 0;
+  while (p[len] && !isspace((unsigned char)p[len])) {
+    len++;
+  }
+  return len;
+}
+
+/**
+ * @brief Split a game into move tokens and find its starting FEN.
+ *
+ * @param game: The game text (UCI position command or PGN).
+ * @param fen: Buffer receiving the starting FEN.
+ * @param tokens: Set to a heap-allocated array of move tokens (must be freed).
+ * @param num_tokens: Set to the number of tokens.
+ */
+void __tokenize_game(const char *game, char *fen, Token **tokens,
+                     size_t *num_tokens) {
+  size_t cap = 0;
+  *tokens = NULL;
+  *num_tokens = 0;
+  snprintf(fen, MAX_FEN, "%s", DEFAULT_FEN);
+
+  const char *p = __skip_space(game);
+
+  if (strncmp(p, "position", 8) == 0) {
+    // UCI form: position [startpos | fen <fen>] [moves <m1> <m2> ...]
+    p = __skip_space(p + 8);
+    if (strncmp(p, "fen", 3) == 0) {
+      p = __skip_space(p + 3);
+      size_t fen_len = 0;
+      while (*p && strncmp(p, "moves", 5) != 0) {
+        size_t len = __word_len(p);
+        if (fen_len + len + 2 < MAX_FEN) {
+          if (fen_len > 0)
+            fen[fen_len++] = ' ';
+          memcpy(fen + fen_len, p, len);
+          fen_len += len;
+        }
+        p = __skip_space(p + len);
+      }
+      fen[fen_len] = '\0';
+    } else if (strncmp(p, "startpos", 8) == 0) {
+      p = __skip_space(p + 8);
+    }
+    if (strncmp(p, "moves", 5) == 0) {
+      p = __skip_space(p + 5);
+      while (*p) {
+        size_t len = __word_len(p);
+        __push_token(tokens, num_tokens, &cap, p, len);
+        p = __skip_space(p + len);
+      }
+    }
+    return;
+  }
+
+  // PGN form
+  while (*p) {
+    if (*p == '[') {
+      // Tag pair; only the FEN tag matters
+      const char *end = strchr(p, ']');
+      if (strncmp(p, "[FEN \"", 6) == 0) {
+        const char *value = p + 6;
+        const char *quote = strchr(value, '"');
+        if (quote && (!end || quote < end)) {
+          snprintf(fen, MAX_FEN, "%.*s", (int)(quote - value), value);
+        }
+      }
+      p = end ? end + 1 : p + strlen(p);
+    } else if (*p == '{') {
+      const char *end = strchr(p, '}');
+      p = end ? end + 1 : p + strlen(p);
+    } else if (*p == ';') {
+      const char *end = strchr(p, '\n');
+      p = end ? end + 1 : p + strlen(p);
+    } else if (*p == '(') {
+      // Variations may nest
+      int level = 0;
+      do {
+        if (*p == '(')
+          level++;
+        else if (*p == ')')
+          level--;
+        p++;
+      } while (*p && level > 0);
+    } else if (*p == '$') {
+      p += __word_len(p);
+    } else {
+      size_t len = 0;
+      while (p[len] && !isspace((unsigned char)p[len]) &&
+             !strchr("[]{}();", p[len])) {
+        len++;
+      }
+
+      // Strip move numbers ("12." / "12..." / "12.e4")
+      const char *token = p;
+      size_t token_len = len;
+      if (isdigit((unsigned char)*token) && memchr(token, '.', len)) {
+        while (token_len > 0 &&
+               (isdigit((unsigned char)*token) || *token == '.')) {
+          token++;
+          token_len--;
+        }
+      }
+
+      // Game termination markers end the movetext
+      if ((len == 3 && (strncmp(p, "1-0", 3) == 0 || strncmp(p, "0-1", 3) == 0)) ||
+          (len == 7 && strncmp(p, "1/2-1/2", 7) == 0) ||
+          (len == 1 && *p == '*')) {
+        break;
+      }
+
+      if (token_len > 0) {
+        __push_token(tokens, num_tokens, &cap, token, token_len);
+      }
+      p += len;
+    }
+    p = __skip_space(p);
+  }
+}
+
+/// Check that a pseudo-legal move does not leave the mover in check.
+bool __is_legal(ChessBitboards *bbs, move_info_t move, enum PieceColor turn) {
+  UndoInfo undo;
+  engine_make(bbs, move, &undo);
+  bool legal = !engine_color_in_check(bbs, turn);
+  engine_unmake(bbs, move, &undo);
+  return legal;
+}
+
+/**
+ * @brief Find the legal move matching a move in standard algebraic notation
+ * (i.e., Nf3, exd5, Raxe1+, e8=Q).
+ *
+ * @return true if exactly one legal move matches.
+ */
+bool __parse_san(ChessBitboards *bbs, const char *san,
+                 enum PieceColor turn, move_info_t *move) {
+  char squares[MAX_TOKEN];
+  size_t len = 0;
+  enum PieceType type = PAWN;
+
+  const char *p = san;
+  if (*p == 'O' || *p == '0') {
+    return false; // castling is not supported by the engine
+  }
+  switch (*p) {
+  case 'N':
+    type = KNIGHT;
+    break;
+  case 'B':
+    type = BISHOP;
+    break;
+  case 'R':
+    type = ROOK;
+    break;
+  case 'Q':
+    type = QUEEN;
+    break;
+  case 'K':
+    type = KING;
+    break;
+  }
+  if (type != PAWN) {
+    p++;
+  }
+
+  // Keep only the disambiguation and destination characters
+  for (; *p && len < MAX_TOKEN - 1; p++) {
+    if (*p == '=' || *p == '+' || *p == '#' || *p == '!' || *p == '?') {
+      break;
+    }
+    if (*p != 'x' && *p != '-') {
+      squares[len++] = *p;
+    }
+  }
+  squares[len] = '\0';
+
+  // Promotion piece, either "e8=Q" or "e8Q". Only queening is supported.
+  char promotion = 0;
+  if (*p == '=') {
+    promotion = p[1];
+  } else if (len > 0 && strchr("QRBN", squares[len - 1])) {
+    promotion = squares[--len];
+    squares[len] = '\0';
+  }
+  if (promotion && promotion != 'Q') {
+    return false;
+  }
+
+  if (len < 2) {
+    return false;
+  }
+  char to_file = squares[len - 2];
+  char to_rank = squares[len - 1];
+  if (to_file < 'a' || to_file > 'h' || to_rank < '1' || to_rank > '8') {
+    return false;
+  }
+  unsigned int to_pos = (to_rank - '1') * 8 + (7 - (to_file - 'a'));
+
+  MoveArray moves;
+  engine_generate_pseudolegal_moves(bbs, &moves, turn);
+
+  unsigned int matches = 0;
+  for (unsigned int i = 0; i < moves.len; i++) {
+    move_info_t candidate = moves.moves[i];
+    unsigned int from_pos = GET_FROM_POS(candidate);
+    if (GET_TO_POS(candidate) != to_pos ||
+        engine_piece_at(bbs, from_pos).type != type) {
+      continue;
+    }
+
+    bool disambiguated = true;
+    for (size_t j = 0; j + 2 < len; j++) {
+      char c = squares[j];
+      if (c >= 'a' && c <= 'h' && (7 - from_pos % 8) != (unsigned int)(c - 'a'))
+        disambiguated = false;
+      if (c >= '1' && c <= '8' && from_pos / 8 != (unsigned int)(c - '1'))
+        disambiguated = false;
+    }
+    if (!disambiguated || !__is_legal(bbs, candidate, turn)) {
+      continue;
+    }
+
+    *move = candidate;
+    matches++;
+  }
+
+  return matches == 1;
+}
+
+/// Parse a move token in either long algebraic notation or SAN.
+bool __parse_game_move(ChessBitboards *bbs, const char *token,
+                       enum PieceColor turn, move_info_t *move) {
+  size_t len = strlen(token);
+  bool long_algebraic =
+      (len == 4 || len == 5) && token[0] >= 'a' && token[0] <= 'h' &&
+      isdigit((unsigned char)token[1]) && token[2] >= 'a' && token[2] <= 'h' &&
+      isdigit((unsigned char)token[3]);
+
+  if (long_algebraic) {
+    return engine_parse_move(bbs, token, turn, move) &&
+           __is_legal(bbs, *move, turn);
+  }
+  return __parse_san(bbs, token, turn, move);
+}
+
+/// Clamp a score for loss computation.
+int __cap_score(int score) {
+  if (score > LOSS_SCORE_CAP)
+    return LOSS_SCORE_CAP;
+  if (score < -LOSS_SCORE_CAP)
+    return -LOSS_SCORE_CAP;
+  return score;
+}
+
+/**
+ * @brief annotate_game(), also returning the flag of each ply.
+ *
+ * @param flags: Filled with the flag of each ply in game order (may be NULL).
+ * @param max_flags: The number of flags `flags` can hold.
+ * @return 0 on success, -1 if a move could not be parsed or is illegal.
+ */
+int __annotate_game(ChessBitboards *bbs, const char *game, unsigned int depth,
+                    enum AnnotateFlag *flags, size_t max_flags) {
+  char fen[MAX_FEN];
+  Token *tokens;
+  size_t num_tokens;
+  __tokenize_game(game, fen, &tokens, &num_tokens);
+
+  FenState state;
+  enum FenError error = bb_parse_fen(bbs, &state, fen, NULL);
+  if (error != FEN_OK) {
+    fprintf(stderr, "Invalid starting FEN (%s): %s\n",
+            bb_fen_error_string(error), fen);
+    free(tokens);
+    return -1;
+  }
+  enum PieceColor turn = state.turn;
+
+  AnnotatedPly *plies = (AnnotatedPly *)calloc(
+      num_tokens > 0 ? num_tokens : 1, sizeof(AnnotatedPly));
+  if (!plies) {
+    fprintf(stderr, "Cannot allocate annotation plies.\n");
+    exit(1);
+  }
+
+  //
+  // Play the game forward, recording what is needed to take each move back
+  size_t num_plies = 0;
+  for (size_t i = 0; i < num_tokens; i++) {
+    char token[MAX_TOKEN];
+    snprintf(token, MAX_TOKEN, "%.*s", (int)tokens[i].len, tokens[i].start);
+
+    move_info_t move;
+    if (!__parse_game_move(bbs, token, turn, &move)) {
+      fprintf(stderr, "Illegal or unsupported move at ply %zu: %s\n",
+              num_plies + 1, token);
+      free(tokens);
+      free(plies);
+      return -1;
+    }
+
+    AnnotatedPly *ply = &plies[num_plies++];
+    ply->move = move;
+    ply->turn = turn;
+    engine_make(bbs, move, &ply->undo);
+    turn = turn == WHITE ? BLACK : WHITE;
+  }
+
+  clock_t start = clock();
+
+  //
+  // Walk backwards; each search reuses the tables warmed by the one before.
+  // The played move is scored by the same search as the engine's best move,
+  // so both are compared at the same depth.
+  for (size_t i = num_plies; i-- > 0;) {
+    AnnotatedPly *ply = &plies[i];
+    engine_unmake(bbs, ply->move, &ply->undo);
+
+    EvalResult res = search_scoring_move(bbs, depth, ply->turn, ply->move,
+                                         &ply->played_score);
+    ply->best_move = res.best_move;
+    ply->best_score = res.eval;
+  }
+
+  double elapsed_ms = (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+
+  //
+  // Output in game order
+  unsigned int blunders = 0, mistakes = 0, inaccuracies = 0;
+  for (size_t i = 0; i < num_plies; i++) {
+    AnnotatedPly *ply = &plies[i];
+    int best = __cap_score(ply->best_score);
+    int played = __cap_score(ply->played_score);
+    int loss = ply->turn == WHITE ? best - played : played - best;
+    if (loss < 0)
+      loss = 0;
+
+    enum AnnotateFlag flag = ANNOTATE_NONE;
+    const char *flag_name = "none";
+    if (loss >= BLUNDER_LOSS) {
+      flag = ANNOTATE_BLUNDER;
+      flag_name = "blunder";
+      blunders++;
+    } else if (loss >= MISTAKE_LOSS) {
+      flag = ANNOTATE_MISTAKE;
+      flag_name = "mistake";
+      mistakes++;
+    } else if (loss >= INACCURACY_LOSS) {
+      flag = ANNOTATE_INACCURACY;
+      flag_name = "inaccuracy";
+      inaccuracies++;
+    }
+    if (flags && i < max_flags) {
+      flags[i] = flag;
+    }
+
+    String played_str = move_info_to_chess_notation(ply->move);
+    String best_str = move_info_to_chess_notation(ply->best_move);
+    printf("annotate ply %zu side %s move %s score %d best %s bestscore %d "
+           "loss %d flag %s\n",
+           i + 1, ply->turn == WHITE ? "white" : "black", played_str.data,
+           ply->played_score, best_str.data, ply->best_score, loss,
+           flag_name);
+    str_free(&played_str);
+    str_free(&best_str);
+  }
+  printf("annotate plies %zu depth %u time %.0f ms blunders %u mistakes %u "
+         "inaccuracies %u\n",
+         num_plies, depth, elapsed_ms, blunders, mistakes, inaccuracies);
+
+  free(tokens);
+  free(plies);
+  return 0;
+}
+
+/**
+ * @brief Annotate a finished game, printing one line per ply with the score
+ * of the played move, the engine's best move and a blunder flag.
+ *
+ * The game is walked backwards from the final position so that the search of
+ * each position reuses the transposition and history tables filled by the
+ * position after it. The played move is scored by the same search as the
+ * best move, so both are compared at the same depth.
+ *
+ * @param bbs: An existing ChessBitboards object (engine_setup() must have
+ * been called).
+ * @param game: Either a UCI position command (i.e., "position startpos moves
+ * e2e4 e7e5") or PGN movetext (tags, comments and move numbers are allowed;
+ * a [FEN "..."] tag sets the starting position).
+ * @param depth: The search depth (half-moves) used for every position.
+ * @return 0 on success, -1 if a move could not be parsed or is illegal.
+ */
+int annotate_game(ChessBitboards *bbs, const char *game, unsigned int depth) {
+  return __annotate_game(bbs, game, depth, NULL, 0);
+}
+
+/**
+ * @brief Annotate a short game with a known blunder and check the flags: the
+ * blunder must be flagged, and the moves that follow the engine's own line
+ * must not be.
+ *
+ * @param bbs: An existing ChessBitboards object (engine_setup() must have
+ * been called).
+ * @return true if the flags are as expected.
+ */
+bool annotate_verify(ChessBitboards *bbs) {
+  enum AnnotateFlag flags[VERIFY_BLUNDER_PLY + 1];
+  search_clear();
+  if (__annotate_game(bbs, VERIFY_GAME, VERIFY_DEPTH, flags,
+                      VERIFY_BLUNDER_PLY + 1) != 0) {
+    return false;
+  }
+  // 9...Qb4 and the recapture 11. Qxb2 are the engine's choices at this depth
+  return flags[VERIFY_BLUNDER_PLY - 1] == ANNOTATE_BLUNDER &&
+         flags[VERIFY_BLUNDER_PLY] == ANNOTATE_NONE &&
+         flags[VERIFY_BLUNDER_PLY - 3] == ANNOTATE_NONE;
+}
+
+/**
+ * @brief Read a game from a file and annotate it with annotate_game().
+ *
+ * @param bbs: An existing ChessBitboards object (engine_setup() must have
+ * been called).
+ * @param path: The path of the file holding the game.
+ * @param depth: The search depth (half-moves) used for every position.
+ * @return 0 on success, -1 on failure.
+ */
+int annotate_file(ChessBitboards *bbs, const char *path, unsigned int depth) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    fprintf(stderr, "Unable to read file %s\n", path);
+    return -1;
+  }
+
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+
+  char *game = (char *)calloc(size + 1, sizeof(char));
+  if (!game || fread(game, 1, size, fp) != (size_t)size) {
+    fprintf(stderr, "Unable to read file %s\n", path);
+    fclose(fp);
+    free(game);
+    return -1;
+  }
+  fclose(fp);
+
+  int status = annotate_game(bbs, game, depth);
+  free(game);
+  return status;
+}
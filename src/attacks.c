@@ -0,0 +1,341 @@
+#include "attacks.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_AVX2 1
+#include <immintrin.h>
+#else
+#define HAVE_AVX2 0
+#endif
+
+#ifdef __wasm_simd128__
+#define HAVE_SIMD128 1
+#include <wasm_simd128.h>
+#else
+#define HAVE_SIMD128 0
+#endif
+
+// A square is bit rank * 8 + (7 - file), so shifting left moves towards the
+// a-file and up the board. Each direction is a shift plus a mask that removes
+// the squares a shift would wrap onto from the other edge of the board.
+#define NOT_FILE_A (~FILE_A_MASK)
+#define NOT_FILE_H (~FILE_H_MASK)
+
+//
+// Scalar
+
+/// Shift left by `shift` if it is positive, right by `-shift` otherwise.
+static inline BITBOARD __shift(BITBOARD bb, int shift) {
+  return shift > 0 ? bb << shift : bb >> -shift;
+}
+
+/**
+ * @brief Kogge-Stone occluded fill in one direction: the squares attacked by
+ * `gen` sliding through `empty` squares.
+ *
+ * @param gen: The sliders.
+ * @param empty: The empty squares.
+ * @param shift: The direction, as a shift of one step.
+ * @param wrap: The squares a step may land on without wrapping around.
+ */
+static inline BITBOARD __fill(BITBOARD gen, BITBOARD empty, int shift,
+                              BITBOARD wrap) {
+  BITBOARD pro = empty & wrap;
+  gen |= pro & __shift(gen, shift);
+  pro &= __shift(pro, shift);
+  gen |= pro & __shift(gen, 2 * shift);
+  pro &= __shift(pro, 2 * shift);
+  gen |= pro & __shift(gen, 4 * shift);
+  return __shift(gen, shift) & wrap;
+}
+
+BITBOARD __sliders_scalar(BITBOARD straight, BITBOARD diagonal,
+                          BITBOARD empty) {
+  return __fill(straight, empty, 8, ~0ULL) |       // north
+         __fill(straight, empty, -8, ~0ULL) |      // south
+         __fill(straight, empty, 1, NOT_FILE_H) |  // west
+         __fill(straight, empty, -1, NOT_FILE_A) | // east
+         __fill(diagonal, empty, 9, NOT_FILE_H) |  // north-west
+         __fill(diagonal, empty, 7, NOT_FILE_A) |  // north-east
+         __fill(diagonal, empty, -7, NOT_FILE_H) | // south-west
+         __fill(diagonal, empty, -9, NOT_FILE_A);  // south-east
+}
+
+//
+// AVX2
+// Each 64-bit lane holds one direction. A lane shifts left by its entry in
+// the left counts and right by its entry in the right counts; a count of 64
+// or more gives 0, so every lane shifts one way only.
+
+#if HAVE_AVX2
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 __m256i __shift_avx2(__m256i v, __m256i left,
+                                        __m256i right) {
+  return _mm256_or_si256(_mm256_sllv_epi64(v, left),
+                         _mm256_srlv_epi64(v, right));
+}
+
+/// __fill() for four directions at once.
+static inline AVX2 __m256i __fill_avx2(__m256i gen, __m256i empty,
+                                       __m256i wrap, __m256i left,
+                                       __m256i right) {
+  __m256i left2 = _mm256_add_epi64(left, left);
+  __m256i right2 = _mm256_add_epi64(right, right);
+  __m256i left4 = _mm256_add_epi64(left2, left2);
+  __m256i right4 = _mm256_add_epi64(right2, right2);
+
+  __m256i pro = _mm256_and_si256(empty, wrap);
+  gen = _mm256_or_si256(
+      gen, _mm256_and_si256(pro, __shift_avx2(gen, left, right)));
+  pro = _mm256_and_si256(pro, __shift_avx2(pro, left, right));
+  gen = _mm256_or_si256(
+      gen, _mm256_and_si256(pro, __shift_avx2(gen, left2, right2)));
+  pro = _mm256_and_si256(pro, __shift_avx2(pro, left2, right2));
+  gen = _mm256_or_si256(
+      gen, _mm256_and_si256(pro, __shift_avx2(gen, left4, right4)));
+  return _mm256_and_si256(__shift_avx2(gen, left, right), wrap);
+}
+
+AVX2 BITBOARD __sliders_avx2(BITBOARD straight, BITBOARD diagonal,
+                             BITBOARD empty) {
+  // Lanes (low to high): north, south, west, east
+  const __m256i STRAIGHT_LEFT = _mm256_setr_epi64x(8, 64, 1, 64);
+  const __m256i STRAIGHT_RIGHT = _mm256_setr_epi64x(64, 8, 64, 1);
+  const __m256i STRAIGHT_WRAP =
+      _mm256_setr_epi64x(~0LL, ~0LL, NOT_FILE_H, NOT_FILE_A);
+  // Lanes: north-west, north-east, south-west, south-east
+  const __m256i DIAGONAL_LEFT = _mm256_setr_epi64x(9, 7, 64, 64);
+  const __m256i DIAGONAL_RIGHT = _mm256_setr_epi64x(64, 64, 7, 9);
+  const __m256i DIAGONAL_WRAP =
+      _mm256_setr_epi64x(NOT_FILE_H, NOT_FILE_A, NOT_FILE_H, NOT_FILE_A);
+
+  __m256i empty_v = _mm256_set1_epi64x(empty);
+  __m256i attacks = _mm256_or_si256(
+      __fill_avx2(_mm256_set1_epi64x(straight), empty_v, STRAIGHT_WRAP,
+                  STRAIGHT_LEFT, STRAIGHT_RIGHT),
+      __fill_avx2(_mm256_set1_epi64x(diagonal), empty_v, DIAGONAL_WRAP,
+                  DIAGONAL_LEFT, DIAGONAL_RIGHT));
+
+  // OR the four lanes together
+  __m128i half = _mm_or_si128(_mm256_castsi256_si128(attacks),
+                              _mm256_extracti128_si256(attacks, 1));
+  return _mm_cvtsi128_si64(_mm_or_si128(half, _mm_unpackhi_epi64(half, half)));
+}
+#endif
+
+//
+// WASM SIMD128
+// Each vector holds two opposite directions that shift by the same amount:
+// lane 0 shifts left, lane 1 right.
+
+#if HAVE_SIMD128
+static inline v128_t __shift_simd128(v128_t v, unsigned int shift) {
+  const v128_t LEFT_LANE = wasm_i64x2_make(-1, 0);
+  return wasm_v128_bitselect(wasm_i64x2_shl(v, shift),
+                             wasm_u64x2_shr(v, shift), LEFT_LANE);
+}
+
+/// __fill() for two directions at once.
+static inline v128_t __fill_simd128(v128_t gen, v128_t empty, v128_t wrap,
+                                    unsigned int shift) {
+  v128_t pro = wasm_v128_and(empty, wrap);
+  gen = wasm_v128_or(gen, wasm_v128_and(pro, __shift_simd128(gen, shift)));
+  pro = wasm_v128_and(pro, __shift_simd128(pro, shift));
+  gen =
+      wasm_v128_or(gen, wasm_v128_and(pro, __shift_simd128(gen, 2 * shift)));
+  pro = wasm_v128_and(pro, __shift_simd128(pro, 2 * shift));
+  gen =
+      wasm_v128_or(gen, wasm_v128_and(pro, __shift_simd128(gen, 4 * shift)));
+  return wasm_v128_and(__shift_simd128(gen, shift), wrap);
+}
+
+BITBOARD __sliders_simd128(BITBOARD straight, BITBOARD diagonal,
+                           BITBOARD empty) {
+  v128_t empty_v = wasm_i64x2_splat(empty);
+  v128_t straight_v = wasm_i64x2_splat(straight);
+  v128_t diagonal_v = wasm_i64x2_splat(diagonal);
+
+  v128_t attacks = wasm_v128_or(
+      wasm_v128_or(
+          // north, south
+          __fill_simd128(straight_v, empty_v, wasm_i64x2_splat(~0LL), 8),
+          // west, east
+          __fill_simd128(straight_v, empty_v,
+                         wasm_i64x2_make(NOT_FILE_H, NOT_FILE_A), 1)),
+      wasm_v128_or(
+          // north-west, south-east
+          __fill_simd128(diagonal_v, empty_v,
+                         wasm_i64x2_make(NOT_FILE_H, NOT_FILE_A), 9),
+          // north-east, south-west
+          __fill_simd128(diagonal_v, empty_v,
+                         wasm_i64x2_make(NOT_FILE_A, NOT_FILE_H), 7)));
+  return wasm_i64x2_extract_lane(attacks, 0) |
+         wasm_i64x2_extract_lane(attacks, 1);
+}
+#endif
+
+//
+// Backend Selection
+
+static enum AttackBackend ATTACK_BACKEND = ATTACKS_SCALAR;
+static BITBOARD (*SLIDER_ATTACKS)(BITBOARD, BITBOARD,
+                                  BITBOARD) = __sliders_scalar;
+
+/**
+ * @brief Determine if an attack backend can be used by this build and CPU.
+ *
+ * @param backend: The backend in question.
+ * @return true if attacks_set_backend(backend) can be used.
+ */
+bool attacks_backend_supported(enum AttackBackend backend) {
+  switch (backend) {
+  case ATTACKS_SCALAR:
+    return true;
+  case ATTACKS_AVX2:
+#if HAVE_AVX2
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+  case ATTACKS_SIMD128:
+    return HAVE_SIMD128;
+  }
+  return false;
+}
+
+/**
+ * @brief Use a backend for the slider fills.
+ *
+ * @param backend: The backend to switch to.
+ * @return false if the backend is not supported (the current one is kept),
+ * true otherwise.
+ */
+bool attacks_set_backend(enum AttackBackend backend) {
+  if (!attacks_backend_supported(backend)) {
+    return false;
+  }
+  SLIDER_ATTACKS = __sliders_scalar;
+#if HAVE_AVX2
+  if (backend == ATTACKS_AVX2) {
+    SLIDER_ATTACKS = __sliders_avx2;
+  }
+#endif
+#if HAVE_SIMD128
+  if (backend == ATTACKS_SIMD128) {
+    SLIDER_ATTACKS = __sliders_simd128;
+  }
+#endif
+  ATTACK_BACKEND = backend;
+  return true;
+}
+
+/**
+ * @brief Get the attack backend in use.
+ *
+ * @return The current AttackBackend.
+ */
+enum AttackBackend attacks_backend() { return ATTACK_BACKEND; }
+
+/**
+ * @brief Use the fastest supported attack backend (called by engine_setup()).
+ */
+void attacks_setup() {
+  if (!attacks_set_backend(ATTACKS_AVX2) &&
+      !attacks_set_backend(ATTACKS_SIMD128)) {
+    attacks_set_backend(ATTACKS_SCALAR);
+  }
+}
+
+//
+// Attack Sets
+
+/**
+ * @brief Squares attacked by a set of sliders.
+ *
+ * @param straight: Pieces that move along ranks and files (rooks, queens).
+ * @param diagonal: Pieces that move along diagonals (bishops, queens).
+ * @param empty: The empty squares.
+ * @return Every square attacked by at least one of the pieces.
+ */
+BITBOARD attacks_sliders(BITBOARD straight, BITBOARD diagonal,
+                         BITBOARD empty) {
+  return SLIDER_ATTACKS(straight, diagonal, empty);
+}
+
+/**
+ * @brief Squares attacked by a set of knights.
+ *
+ * @param knights: The knights.
+ * @return Every square attacked by at least one of the knights.
+ */
+BITBOARD attacks_knights(BITBOARD knights) {
+  BITBOARD one = ((knights << 1) & NOT_FILE_H) | ((knights >> 1) & NOT_FILE_A);
+  BITBOARD two = ((knights << 2) & ~(FILE_G_MASK | FILE_H_MASK)) |
+                 ((knights >> 2) & ~(FILE_A_MASK | FILE_B_MASK));
+  return (one << 16) | (one >> 16) | (two << 8) | (two >> 8);
+}
+
+/**
+ * @brief Squares attacked by a set of kings.
+ *
+ * @param kings: The kings.
+ * @return Every square attacked by at least one of the kings.
+ */
+BITBOARD attacks_kings(BITBOARD kings) {
+  BITBOARD attacks =
+      ((kings << 1) & NOT_FILE_H) | ((kings >> 1) & NOT_FILE_A);
+  kings |= attacks;
+  return attacks | (kings << 8) | (kings >> 8);
+}
+
+/**
+ * @brief Squares attacked by a set of pawns.
+ *
+ * @param pawns: The pawns.
+ * @param color: The color of the pawns.
+ * @return Every square attacked by at least one of the pawns.
+ */
+BITBOARD attacks_pawns(BITBOARD pawns, enum PieceColor color) {
+  if (color == WHITE) {
+    return ((pawns << 9) & NOT_FILE_H) | ((pawns << 7) & NOT_FILE_A);
+  }
+  return ((pawns >> 7) & NOT_FILE_H) | ((pawns >> 9) & NOT_FILE_A);
+}
+
+/**
+ * @brief Squares attacked by all pieces of a color.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @param color: The attacking color.
+ * @return The attack map of the color.
+ */
+HOT_KERNEL BITBOARD attacks_by_color(const ChessBitboards *bbs,
+                                     enum PieceColor color) {
+  const BITBOARD *own = bbs->pieces[COLOR_INDEX(color)];
+  BITBOARD queens = own[PIECE_SLOT(QUEEN)];
+  return attacks_pawns(own[PIECE_SLOT(PAWN)], color) |
+         attacks_knights(own[PIECE_SLOT(KNIGHT)]) |
+         attacks_kings(own[PIECE_SLOT(KING)]) |
+         attacks_sliders(own[PIECE_SLOT(ROOK)] | queens,
+                         own[PIECE_SLOT(BISHOP)] | queens, ~bbs->all_pieces);
+}
+
+/**
+ * @brief Mobility of a color: the number of squares its knights, bishops,
+ * rooks and queens attack that are not occupied by its own pieces.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @param color: The color in question.
+ * @return The number of squares.
+ */
+HOT_KERNEL int attacks_mobility(const ChessBitboards *bbs,
+                                enum PieceColor color) {
+  unsigned int us = COLOR_INDEX(color);
+  const BITBOARD *own = bbs->pieces[us];
+  BITBOARD queens = own[PIECE_SLOT(QUEEN)];
+  BITBOARD attacks = attacks_knights(own[PIECE_SLOT(KNIGHT)]) |
+                     attacks_sliders(own[PIECE_SLOT(ROOK)] | queens,
+                                     own[PIECE_SLOT(BISHOP)] | queens,
+                                     ~bbs->all_pieces);
+  return __builtin_popcountll(attacks & ~bbs->occupancy[us]);
+}
@@ -1,12 +1,9 @@
 #include "bitboard.h"
-#include <ctype.h>
-#include <limits.h>
-#include <signal.h>
+#include "eval.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
 /// Print a Bitboard in binary representation
 void bb_print(BITBOARD bb) {
@@ -28,93 +25,6 @@ void bb_pretty_print(BITBOARD bb) {
   printf("\n");
 }
 
-/// General method for computing a Bitboard given a FEN string
-BITBOARD compute_initial_from_piece_char(char piece, char *fen) {
-  BITBOARD bb = 0;
-  unsigned int curr = 0;
-  for (unsigned int i = 0; fen[i] != ' '; i++) {
-    if (fen[i] == '/') {
-      continue;
-    }
-    if (fen[i] == piece) {
-      bb |= (1ULL << (63 - curr));
-    }
-    if (isdigit(fen[i])) {
-      int offset = fen[i] - '0';
-      curr += offset;
-    } else {
-      curr += 1;
-    }
-  }
-  return bb;
-}
-
-BITBOARD init_white_pawns(char *board_str) {
-  return compute_initial_from_piece_char('P', board_str);
-}
-
-BITBOARD init_white_bishops(char *board_str) {
-  return compute_initial_from_piece_char('B', board_str);
-}
-
-BITBOARD init_white_knights(char *board_str) {
-  return compute_initial_from_piece_char('N', board_str);
-}
-
-BITBOARD init_white_rooks(char *board_str) {
-  return compute_initial_from_piece_char('R', board_str);
-}
-
-BITBOARD init_white_queens(char *board_str) {
-  return compute_initial_from_piece_char('Q', board_str);
-}
-
-BITBOARD init_white_king(char *board_str) {
-  return compute_initial_from_piece_char('K', board_str);
-}
-
-BITBOARD init_black_pawns(char *board_str) {
-  return compute_initial_from_piece_char('p', board_str);
-}
-
-BITBOARD init_black_bishops(char *board_str) {
-  return compute_initial_from_piece_char('b', board_str);
-}
-
-BITBOARD init_black_knights(char *board_str) {
-  return compute_initial_from_piece_char('n', board_str);
-}
-
-BITBOARD init_black_rooks(char *board_str) {
-  return compute_initial_from_piece_char('r', board_str);
-}
-
-BITBOARD init_black_queens(char *board_str) {
-  return compute_initial_from_piece_char('q', board_str);
-}
-
-BITBOARD init_black_king(char *board_str) {
-  return compute_initial_from_piece_char('k', board_str);
-}
-
-BITBOARD init_white_pieces(ChessBitboards *bbs) {
-  return (BITBOARD)(bbs->white_pawns | bbs->white_bishops | bbs->white_knights |
-                    bbs->white_rooks | bbs->white_queens | bbs->white_king);
-}
-
-BITBOARD init_black_pieces(ChessBitboards *bbs) {
-  return (BITBOARD)(bbs->black_pawns | bbs->black_bishops | bbs->black_knights |
-                    bbs->black_rooks | bbs->black_queens | bbs->black_king);
-}
-
-BITBOARD init_all_pieces(ChessBitboards *bbs) {
-  return (BITBOARD)(bbs->white_pieces | bbs->black_pieces);
-}
-
-BITBOARD init_empty_squares(ChessBitboards *bbs) {
-  return (BITBOARD)(~bbs->all_pieces);
-}
-
 /// Get the bitboard for the moves of a knight at a position
 BITBOARD __get_knight_move_bb(unsigned int pos) {
   BITBOARD moves = 0;
@@ -164,17 +74,12 @@ BITBOARD __get_blocking_ray_mask(unsigned int pos) {
     int rank = pos / 8 + ray_dirs[i][0];
     int file = pos % 8 + ray_dirs[i][1];
 
-    while (rank >= 0 && rank < 8 && file >= 0 && file < 8) {
+    // Stop before the last position since it cannot be a "blocker"
+    while (rank + ray_dirs[i][0] >= 0 && rank + ray_dirs[i][0] < 8 &&
+           file + ray_dirs[i][1] >= 0 && file + ray_dirs[i][1] < 8) {
       mask |= 1ULL << (rank * 8 + file);
       rank += ray_dirs[i][0];
       file += ray_dirs[i][1];
-
-      // Remove the last position since it cannot be a "blocker"
-      int next_rank = rank + ray_dirs[i][0];
-      int next_file = file + ray_dirs[i][1];
-      if (next_rank < 0 || next_rank > 7 || next_file < 0 || next_file > 7) {
-        break;
-      }
     }
   }
   return mask;
@@ -189,20 +94,36 @@ BITBOARD __get_blocking_diag_mask(unsigned int pos) {
     int rank = pos / 8 + diag_dirs[i][0];
     int file = pos % 8 + diag_dirs[i][1];
 
-    while (rank >= 0 && rank < 8 && file >= 0 && file < 8) {
+    // Stop before the last position since it cannot be a "blocker"
+    while (rank + diag_dirs[i][0] >= 0 && rank + diag_dirs[i][0] < 8 &&
+           file + diag_dirs[i][1] >= 0 && file + diag_dirs[i][1] < 8) {
       mask |= 1ULL << (rank * 8 + file);
       rank += diag_dirs[i][0];
       file += diag_dirs[i][1];
+    }
+  }
+  return mask;
+}
 
-      // Remove the last position since it cannot be a "blocker"
-      int next_rank = rank + diag_dirs[i][0];
-      int next_file = file + diag_dirs[i][1];
-      if (next_rank < 0 || next_rank > 7 || next_file < 0 || next_file > 7) {
-        break;
+/// Get the squares of a line through a position, split into the squares
+/// below and above it. `dir` is one step along the line in {rank, file}.
+LineMask __get_line_mask(unsigned int pos, const int dir[2]) {
+  LineMask line = {0, 0};
+  for (int sign = -1; sign <= 1; sign += 2) {
+    int rank = pos / 8 + sign * dir[0];
+    int file = pos % 8 + sign * dir[1];
+    while (rank >= 0 && rank < 8 && file >= 0 && file < 8) {
+      BITBOARD square = 1ULL << (rank * 8 + file);
+      if (rank * 8 + file < (int)pos) {
+        line.lower |= square;
+      } else {
+        line.upper |= square;
       }
+      rank += sign * dir[0];
+      file += sign * dir[1];
     }
   }
-  return mask;
+  return line;
 }
 
 /**
@@ -238,281 +159,461 @@ BITBOARD __get_pawn_capture_mask(unsigned int pos, int capture_offsets[2]) {
   return capture_mask;
 }
 
-/// Initialize the ChessBitboards structure.
-void bb_init_chess_boards(ChessBitboards *bbs, char *board_str) {
-  bbs->white_pawns = init_white_pawns(board_str);
-  bbs->white_bishops = init_white_bishops(board_str);
-  bbs->white_knights = init_white_knights(board_str);
-  bbs->white_rooks = init_white_rooks(board_str);
-  bbs->white_queens = init_white_queens(board_str);
-  bbs->white_king = init_white_king(board_str);
-
-  bbs->black_pawns = init_black_pawns(board_str);
-  bbs->black_bishops = init_black_bishops(board_str);
-  bbs->black_knights = init_black_knights(board_str);
-  bbs->black_rooks = init_black_rooks(board_str);
-  bbs->black_queens = init_black_queens(board_str);
-  bbs->black_king = init_black_king(board_str);
-
-  //
-  // Cumulative bitboards
-  bbs->white_pieces = init_white_pieces(bbs);
-  bbs->black_pieces = init_black_pieces(bbs);
-  bbs->all_pieces = init_all_pieces(bbs);
-  bbs->empty_squares = init_empty_squares(bbs);
+//
+// Zobrist Hashing
 
-  //
-  // Precomputation tables
+unsigned long long ZOBRIST_PIECES[2][8][64];
+unsigned long long ZOBRIST_BLACK_TO_MOVE;
 
-  // Knights
-  for (unsigned int i = 0; i < 64; i++) {
-    bbs->knight_moves[i] = __get_knight_move_bb(i);
+/// Fill the Zobrist key tables once. A fixed xorshift seed keeps hashes
+/// identical between runs.
+void __init_zobrist() {
+  static bool initialized = false;
+  if (initialized) {
+    return;
   }
 
-  // Kings
-  for (unsigned int i = 0; i < 64; i++) {
-    bbs->king_moves[i] = __get_king_move_bb(i);
+  unsigned long long state = 0x9E3779B97F4A7C15ULL;
+  for (unsigned int c = 0; c < 2; c++) {
+    for (unsigned int t = PAWN; t <= KING; t++) {
+      for (unsigned int sq = 0; sq < 64; sq++) {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        ZOBRIST_PIECES[c][t][sq] = state * 0x2545F4914F6CDD1DULL;
+      }
+    }
   }
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  ZOBRIST_BLACK_TO_MOVE = state * 0x2545F4914F6CDD1DULL;
 
-  // Pawns
-  int white_capture_offsets[2] = {7, 9};
-  int black_capture_offsets[2] = {-7, -9};
-  for (unsigned int i = 0; i < 64; i++) {
-    bbs->white_pawn_captures[i] =
-        __get_pawn_capture_mask(i, white_capture_offsets);
-    bbs->black_pawn_captures[i] =
-        __get_pawn_capture_mask(i, black_capture_offsets);
-  }
+  initialized = true;
+}
 
-  // Get blocker masks for rooks/bishops... to be used in magic setup
-  for (unsigned int i = 0; i < 64; i++) {
-    bbs->rook_blocker_masks[i] = __get_blocking_ray_mask(i);
-    bbs->bishop_blocker_masks[i] = __get_blocking_diag_mask(i);
+/// XOR the keys of every piece in a bitboard into a hash.
+unsigned long long __hash_pieces(BITBOARD bb, unsigned int color_index,
+                                 enum PieceType type) {
+  unsigned long long hash = 0;
+  while (bb) {
+    unsigned int sq = POP_LSB(bb);
+    hash ^= ZOBRIST_PIECES[color_index][type][sq];
   }
+  return hash;
 }
 
-/// Set a bit to 1. NOTE: a1 is index 0, h8 is index 63.
-void set_bit(BITBOARD *bb, unsigned int pos) { *bb |= (1ULL << pos); }
-
-/// Clear a bit to 0. NOTE: a1 is index 0, h8 is index 63.
-void clear_bit(BITBOARD *bb, unsigned int pos) { *bb &= ~(1ULL << pos); }
-
-/// Toggle a bit. NOTE: a1 is index 0, h8 is index 63.
-void toggle_bit(BITBOARD *bb, unsigned int pos) { *bb ^= (1ULL << pos); }
-
-/// Check if a bit is set to 1 at a given position. NOTE: a1 is index 0, h8 is
-/// index 63.
-bool is_occupied(BITBOARD bb, unsigned int pos) {
-  return (bb & (1ULL << pos)) != 0;
+/**
+ * @brief Compute the Zobrist hash of the piece placement from scratch.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @return The hash of the position (side to move not included).
+ */
+unsigned long long bb_compute_hash(ChessBitboards *bbs) {
+  unsigned long long hash = 0;
+  for (unsigned int c = 0; c < 2; c++) {
+    for (unsigned int t = PAWN; t <= KING; t++) {
+      hash ^= __hash_pieces(bbs->pieces[c][PIECE_SLOT(t)], c, t);
+    }
+  }
+  return hash;
 }
 
-//
-// Magic Bitboards
-
-/// Generate random unsigned long long value.
-unsigned long long __ull_rand() {
-  unsigned long long rand_val = 0;
-  for (unsigned int i = 0; i < 64; i += 32) {
-    rand_val |= (unsigned long long)(rand()) << i;
-  }
-  return rand_val;
+/**
+ * @brief Compute the Zobrist hash of the pawns of both colors from scratch.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @return The pawn hash of the position (0 without pawns).
+ */
+unsigned long long bb_compute_pawn_hash(ChessBitboards *bbs) {
+  return __hash_pieces(bbs->pieces[0][PIECE_SLOT(PAWN)], 0, PAWN) ^
+         __hash_pieces(bbs->pieces[1][PIECE_SLOT(PAWN)], 1, PAWN);
 }
 
-typedef struct {
-  unsigned int first;
-  unsigned int second;
-} UInt_Tuple;
+/// Piece codes by FEN character (0 for anything that is not a piece).
+static const unsigned char FEN_PIECE_CODES[128] = {
+    ['P'] = PIECE_CODE(PAWN, WHITE),   ['p'] = PIECE_CODE(PAWN, BLACK),
+    ['B'] = PIECE_CODE(BISHOP, WHITE), ['b'] = PIECE_CODE(BISHOP, BLACK),
+    ['N'] = PIECE_CODE(KNIGHT, WHITE), ['n'] = PIECE_CODE(KNIGHT, BLACK),
+    ['R'] = PIECE_CODE(ROOK, WHITE),   ['r'] = PIECE_CODE(ROOK, BLACK),
+    ['Q'] = PIECE_CODE(QUEEN, WHITE),  ['q'] = PIECE_CODE(QUEEN, BLACK),
+    ['K'] = PIECE_CODE(KING, WHITE),   ['k'] = PIECE_CODE(KING, BLACK)};
+
+/// FEN characters by piece code.
+static const char PIECE_CODE_CHARS[16] = "?PBNRQK??pbnrqk?";
+
+/// Check for the end of a FEN field.
+static inline bool __is_field_end(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\0';
+}
 
-/// Returns a tuple where the first value is the
-/// index of the least-significant bit in a BITBOARD (i.e, in a mask),
-/// and the second value is the result of 'val' being right-shifted the minimum
-/// number of times until the lsb is popped.
-UInt_Tuple __pop_lsb(BITBOARD val) {
-  UInt_Tuple ret;
-  unsigned int idx = 0;
+/// Check for the end of the line holding a FEN.
+static inline bool __is_line_end(char c) {
+  return c == '\r' || c == '\n' || c == '\0';
+}
 
-  while ((val & 1) == 0) {
-    val >>= 1;
-    idx++;
+/// Advance past the blanks between two FEN fields.
+static inline const char *__skip_blanks(const char *p) {
+  while (*p == ' ' || *p == '\t') {
+    p++;
   }
-  val >>= 1;
-  idx++;
-
-  ret.first = idx;
-  ret.second = val;
-
-  return ret;
+  return p;
 }
 
-typedef struct {
-  BITBOARD *data;
-  unsigned int size;
-} DynArray;
-
-volatile sig_atomic_t terminate = 0;
-void __signal_handler(int signo) {
-  if (signo == SIGINT) {
-    terminate = 1;
+/// Put a piece on an empty square of a position being loaded, updating the
+/// bitboards, the mailbox, both hashes and the piece-square scores.
+static inline void __load_piece(ChessBitboards *bbs, unsigned char code,
+                                unsigned int sq) {
+  unsigned int color_index = PIECE_CODE_COLOR_INDEX(code);
+  enum PieceType type = PIECE_CODE_TYPE(code);
+  BITBOARD bb = 1ULL << sq;
+
+  bbs->pieces[color_index][PIECE_SLOT(type)] |= bb;
+  bbs->occupancy[color_index] |= bb;
+  BB_SET_CODE(bbs, sq, code);
+  bbs->hash ^= ZOBRIST_PIECES[color_index][type][sq];
+  if (type == PAWN) {
+    bbs->pawn_hash ^= ZOBRIST_PIECES[color_index][PAWN][sq];
   }
+  bbs->mg_score += EVAL_MG[code][sq];
+  bbs->eg_score += EVAL_EG[code][sq];
+  bbs->phase += EVAL_PHASE[code];
 }
 
-void compute_and_export_magics(BITBOARD *blocker_masks,
-                               const unsigned int MAX_INDICES, char *filename) {
-  // Magic number management
-  BITBOARD magics[64] = {0};
-  BITBOARD max_sizes[64];
-  memset(max_sizes, (BITBOARD)INT_MAX, 64 * sizeof(BITBOARD));
-  unsigned int max_bits[64] = {0}; // the number of bits needed per square
-
-  // Register the signal (Ctrl+C) to cleanup and force output magic output
-  // file
-  if (signal(SIGINT, __signal_handler) == SIG_ERR) {
-    perror("signal");
-    exit(1);
-  }
-
-  unsigned long long iterated_squares = 0;
-  unsigned long long iterations = 0;
-  unsigned int min_bits_found = 64;
-
-  // Setup blocker boards.
-  // occupancy_board = blocker_mask & occupancy
-  DynArray occupancy_boards[64];
-  memset(occupancy_boards, 0, 64 * sizeof(DynArray));
-  for (unsigned int i = 0; i < 64; i++) {
-    // Initialize the occupancy boards
-    BITBOARD num_occupancies = 1ULL << __builtin_popcountll(blocker_masks[i]);
-    if (!occupancy_boards[i].data) {
-      occupancy_boards[i].data =
-          (BITBOARD *)calloc(num_occupancies, sizeof(BITBOARD));
-      occupancy_boards[i].size = num_occupancies;
-    }
-
-    // Use the above array to perform a variant of binary counting
-    // where each bit of the count is shifted according to the
-    // currently iterated index in the array
-    for (unsigned int j = 0; j < num_occupancies; j++) {
-      BITBOARD curr_mask = blocker_masks[i];
-      unsigned long long j_cpy = j;
-      while (j_cpy != 0) {
-        unsigned int index = __builtin_ctzll(curr_mask); // get LSB index
-        curr_mask &= curr_mask - 1;                      // clear LSB
-        occupancy_boards[i].data[j] |= (j_cpy & 1) << index;
-        j_cpy >>= 1;
+/**
+ * @brief Load the piece placement field of a FEN into a cleared position.
+ *
+ * @param bbs: A ChessBitboards object cleared to 0.
+ * @param p: The start of the field.
+ * @return The first character after the field, or NULL if the field is not 8
+ * ranks of 8 squares (the pieces read up to the problem are kept).
+ */
+static const char *__load_placement(ChessBitboards *bbs, const char *p) {
+  unsigned int rank = 0; // ranks completed, from the 8th down
+  unsigned int file = 0; // squares filled on the current rank
+  for (;; p++) {
+    unsigned char c = *p;
+    if (c == '/') {
+      if (file != 8 || ++rank == 8) {
+        return NULL;
       }
-    }
-  }
-
-  // Find the magic numbers.
-  srand(time(NULL));
-  while (1) {
-    if (terminate) {
-      // Program terminated...
+      file = 0;
+    } else if (c >= '1' && c <= '8') {
+      file += c - '0';
+      if (file > 8) {
+        return NULL;
+      }
+    } else if (c < 128 && FEN_PIECE_CODES[c]) {
+      if (file == 8) {
+        return NULL;
+      }
+      __load_piece(bbs, FEN_PIECE_CODES[c], 63 - (rank * 8 + file));
+      file++;
+    } else {
       break;
     }
+  }
+  return rank == 7 && file == 8 ? p : NULL;
+}
 
-    for (int i = 0; i < 64; i++) {
-      if (terminate) {
-        // Program terminated. Here is where the code will loop the majority of
-        // the time so it is crucial to check for termination here.
-        break;
-      }
-
-      BITBOARD magic = __ull_rand() & __ull_rand() & __ull_rand();
-      bool skip_flag = false;
-
-      // Use (bits - 1) since we are aiming to minimize bits
-      unsigned int bit_shifts =
-          max_bits[i] == 0 ? 64 - (MAX_INDICES - 1) : 64 - (max_bits[i] - 1);
+/**
+ * @brief Set up a position from the piece placement field of a FEN string, in
+ * a single pass over the field. The bitboards, the mailbox, both hashes and
+ * the piece-square scores are filled as each piece is read; the lookup tables
+ * are never touched.
+ *
+ * @param bbs: The ChessBitboards object to fill (any previous contents are
+ * discarded). If the field is malformed, only the pieces before the problem
+ * are placed; use bb_parse_fen() to check a FEN.
+ * @param board_str: A FEN string, or only its piece placement field. Reading
+ * stops at the first space or at the end of the string.
+ */
+void bb_init_chess_boards(ChessBitboards *bbs, const char *board_str) {
+  // Both only do any work the first time
+  __init_zobrist();
+  eval_init();
+
+  memset(bbs, 0, sizeof(*bbs));
+  __load_placement(bbs, board_str);
+  bbs->all_pieces = bbs->occupancy[0] | bbs->occupancy[1];
+
+#ifdef NNUE_EVAL
+  bbs->nnue_dirty[0] = bbs->nnue_dirty[1] = 1;
+#endif
+}
 
-      bool unique_magic_result[1ULL << (64 - bit_shifts)];
-      memset(unique_magic_result, 0,
-             (unsigned long long)((1ULL << (64 - bit_shifts)) * sizeof(_Bool)));
+/// Read an unsigned number of at most 9 digits (so it cannot overflow).
+/// Returns the first character after it, or NULL if there is no number.
+static const char *__parse_count(const char *p, unsigned int *value) {
+  unsigned int n = 0, digits = 0;
+  for (; *p >= '0' && *p <= '9'; p++, digits++) {
+    n = n * 10 + (*p - '0');
+  }
+  if (digits == 0 || digits > 9) {
+    return NULL;
+  }
+  *value = n;
+  return p;
+}
 
-      BITBOARD max_magic_applied = 0;
+/**
+ * @brief Set up a position and its FenState from a FEN string, in a single
+ * pass over the string. The move clocks may be left out, as in EPD records;
+ * they then default to 0 and 1. A FEN may also end after the side to move,
+ * with no castling rights and no en passant target.
+ *
+ * @param bbs: The ChessBitboards object to fill. Its contents are undefined
+ * if the FEN is rejected.
+ * @param state: Filled with the other fields (left untouched on errors).
+ * @param fen: The FEN string. Leading blanks are skipped.
+ * @param end: If not NULL, set to the first character after the last field
+ * read (i.e., the operations of an EPD record). Only set on success.
+ * @return FEN_OK, or the first problem found.
+ */
+enum FenError bb_parse_fen(ChessBitboards *bbs, FenState *state,
+                           const char *fen, const char **end) {
+  __init_zobrist();
+  eval_init();
 
-      for (unsigned int j = 0; j < occupancy_boards[i].size; j++) {
-        BITBOARD blocker = occupancy_boards[i].data[j];
-        BITBOARD magic_applied = (blocker * magic) >> bit_shifts;
+  //
+  // Piece placement
+  memset(bbs, 0, sizeof(*bbs));
+  const char *p = __load_placement(bbs, __skip_blanks(fen));
+  bbs->all_pieces = bbs->occupancy[0] | bbs->occupancy[1];
+#ifdef NNUE_EVAL
+  bbs->nnue_dirty[0] = bbs->nnue_dirty[1] = 1;
+#endif
+  if (p == NULL || !__is_field_end(*p)) {
+    return FEN_BAD_PLACEMENT;
+  }
+  const BITBOARD BACK_RANKS = 0xFF000000000000FFULL;
+  if (__builtin_popcountll(bbs->pieces[0][PIECE_SLOT(KING)]) != 1 ||
+      __builtin_popcountll(bbs->pieces[1][PIECE_SLOT(KING)]) != 1 ||
+      ((bbs->pieces[0][PIECE_SLOT(PAWN)] | bbs->pieces[1][PIECE_SLOT(PAWN)]) &
+       BACK_RANKS)) {
+    return FEN_BAD_PIECES;
+  }
 
-        if (magic_applied > max_magic_applied) {
-          max_magic_applied = magic_applied;
-        }
+  //
+  // Side to move
+  FenState fields = {.en_passant = -1, .fullmove_number = 1};
+  p = __skip_blanks(p);
+  if ((*p != 'w' && *p != 'b') || !__is_field_end(p[1])) {
+    return FEN_BAD_TURN;
+  }
+  fields.turn = *p++ == 'w' ? WHITE : BLACK;
 
-        if (unique_magic_result[magic_applied]) {
-          skip_flag = true;
-          break;
-        } else {
-          unique_magic_result[magic_applied] = true;
+  //
+  // Castling rights and en passant target. Abbreviated FENs (as in some perft
+  // suites) may end after the side to move; both then default to none.
+  if (!__is_line_end(*__skip_blanks(p))) {
+    p = __skip_blanks(p);
+    if (*p == '-') {
+      p++;
+    } else {
+      do {
+        const char *right = memchr("KQkq", *p, 4);
+        unsigned char bit = right ? 1 << (right - "KQkq") : 0;
+        if (!bit || (fields.castling & bit)) {
+          return FEN_BAD_CASTLING;
         }
-      }
+        fields.castling |= bit;
+        p++;
+      } while (!__is_field_end(*p));
+    }
+    if (!__is_field_end(*p)) {
+      return FEN_BAD_CASTLING;
+    }
 
-      if (max_sizes[i] <= max_magic_applied) {
-        skip_flag = true;
+    p = __skip_blanks(p);
+    if (*p == '-') {
+      p++;
+    } else {
+      char behind = fields.turn == WHITE ? '6' : '3';
+      if (p[0] < 'a' || p[0] > 'h' || p[1] != behind) {
+        return FEN_BAD_EN_PASSANT;
       }
+      fields.en_passant = (p[1] - '1') * 8 + (7 - (p[0] - 'a'));
+      p += 2;
+    }
+    if (!__is_field_end(*p)) {
+      return FEN_BAD_EN_PASSANT;
+    }
+  }
 
-      if (skip_flag) {
-        // re-compute a magic number for this square
-        i--;
-        continue;
-      }
+  //
+  // Move clocks, if present
+  const char *clocks = __skip_blanks(p);
+  if (*clocks >= '0' && *clocks <= '9') {
+    p = __parse_count(clocks, &fields.halfmove_clock);
+    if (p == NULL || (*p != ' ' && *p != '\t')) {
+      return FEN_BAD_CLOCKS;
+    }
+    p = __parse_count(__skip_blanks(p), &fields.fullmove_number);
+    if (p == NULL || !__is_field_end(*p)) {
+      return FEN_BAD_CLOCKS;
+    }
+  }
 
-      // Update the max size for this square
-      max_sizes[i] = max_magic_applied;
+  *state = fields;
+  if (end != NULL) {
+    *end = p;
+  }
+  return FEN_OK;
+}
 
-      // Set and update bit values
-      max_bits[i] = 64 - bit_shifts;
+/**
+ * @brief Describe a FenError.
+ *
+ * @param error: The error in question.
+ * @return A short lowercase description (i.e., "bad castling rights").
+ */
+const char *bb_fen_error_string(enum FenError error) {
+  switch (error) {
+  case FEN_OK:
+    return "ok";
+  case FEN_BAD_PLACEMENT:
+    return "bad piece placement";
+  case FEN_BAD_PIECES:
+    return "bad kings or pawns";
+  case FEN_BAD_TURN:
+    return "bad side to move";
+  case FEN_BAD_CASTLING:
+    return "bad castling rights";
+  case FEN_BAD_EN_PASSANT:
+    return "bad en passant square";
+  case FEN_BAD_CLOCKS:
+    return "bad move clocks";
+  }
+  return "unknown error";
+}
 
-      if (max_bits[i] < min_bits_found) {
-        min_bits_found = max_bits[i];
+/**
+ * @brief Write a position and its FenState as a FEN, the inverse of
+ * bb_parse_fen().
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @param state: The other fields of the FEN.
+ * @param out: A buffer of at least FEN_BUFFER_SIZE bytes, receiving the FEN
+ * and a terminating null character.
+ * @return The length of the FEN.
+ */
+size_t bb_write_fen(const ChessBitboards *bbs, const FenState *state,
+                    char *out) {
+  char *p = out;
+  for (int rank = 7; rank >= 0; rank--) {
+    unsigned int empty = 0;
+    for (int sq = rank * 8 + 7; sq >= rank * 8; sq--) {
+      unsigned char code = BB_CODE_AT(bbs, sq);
+      if (code == 0) {
+        empty++;
+        continue;
       }
-
-      // Update the magic value to this improved number
-      magics[i] = magic;
-
-      // Output progress
-      printf("\033[2J"); // ANSI escape code to clear the screen
-      printf("\033[H");  // ANSI escape code to move cursor to top-left
-      printf("Iteration: %llu\n", iterations);
-      printf("Square: %llu / 64\n", iterated_squares % 64 + 1);
-      unsigned int size_sum = 0;
-      for (unsigned int i = 0; i < 64; i++) {
-        size_sum += max_sizes[i];
+      if (empty) {
+        *p++ = '0' + empty;
+        empty = 0;
       }
-      printf("Total size: %0.2f kB\n", size_sum / 1000.0f);
-      printf("Average Size Per Square: %0.2f kB\n",
-             (size_sum / 64.0f) / 1000.0f);
-      printf("Lowest Required Bit Count: %u\n", min_bits_found);
-      printf("(press Ctrl+C to terminate and output the magics output file)\n");
-      fflush(stdout);
-      iterated_squares++;
+      *p++ = PIECE_CODE_CHARS[code];
+    }
+    if (empty) {
+      *p++ = '0' + empty;
     }
+    *p++ = rank > 0 ? '/' : ' ';
+  }
 
-    iterations++;
+  *p++ = state->turn == BLACK ? 'b' : 'w';
+  *p++ = ' ';
+  if (state->castling == 0) {
+    *p++ = '-';
+  }
+  for (unsigned int i = 0; i < 4; i++) {
+    if (state->castling & (1 << i)) {
+      *p++ = "KQkq"[i];
+    }
+  }
+  *p++ = ' ';
+  if (state->en_passant < 0) {
+    *p++ = '-';
+  } else {
+    *p++ = 'a' + (7 - state->en_passant % 8);
+    *p++ = '1' + state->en_passant / 8;
   }
 
-  printf("\n");
+  p += snprintf(p, FEN_BUFFER_SIZE - (p - out), " %u %u",
+                state->halfmove_clock, state->fullmove_number);
+  return p - out;
+}
 
-  FILE *fp = fopen(filename, "w");
-  if (!fp) {
-    fprintf(stderr, "Unable to write to file %s\n", filename);
-    exit(1);
+BoardTables BB_TABLES;
+
+/**
+ * @brief Compute the position-independent lookup tables (knight, king and
+ * pawn capture moves, slider blocker masks) into `tables`.
+ *
+ * @param tables: The tables to fill. The slider entries only get their masks.
+ */
+void bb_compute_tables(BoardTables *tables) {
+  // Knights
+  for (unsigned int i = 0; i < 64; i++) {
+    tables->knight_moves[i] = __get_knight_move_bb(i);
   }
 
+  // Kings
   for (unsigned int i = 0; i < 64; i++) {
-    fprintf(fp, "%llu%s", magics[i], i == 63 ? "\n" : " ");
+    tables->king_moves[i] = __get_king_move_bb(i);
   }
+
+  // Pawns
+  int white_capture_offsets[2] = {7, 9};
+  int black_capture_offsets[2] = {-7, -9};
   for (unsigned int i = 0; i < 64; i++) {
-    fprintf(fp, "%u%s", 64 - max_bits[i], i == 63 ? "\n" : " ");
+    tables->pawn_captures[COLOR_INDEX(WHITE)][i] =
+        __get_pawn_capture_mask(i, white_capture_offsets);
+    tables->pawn_captures[COLOR_INDEX(BLACK)][i] =
+        __get_pawn_capture_mask(i, black_capture_offsets);
   }
 
-  fclose(fp);
+  // Get blocker masks for rooks/bishops... to be used in magic setup
+  for (unsigned int i = 0; i < 64; i++) {
+    tables->rook_magics[i].mask = __get_blocking_ray_mask(i);
+    tables->bishop_magics[i].mask = __get_blocking_diag_mask(i);
+  }
 
-  // Free heap-allocated objects
+  // Lines through every square for table-free slider attacks
+  const int LINE_DIRS[4][2] = {{1, 0}, {0, 1}, {1, 1}, {1, -1}};
   for (unsigned int i = 0; i < 64; i++) {
-    if (occupancy_boards[i].data) {
-      free(occupancy_boards[i].data);
-      occupancy_boards[i].data = NULL;
+    for (unsigned int l = 0; l < 4; l++) {
+      tables->lines[i][l] = __get_line_mask(i, LINE_DIRS[l]);
     }
   }
 }
+
+/**
+ * @brief Compute the position-independent lookup tables in BB_TABLES (knight,
+ * king and pawn capture moves, slider blocker and line masks). Only the first
+ * call does any work.
+ */
+void bb_init_tables() {
+  static bool initialized = false;
+  if (initialized) {
+    return;
+  }
+
+  bb_compute_tables(&BB_TABLES);
+  initialized = true;
+}
+
+/// Set a bit to 1. NOTE: a1 is index 0, h8 is index 63.
+void set_bit(BITBOARD *bb, unsigned int pos) { *bb |= (1ULL << pos); }
+
+/// Clear a bit to 0. NOTE: a1 is index 0, h8 is index 63.
+void clear_bit(BITBOARD *bb, unsigned int pos) { *bb &= ~(1ULL << pos); }
+
+/// Toggle a bit. NOTE: a1 is index 0, h8 is index 63.
+void toggle_bit(BITBOARD *bb, unsigned int pos) { *bb ^= (1ULL << pos); }
+
+/// Check if a bit is set to 1 at a given position. NOTE: a1 is index 0, h8 is
+/// index 63.
+bool is_occupied(BITBOARD bb, unsigned int pos) {
+  return (bb & (1ULL << pos)) != 0;
+}
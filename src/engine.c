@@ -1,27 +1,91 @@
 #include "engine.h"
+#include "attacks.h"
 #include "bitboard.h"
+#include "eval.h"
+#include "nnue.h"
 #include "utils.h"
 #include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+#if defined(TABLE_FREE_SLIDERS)
+// Only the obstruction difference backend: no slider arena at all.
+#elif defined(GENERATED_TABLES)
+#include "generated_tables.h"
+#else
+/// All rook and bishop attack tables of the current backend, in one
+/// contiguous, cache-line aligned block. Each MagicEntry points at its
+/// square's table in here.
+static BITBOARD *SLIDER_ARENA = NULL;
+#endif
+
+/// The magics the tables are built from, kept to rebuild the arena when the
+/// slider backend changes.
+static MagicInfo MAGIC_INFO;
+static enum SliderBackend SLIDER_BACKEND = SLIDERS_MAGIC;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_PEXT 1
+/// BMI2 parallel bit extract. Written as inline assembly so that the engine
+/// does not have to be built with -mbmi2; it must only run once
+/// engine_pext_supported() returned true.
+static inline BITBOARD __pext(BITBOARD value, BITBOARD mask) {
+  BITBOARD result;
+  __asm__("pextq %2, %1, %0" : "=r"(result) : "r"(value), "rm"(mask));
+  return result;
+}
+#else
+#define HAVE_PEXT 0
+/// Never called: PEXT is only selected when engine_pext_supported().
+static inline BITBOARD __pext(BITBOARD value, BITBOARD mask) {
+  (void)value;
+  (void)mask;
+  return 0;
+}
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_BATCH_AVX512 1
+/// The instruction sets of the batched move generation kernel. It is only
+/// called once engine_setup() found them all on the CPU.
+#define BATCH_AVX512                                                           \
+  __attribute__((target("avx512f,avx512bw,avx512vl,avx512vbmi2,popcnt")))
+#else
+#define HAVE_BATCH_AVX512 0
+#endif
+/// Set by engine_setup() when the CPU runs the AVX-512 batch kernel.
+static bool BATCH_AVX512_SUPPORTED = false;
 
 /**
- * @brief Sets up a table.
+ * @brief Sets up the table of one square in the slider arena.
  *
- * @param blockers: The pieces' blocker masks
- * @param table: The current table that is being setup.
+ * @param entry: The square's entry (its mask must already be set).
+ * @param table: The square's table in the arena.
+ * @param arena_end: The end of the arena (only checked by assertions).
  * @param i: The current square index that is being processed.
- * @param magics: The magic values for this table.
- * @param shifts: The shift values for this table.
+ * @param magic: The magic value for this square (0 with the PEXT backend).
+ * @param shift: The shift value for this square.
  * @param DIRECTIONS: an array of 4 direction offset in {rank, file} (2) format.
  */
-void __table_setup(BITBOARD *blockers, BITBOARD **table, unsigned int i,
-                   const BITBOARD *MAGICS, const unsigned int *SHIFTS,
-                   const int (*DIRECTIONS)[2]) {
-
-  table[i] = (BITBOARD *)calloc(1ULL << (64 - SHIFTS[i]), sizeof(BITBOARD));
+void __table_setup(MagicEntry *entry, BITBOARD *table,
+                   const BITBOARD *arena_end, unsigned int i, BITBOARD magic,
+                   unsigned int shift, const int (*DIRECTIONS)[2]) {
+  (void)arena_end;
+  entry->magic = magic;
+  entry->shift = shift;
+  entry->attacks = table;
 
   // Go through each relevant occupancy board and compute legal moves
-  BITBOARD blocker_mask = blockers[i];
+  BITBOARD blocker_mask = entry->mask;
   const unsigned int NUM_SET_BITS = __builtin_popcountll(blocker_mask);
   const unsigned long long TOTAL_BIT_VARIANTS = 1ULL << NUM_SET_BITS;
 
@@ -59,429 +123,1059 @@ void __table_setup(BITBOARD *blockers, BITBOARD **table, unsigned int i,
 
     // Use magic numbers to assign the moves to the correct precomputation
     // table entry. A "blocker" is the relevant occupancy board ANDed with the
-    // blocker mask.
-    // Get the index using the magic number and shift value.
-    BITBOARD move_index = (relevant_occupancy * MAGICS[i]) >> SHIFTS[i];
-    assert(table[i][move_index] == 0); // for testing
-    table[i][move_index] = pseudo_legal_moves;
+    // blocker mask; black magics see it with every square off the mask set.
+    // Get the index using the magic number and shift value. Several
+    // occupancies (and the tables of other squares, which may overlap this
+    // one) may share an entry as long as they have the same moves. No slider
+    // has an empty move set, so 0 marks an unused entry.
+    // With PEXT (magic 0) the index is the occupancy bits under the mask,
+    // which is relevant_i itself.
+    BITBOARD move_index =
+        magic ? ((relevant_occupancy | ~blocker_mask) * magic) >> shift
+              : relevant_i;
+    assert(table + move_index < arena_end);
+    assert(table[move_index] == 0 || table[move_index] == pseudo_legal_moves);
+    table[move_index] = pseudo_legal_moves;
   }
 }
 
 /**
- * @brief Setup the engine, including precomputation of move lookup tables.
+ * @brief Get the number of slider arena entries the tables of a backend need.
  *
- * @param bbs: A ChessBitboards object that has been initialized using
- * bb_init_chess_boards()
- * @param rook_move_table: rook move lookup table (2D array)
- * @param bishop_move_table: bishop move lookup table (2D array)
- * @param magic_info: MagicInfo object that is initiated in init_magic_info().
- * @note the tables should be setup as BITBOARD *table[64];
+ * @param magic_info: The magics (only used by the magic backend).
+ * @param backend: The slider backend.
+ * @return MagicInfo.ARENA_SIZE for magics, PEXT_ARENA_SIZE for PEXT and 0 for
+ * obstruction difference.
+ */
+unsigned int engine_arena_size(const MagicInfo *magic_info,
+                               enum SliderBackend backend) {
+  switch (backend) {
+  case SLIDERS_MAGIC:
+    return magic_info->ARENA_SIZE;
+  case SLIDERS_PEXT:
+    return PEXT_ARENA_SIZE;
+  default:
+    return 0;
+  }
+}
+
+/**
+ * @brief Build all lookup tables for a slider backend at runtime. Magic
+ * tables are placed at the MagicInfo offsets, PEXT tables back to back.
+ *
+ * @param tables: The tables to fill.
+ * @param arena: engine_arena_size() entries to hold the slider tables.
+ * @param magic_info: The magics (ignored by the PEXT backend).
+ * @param backend: The backend to build the slider tables for.
  */
-void engine_setup(ChessBitboards *bbs, BITBOARD **rook_move_table,
-                  BITBOARD **bishop_move_table, MagicInfo *magic_info) {
+void engine_build_tables(BoardTables *tables, BITBOARD *arena,
+                         const MagicInfo *magic_info,
+                         enum SliderBackend backend) {
+  bb_compute_tables(tables);
+  if (backend == SLIDERS_OBSTRUCTION) {
+    // Only needs the line masks
+    for (unsigned int i = 0; i < 64; i++) {
+      MagicEntry *entries[2] = {&tables->rook_magics[i],
+                                &tables->bishop_magics[i]};
+      for (unsigned int s = 0; s < 2; s++) {
+        entries[s]->magic = 0;
+        entries[s]->shift = 64;
+        entries[s]->attacks = NULL;
+      }
+    }
+    return;
+  }
+  const unsigned int ARENA_SIZE = engine_arena_size(magic_info, backend);
+  memset(arena, 0, ARENA_SIZE * sizeof(BITBOARD));
+  bool pext = backend == SLIDERS_PEXT;
+  unsigned int dense_offset = 0;
+
   //
   // Rook Table
   const int ROOK_DIRS[4][2] = {{-1, 0}, {0, -1}, {1, 0}, {0, 1}};
   for (unsigned int i = 0; i < 64; i++) {
-    __table_setup(bbs->rook_blocker_masks, rook_move_table, i,
-                  magic_info->ROOK_MAGICS, magic_info->ROOK_SHIFTS, ROOK_DIRS);
+    MagicEntry *entry = &tables->rook_magics[i];
+    unsigned int shift = pext ? 64U - __builtin_popcountll(entry->mask)
+                              : magic_info->ROOK_SHIFTS[i];
+    unsigned int offset = pext ? dense_offset : magic_info->ROOK_OFFSETS[i];
+    __table_setup(entry, arena + offset, arena + ARENA_SIZE, i,
+                  pext ? 0 : magic_info->ROOK_MAGICS[i], shift, ROOK_DIRS);
+    dense_offset += 1U << (64 - shift);
   }
 
   //
   // Bishop Table
   const int BISHOP_DIRS[4][2] = {{-1, -1}, {-1, 1}, {1, -1}, {1, 1}};
   for (unsigned int i = 0; i < 64; i++) {
-    __table_setup(bbs->bishop_blocker_masks, bishop_move_table, i,
-                  magic_info->BISHOP_MAGICS, magic_info->BISHOP_SHIFTS,
-                  BISHOP_DIRS);
+    MagicEntry *entry = &tables->bishop_magics[i];
+    unsigned int shift = pext ? 64U - __builtin_popcountll(entry->mask)
+                              : magic_info->BISHOP_SHIFTS[i];
+    unsigned int offset = pext ? dense_offset : magic_info->BISHOP_OFFSETS[i];
+    __table_setup(entry, arena + offset, arena + ARENA_SIZE, i,
+                  pext ? 0 : magic_info->BISHOP_MAGICS[i], shift, BISHOP_DIRS);
+    dense_offset += 1U << (64 - shift);
   }
 }
 
 /**
- * @brief Helper for table cleanup; free all elements of a table.
+ * @brief Determine if the CPU can run the PEXT slider backend (x86-64 with
+ * BMI2).
  *
- * @param table: the table to cleanup
+ * @return true if engine_set_slider_backend(SLIDERS_PEXT) can be used.
  */
-void __table_cleanup(BITBOARD **table) {
-  for (unsigned int i = 0; i < 64; i++) {
-    if (table[i]) {
-      free(table[i]);
-      table[i] = NULL;
-    }
+bool engine_pext_supported() {
+#if HAVE_PEXT
+  return __builtin_cpu_supports("bmi2");
+#else
+  return false;
+#endif
+}
+
+/**
+ * @brief Name the instruction set level the HOT_KERNEL functions run at on
+ * this CPU.
+ *
+ * @return "x86-64-v4", "x86-64-v3" or "x86-64" on x86-64 Linux, "generic"
+ * elsewhere.
+ */
+const char *engine_cpu_level() {
+#if defined(__x86_64__) && defined(__GNUC__) && defined(__linux__)
+  if (__builtin_cpu_supports("x86-64-v4")) {
+    return "x86-64-v4";
   }
+  if (__builtin_cpu_supports("x86-64-v3")) {
+    return "x86-64-v3";
+  }
+  return "x86-64";
+#else
+  return "generic";
+#endif
 }
 
 /**
- * @brief Perform cleanup on the engine. This includes freeing allocated
- * resources in the lookup tables.
+ * @brief Switch the lookup tables to a backend and use it for move
+ * generation. With GENERATED_TABLES this only copies the small per-square
+ * tables; the slider arenas are linked in read-only.
  *
- * @param rook_move_table: rook move lookup table (2D array)
- * @param bishop_move_table: bishop move lookup table (2D array)
+ * @param backend: The backend to switch to.
+ * @return false if the backend is not supported on this CPU or in this build
+ * (the current one is kept), true otherwise.
  */
-void engine_cleanup(BITBOARD **rook_move_table, BITBOARD **bishop_move_table) {
-  __table_cleanup(rook_move_table);
-  __table_cleanup(bishop_move_table);
+bool engine_set_slider_backend(enum SliderBackend backend) {
+  if (backend == SLIDERS_PEXT && !engine_pext_supported()) {
+    return false;
+  }
+#if defined(TABLE_FREE_SLIDERS)
+  if (backend != SLIDERS_OBSTRUCTION) {
+    return false;
+  }
+  engine_build_tables(&BB_TABLES, NULL, &MAGIC_INFO, backend);
+#elif defined(GENERATED_TABLES)
+  // The obstruction difference backend only uses the line masks, which both
+  // sets of tables have
+#if HAVE_PEXT
+  BB_TABLES = backend == SLIDERS_PEXT ? GENERATED_PEXT_TABLES
+                                      : GENERATED_MAGIC_TABLES;
+#else
+  BB_TABLES = GENERATED_MAGIC_TABLES;
+#endif
+#else
+  // Rounded up to whole cache lines, as aligned_alloc() wants
+  size_t arena_bytes =
+      engine_arena_size(&MAGIC_INFO, backend) * sizeof(BITBOARD);
+  BITBOARD *arena = aligned_alloc(64, (arena_bytes + 63) / 64 * 64);
+  if (arena == NULL) {
+    fprintf(stderr, "Unable to allocate the slider arena.\n");
+    exit(1);
+  }
+  engine_build_tables(&BB_TABLES, arena, &MAGIC_INFO, backend);
+  free(SLIDER_ARENA);
+  SLIDER_ARENA = arena;
+#endif
+  SLIDER_BACKEND = backend;
+  return true;
 }
 
 /**
- * @brief Computes all pseudo-legal moves given the current board.
- * The moves are set in `move_arr`.
+ * @brief Get the slider backend in use.
  *
- * @param bbs: An initialized ChessBitboards object.
- * @param magic: An initialized MagicInfo object.
- * @param move_arr: The array to assign moves.
- * @param color: The color to generate moves from.
+ * @return The current SliderBackend.
  */
-void engine_generate_pseudolegal_moves(ChessBitboards *bbs, MagicInfo *magic,
-                                       MoveArray *move_arr,
-                                       enum PieceColor color) {
-  move_arr->len = 0;
+enum SliderBackend engine_slider_backend() { return SLIDER_BACKEND; }
 
-  if (color == WHITE) {
-    //
-    // White
-
-    // Knights
-    BITBOARD w_knights_copy = bbs->white_knights;
-    while (w_knights_copy) {
-      unsigned int from_pos = POP_LSB(w_knights_copy);
-      BITBOARD w_knight_moves_copy = bbs->knight_moves[from_pos];
-      while (w_knight_moves_copy) {
-        unsigned int to_pos = POP_LSB(w_knight_moves_copy);
-        if ((1ULL << to_pos) & ~bbs->white_pieces) {
-          move_info_t move = from_pos | (to_pos << 6);
-          move_arr->moves[move_arr->len++] = move;
-        }
-      }
-    }
+/**
+ * @brief Setup the engine, including precomputation of move lookup tables.
+ * Uses the PEXT slider backend when the CPU supports it, magics otherwise,
+ * and obstruction difference in TABLE_FREE_SLIDERS builds.
+ *
+ * @param magic_info: MagicInfo object that is initiated in init_magic_info().
+ * With GENERATED_TABLES, the tables were built from the same magics at
+ * compile time.
+ * @note This fills the global BB_TABLES, so it only needs to be called once.
+ */
+void engine_setup(MagicInfo *magic_info) {
+  MAGIC_INFO = *magic_info;
+  attacks_setup();
+#ifdef NNUE_EVAL
+  nnue_setup();
+#endif
+#if HAVE_BATCH_AVX512
+  BATCH_AVX512_SUPPORTED = __builtin_cpu_supports("avx512vbmi2") &&
+                           __builtin_cpu_supports("avx512bw") &&
+                           __builtin_cpu_supports("avx512vl");
+#endif
+#ifdef TABLE_FREE_SLIDERS
+  engine_set_slider_backend(SLIDERS_OBSTRUCTION);
+#else
+  engine_set_slider_backend(engine_pext_supported() ? SLIDERS_PEXT
+                                                    : SLIDERS_MAGIC);
+#endif
+}
 
-    // King
-    BITBOARD w_king_copy = bbs->white_king;
-    while (w_king_copy) {
-      unsigned int from_pos = POP_LSB(w_king_copy);
-      BITBOARD w_king_moves_copy = bbs->king_moves[from_pos];
-      while (w_king_moves_copy) {
-        unsigned int to_pos = POP_LSB(w_king_moves_copy);
-        if ((1ULL << to_pos) & ~bbs->white_pieces) {
-          move_info_t move = from_pos | (to_pos << 6);
-          move_arr->moves[move_arr->len++] = move;
-        }
+#ifdef GENERATED_TABLES
+/// Compare the slider entries (and every table entry they index) of two sets
+/// of tables.
+bool __magic_entries_equal(const MagicEntry *a, const MagicEntry *b) {
+  for (unsigned int i = 0; i < 64; i++) {
+    if (a[i].mask != b[i].mask || a[i].magic != b[i].magic ||
+        a[i].shift != b[i].shift) {
+      return false;
+    }
+    // Carry-rippler: subsets of the mask in the order of their PEXT index
+    BITBOARD occupancy = 0;
+    unsigned long long subset = 0;
+    do {
+      BITBOARD idx =
+          a[i].magic ? ((occupancy | ~a[i].mask) * a[i].magic) >> a[i].shift
+                     : subset;
+      if (a[i].attacks[idx] != b[i].attacks[idx]) {
+        return false;
       }
+      occupancy = (occupancy - a[i].mask) & a[i].mask;
+      subset++;
+    } while (occupancy != 0);
+  }
+  return true;
+}
+
+/// Compare the tables built at runtime for a backend with generated ones.
+bool __verify_backend(const BoardTables *generated,
+                      enum SliderBackend backend) {
+  BoardTables *runtime = malloc(sizeof(BoardTables));
+  BITBOARD *arena =
+      malloc(engine_arena_size(&MAGIC_INFO, backend) * sizeof(BITBOARD));
+  engine_build_tables(runtime, arena, &MAGIC_INFO, backend);
+
+  bool equal =
+      memcmp(runtime->knight_moves, generated->knight_moves,
+             sizeof(runtime->knight_moves)) == 0 &&
+      memcmp(runtime->king_moves, generated->king_moves,
+             sizeof(runtime->king_moves)) == 0 &&
+      memcmp(runtime->pawn_captures, generated->pawn_captures,
+             sizeof(runtime->pawn_captures)) == 0 &&
+      memcmp(runtime->lines, generated->lines, sizeof(runtime->lines)) == 0 &&
+      __magic_entries_equal(runtime->rook_magics, generated->rook_magics) &&
+      __magic_entries_equal(runtime->bishop_magics, generated->bishop_magics);
+
+  free(arena);
+  free(runtime);
+  return equal;
+}
+#endif
+
+/**
+ * @brief Check the tables linked in at build time against the ones built at
+ * runtime from the MagicInfo given to engine_setup().
+ *
+ * @return true if they match, or if the engine was built without
+ * GENERATED_TABLES.
+ */
+bool engine_verify_tables() {
+#ifdef GENERATED_TABLES
+  bool equal = __verify_backend(&GENERATED_MAGIC_TABLES, SLIDERS_MAGIC);
+#if HAVE_PEXT
+  equal = equal && __verify_backend(&GENERATED_PEXT_TABLES, SLIDERS_PEXT);
+#endif
+  return equal;
+#else
+  return true;
+#endif
+}
+
+//
+// Table Files
+
+#define TABLE_FILE_MAGIC "IRONPAWN"
+#define TABLE_FILE_VERSION 1
+/// The arena starts on a page boundary of the file.
+#define TABLE_FILE_ARENA_OFFSET 8192
+/// The size of a table file with the tables of a backend.
+#define TABLE_FILE_SIZE(backend)                                               \
+  (TABLE_FILE_ARENA_OFFSET +                                                   \
+   engine_arena_size(&MAGIC_INFO, backend) * sizeof(BITBOARD))
+
+/// Header of an attack-table file. The checksum covers everything after it.
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t backend;
+  uint64_t magic_info_hash; // of the MagicInfo the tables were built from
+  uint64_t size;            // of the whole file
+  uint64_t checksum;
+} TableFileHeader;
+
+/// Everything in BB_TABLES apart from the arena, with offsets in place of
+/// pointers.
+typedef struct {
+  TableFileHeader header;
+  BITBOARD knight_moves[64];
+  BITBOARD king_moves[64];
+  BITBOARD pawn_captures[2][64];
+  BITBOARD masks[2][64]; // rooks, bishops
+  BITBOARD magics[2][64];
+  uint32_t shifts[2][64];
+  uint32_t offsets[2][64];
+} TableFile;
+
+_Static_assert(sizeof(TableFile) <= TABLE_FILE_ARENA_OFFSET,
+               "the table file header overlaps the arena");
+
+/// The mapped table file, if any, and its size.
+static void *MAPPED_TABLES = NULL;
+static size_t MAPPED_TABLES_SIZE = 0;
+
+/// 64-bit FNV-1a over `size` bytes, continuing from `hash`.
+uint64_t __fnv1a(uint64_t hash, const void *data, size_t size) {
+  const unsigned char *bytes = data;
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+
+/// Checksum of a table file image of `size` bytes (everything after the
+/// header).
+uint64_t __table_file_checksum(const unsigned char *file, size_t size) {
+  return __fnv1a(FNV_OFFSET_BASIS, file + sizeof(TableFileHeader),
+                 size - sizeof(TableFileHeader));
+}
+
+/**
+ * @brief Build the tables for the current backend and write them to `path`.
+ * The file is written next to `path` and renamed over it, so a process that
+ * maps `path` concurrently sees either no file or a complete one.
+ *
+ * @return true on success.
+ */
+bool __write_table_file(const char *path, uint64_t magic_info_hash) {
+  const size_t FILE_SIZE = TABLE_FILE_SIZE(SLIDER_BACKEND);
+  unsigned char *file = calloc(1, FILE_SIZE);
+  BoardTables *tables = malloc(sizeof(BoardTables));
+  BITBOARD *arena = (BITBOARD *)(file + TABLE_FILE_ARENA_OFFSET);
+  engine_build_tables(tables, arena, &MAGIC_INFO, SLIDER_BACKEND);
+
+  TableFile *header = (TableFile *)file;
+  memcpy(header->knight_moves, tables->knight_moves,
+         sizeof(header->knight_moves));
+  memcpy(header->king_moves, tables->king_moves, sizeof(header->king_moves));
+  memcpy(header->pawn_captures, tables->pawn_captures,
+         sizeof(header->pawn_captures));
+  for (unsigned int i = 0; i < 64; i++) {
+    const MagicEntry *entries[2] = {&tables->rook_magics[i],
+                                    &tables->bishop_magics[i]};
+    for (unsigned int s = 0; s < 2; s++) {
+      header->masks[s][i] = entries[s]->mask;
+      header->magics[s][i] = entries[s]->magic;
+      header->shifts[s][i] = entries[s]->shift;
+      header->offsets[s][i] = entries[s]->attacks - arena;
     }
+  }
+  free(tables);
+
+  memcpy(header->header.magic, TABLE_FILE_MAGIC, 8);
+  header->header.version = TABLE_FILE_VERSION;
+  header->header.backend = SLIDER_BACKEND;
+  header->header.magic_info_hash = magic_info_hash;
+  header->header.size = FILE_SIZE;
+  header->header.checksum = __table_file_checksum(file, FILE_SIZE);
+
+  char tmp_path[4096];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long)getpid());
+  FILE *fp = fopen(tmp_path, "wb");
+  bool written =
+      fp != NULL && fwrite(file, 1, FILE_SIZE, fp) == FILE_SIZE;
+  written = fp != NULL && fflush(fp) == 0 && fsync(fileno(fp)) == 0 &&
+            written;
+  if (fp != NULL && fclose(fp) != 0) {
+    written = false;
+  }
+  written = written && rename(tmp_path, path) == 0;
+  if (!written) {
+    remove(tmp_path);
+  }
+  free(file);
+  return written;
+}
 
-    // Rooks
-    BITBOARD w_rook_copy = bbs->white_rooks;
-    while (w_rook_copy) {
-      unsigned int from_pos = POP_LSB(w_rook_copy);
-      BITBOARD blocker = bbs->rook_blocker_masks[from_pos] & bbs->all_pieces;
-      BITBOARD magic_index = (blocker * magic->ROOK_MAGICS[from_pos]) >>
-                             magic->ROOK_SHIFTS[from_pos];
-      BITBOARD w_rook_moves_copy = bbs->rook_move_table[from_pos][magic_index];
-      while (w_rook_moves_copy) {
-        unsigned int to_pos = POP_LSB(w_rook_moves_copy);
-        if ((1ULL << to_pos) & ~bbs->white_pieces) {
-          move_info_t move = from_pos | (to_pos << 6);
-          move_arr->moves[move_arr->len++] = move;
-        }
-      }
+/**
+ * @brief Map a table file read-only and check that it holds the tables of the
+ * current backend and magics.
+ *
+ * @return The mapping, or NULL if the file is missing or does not match.
+ */
+void *__map_table_file(const char *path, uint64_t magic_info_hash) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  const size_t FILE_SIZE = TABLE_FILE_SIZE(SLIDER_BACKEND);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (uint64_t)st.st_size != FILE_SIZE) {
+    close(fd);
+    return NULL;
+  }
+  void *file = mmap(NULL, FILE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED) {
+    return NULL;
+  }
+#ifdef MADV_HUGEPAGE
+  // Best effort: only filesystems with huge page support honour this.
+  madvise(file, FILE_SIZE, MADV_HUGEPAGE);
+#endif
+
+  const TableFileHeader *header = file;
+  if (memcmp(header->magic, TABLE_FILE_MAGIC, 8) != 0 ||
+      header->version != TABLE_FILE_VERSION ||
+      header->backend != (uint32_t)SLIDER_BACKEND ||
+      header->magic_info_hash != magic_info_hash ||
+      header->size != FILE_SIZE ||
+      header->checksum != __table_file_checksum(file, FILE_SIZE)) {
+    munmap(file, FILE_SIZE);
+    return NULL;
+  }
+  return file;
+}
+
+/**
+ * @brief Use the lookup tables of the current backend from a file mapped
+ * read-only, so that every engine process on a host shares one physical copy.
+ * If the file is missing, or was written by another version or from other
+ * magics, it is built and written first.
+ *
+ * @param path: The path of the table file.
+ * @return false if the file could neither be mapped nor written, or if the
+ * backend uses no tables (the current tables are kept), true otherwise.
+ */
+bool engine_map_tables(const char *path) {
+  if (SLIDER_BACKEND == SLIDERS_OBSTRUCTION) {
+    return false;
+  }
+  uint64_t magic_info_hash =
+      __fnv1a(FNV_OFFSET_BASIS, &MAGIC_INFO, sizeof(MAGIC_INFO));
+  void *file = __map_table_file(path, magic_info_hash);
+  if (file == NULL) {
+    if (!__write_table_file(path, magic_info_hash)) {
+      return false;
+    }
+    file = __map_table_file(path, magic_info_hash);
+    if (file == NULL) {
+      return false;
     }
+  }
 
-    // Bishop
-    BITBOARD w_bishop_copy = bbs->white_bishops;
-    while (w_bishop_copy) {
-      unsigned int from_pos = POP_LSB(w_bishop_copy);
-      BITBOARD blocker = bbs->bishop_blocker_masks[from_pos] & bbs->all_pieces;
-      BITBOARD magic_index = (blocker * magic->BISHOP_MAGICS[from_pos]) >>
-                             magic->BISHOP_SHIFTS[from_pos];
-      BITBOARD w_bishop_moves_copy =
-          bbs->bishop_move_table[from_pos][magic_index];
-      while (w_bishop_moves_copy) {
-        unsigned int to_pos = POP_LSB(w_bishop_moves_copy);
-        if ((1ULL << to_pos) & ~bbs->white_pieces) {
-          move_info_t move = from_pos | (to_pos << 6);
-          move_arr->moves[move_arr->len++] = move;
-        }
-      }
+  const TableFile *header = file;
+  const BITBOARD *arena =
+      (const BITBOARD *)((const unsigned char *)file + TABLE_FILE_ARENA_OFFSET);
+  memcpy(BB_TABLES.knight_moves, header->knight_moves,
+         sizeof(BB_TABLES.knight_moves));
+  memcpy(BB_TABLES.king_moves, header->king_moves,
+         sizeof(BB_TABLES.king_moves));
+  memcpy(BB_TABLES.pawn_captures, header->pawn_captures,
+         sizeof(BB_TABLES.pawn_captures));
+  for (unsigned int i = 0; i < 64; i++) {
+    MagicEntry *entries[2] = {&BB_TABLES.rook_magics[i],
+                              &BB_TABLES.bishop_magics[i]};
+    for (unsigned int s = 0; s < 2; s++) {
+      entries[s]->mask = header->masks[s][i];
+      entries[s]->magic = header->magics[s][i];
+      entries[s]->shift = header->shifts[s][i];
+      entries[s]->attacks = arena + header->offsets[s][i];
     }
+  }
 
-    // Queen
-    BITBOARD w_queen_copy = bbs->white_queens;
-    while (w_queen_copy) {
-      unsigned int from_pos = POP_LSB(w_queen_copy);
-
-      // Diagonals
-      BITBOARD diag_blocker =
-          bbs->bishop_blocker_masks[from_pos] & bbs->all_pieces;
-      BITBOARD diag_magic_index =
-          (diag_blocker * magic->BISHOP_MAGICS[from_pos]) >>
-          magic->BISHOP_SHIFTS[from_pos];
-      BITBOARD w_diag_moves_copy =
-          bbs->bishop_move_table[from_pos][diag_magic_index];
-      while (w_diag_moves_copy) {
-        unsigned int to_pos = POP_LSB(w_diag_moves_copy);
-        if ((1ULL << to_pos) & ~bbs->white_pieces) {
-          move_info_t move = from_pos | (to_pos << 6);
-          move_arr->moves[move_arr->len++] = move;
-        }
-      }
+  if (MAPPED_TABLES != NULL) {
+    munmap(MAPPED_TABLES, MAPPED_TABLES_SIZE);
+  }
+  MAPPED_TABLES = file;
+  MAPPED_TABLES_SIZE = TABLE_FILE_SIZE(SLIDER_BACKEND);
+  return true;
+}
 
-      // Straights
-      BITBOARD straight_blocker =
-          bbs->rook_blocker_masks[from_pos] & bbs->all_pieces;
-      BITBOARD straight_magic_index =
-          (straight_blocker * magic->ROOK_MAGICS[from_pos]) >>
-          magic->ROOK_SHIFTS[from_pos];
-      BITBOARD w_straight_moves_copy =
-          bbs->rook_move_table[from_pos][straight_magic_index];
-      while (w_straight_moves_copy) {
-        unsigned int to_pos = POP_LSB(w_straight_moves_copy);
-        if ((1ULL << to_pos) & ~bbs->white_pieces) {
-          move_info_t move = from_pos | (to_pos << 6);
-          move_arr->moves[move_arr->len++] = move;
-        }
-      }
-    }
+/**
+ * @brief Perform cleanup on the engine. The slider tables live in an arena
+ * allocated for the backend or in a mapped table file; the entries are
+ * detached from them, the arena is freed and the file is unmapped.
+ */
+void engine_cleanup() {
+  for (unsigned int i = 0; i < 64; i++) {
+    BB_TABLES.rook_magics[i].attacks = NULL;
+    BB_TABLES.bishop_magics[i].attacks = NULL;
+  }
+#if !defined(TABLE_FREE_SLIDERS) && !defined(GENERATED_TABLES)
+  free(SLIDER_ARENA);
+  SLIDER_ARENA = NULL;
+#endif
+  if (MAPPED_TABLES != NULL) {
+    munmap(MAPPED_TABLES, MAPPED_TABLES_SIZE);
+    MAPPED_TABLES = NULL;
+  }
+}
+
+//
+// Move Generation
+
+/// Move a bitboard `ranks` ranks forward from the point of view of the color
+/// with index `us`.
+#define PAWN_FORWARD(bb, us, ranks)                                            \
+  ((us) == COLOR_INDEX(WHITE) ? (bb) << (8 * (ranks)) : (bb) >> (8 * (ranks)))
+/// Rank the pawns of color index `us` start on.
+#define PAWN_START_RANK(us)                                                    \
+  ((us) == COLOR_INDEX(WHITE) ? (RANK_2_MASK) : (RANK_7_MASK))
+/// Rank the pawns of color index `us` promote on.
+#define PAWN_PROMOTION_RANK(us)                                                \
+  ((us) == COLOR_INDEX(WHITE) ? (RANK_8_MASK) : (RANK_1_MASK))
+
+/// Slider moves from a square given the occupied squares (own pieces
+/// included). `backend` is a compile-time constant at every call site.
+static inline BITBOARD __slider_moves(const MagicEntry *entry,
+                                      BITBOARD occupied,
+                                      const enum SliderBackend backend) {
+  if (backend == SLIDERS_PEXT) {
+    return entry->attacks[__pext(occupied, entry->mask)];
+  }
+  return entry->attacks[((occupied | ~entry->mask) * entry->magic) >>
+                        entry->shift];
+}
+
+/// Moves along one line through a square by obstruction difference: the
+/// nearest blocker above the square is isolated with `upper & -upper`, the
+/// nearest one below with a mask from the most significant bit of `lower`,
+/// and one subtraction spans the squares between them.
+static inline BITBOARD __line_moves(const LineMask *line, BITBOARD occupied) {
+  BITBOARD lower = line->lower & occupied;
+  BITBOARD upper = line->upper & occupied;
+  BITBOARD lower_blocker = ~0ULL << (63 - __builtin_clzll(lower | 1));
+  BITBOARD obstruction_difference = 2 * (upper & -upper) + lower_blocker;
+  return (line->lower | line->upper) & obstruction_difference;
+}
+
+static inline BITBOARD __rook_moves(unsigned int pos, BITBOARD occupied,
+                                    const enum SliderBackend backend) {
+  if (backend == SLIDERS_OBSTRUCTION) {
+    return __line_moves(&BB_TABLES.lines[pos][LINE_FILE], occupied) |
+           __line_moves(&BB_TABLES.lines[pos][LINE_RANK], occupied);
+  }
+  return __slider_moves(&BB_TABLES.rook_magics[pos], occupied, backend);
+}
+
+static inline BITBOARD __bishop_moves(unsigned int pos, BITBOARD occupied,
+                                      const enum SliderBackend backend) {
+  if (backend == SLIDERS_OBSTRUCTION) {
+    return __line_moves(&BB_TABLES.lines[pos][LINE_DIAGONAL], occupied) |
+           __line_moves(&BB_TABLES.lines[pos][LINE_ANTI_DIAGONAL], occupied);
+  }
+  return __slider_moves(&BB_TABLES.bishop_magics[pos], occupied, backend);
+}
+
+#define ROOK_MOVES(pos, occupied, backend) __rook_moves(pos, occupied, backend)
+#define BISHOP_MOVES(pos, occupied, backend)                                   \
+  __bishop_moves(pos, occupied, backend)
+
+/// Append a move from `from_pos` to every square of `targets`.
+static inline void __add_moves(MoveArray *move_arr, unsigned int from_pos,
+                               BITBOARD targets) {
+  while (targets) {
+    unsigned int to_pos = POP_LSB(targets);
+    move_arr->moves[move_arr->len++] = from_pos | (to_pos << 6);
+  }
+}
+
+/// Append a pawn move to every square of `targets`, coming from `from_offset`
+/// squares away and flagged as a promotion on `promotion_rank`.
+static inline void __add_pawn_moves(MoveArray *move_arr, BITBOARD targets,
+                                    int from_offset, BITBOARD promotion_rank) {
+  while (targets) {
+    unsigned int to_pos = POP_LSB(targets);
+    move_info_t move = (to_pos + from_offset) | (to_pos << 6);
+    if ((1ULL << to_pos) & promotion_rank)
+      move |= FLAG_PROMOTION;
+    move_arr->moves[move_arr->len++] = move;
+  }
+}
+
+/// Append the rook, bishop and queen moves (queens: diagonals, then
+/// straights) of one side.
+static inline __attribute__((always_inline)) void
+__add_slider_moves(MoveArray *move_arr, const BITBOARD *own, BITBOARD targets,
+                   BITBOARD occupied, const enum SliderBackend backend) {
+  // Rooks
+  BITBOARD rooks = own[PIECE_SLOT(ROOK)];
+  while (rooks) {
+    unsigned int from_pos = POP_LSB(rooks);
+    __add_moves(move_arr, from_pos,
+                ROOK_MOVES(from_pos, occupied, backend) & targets);
+  }
+
+  // Bishops
+  BITBOARD bishops = own[PIECE_SLOT(BISHOP)];
+  while (bishops) {
+    unsigned int from_pos = POP_LSB(bishops);
+    __add_moves(move_arr, from_pos,
+                BISHOP_MOVES(from_pos, occupied, backend) & targets);
+  }
+
+  // Queens (diagonals, then straights)
+  BITBOARD queens = own[PIECE_SLOT(QUEEN)];
+  while (queens) {
+    unsigned int from_pos = POP_LSB(queens);
+    __add_moves(move_arr, from_pos,
+                BISHOP_MOVES(from_pos, occupied, backend) & targets);
+    __add_moves(move_arr, from_pos,
+                ROOK_MOVES(from_pos, occupied, backend) & targets);
+  }
+}
+
+/**
+ * @brief The move generator for one side. `us` and `backend` are compile-time
+ * constants at every call site, so each instantiation has the color and
+ * backend checks folded away.
+ *
+ * @param bbs: An initialized ChessBitboards object.
+ * @param move_arr: The array to assign moves.
+ * @param us: The color index (see COLOR_INDEX) to generate moves for.
+ * @param backend: The slider backend the tables were built for.
+ */
+static inline __attribute__((always_inline)) void
+__generate_moves(const ChessBitboards *bbs, MoveArray *move_arr,
+                 const unsigned int us, const enum SliderBackend backend) {
+  const BITBOARD *own = bbs->pieces[us];
+  const BITBOARD targets = ~bbs->occupancy[us];
+  const BITBOARD occupied = bbs->all_pieces;
+  const BITBOARD empty_squares = ~occupied;
+
+  move_arr->len = 0;
+
+  // Knights
+  BITBOARD knights = own[PIECE_SLOT(KNIGHT)];
+  while (knights) {
+    unsigned int from_pos = POP_LSB(knights);
+    __add_moves(move_arr, from_pos, BB_TABLES.knight_moves[from_pos] & targets);
+  }
+
+  // King
+  BITBOARD king = own[PIECE_SLOT(KING)];
+  while (king) {
+    unsigned int from_pos = POP_LSB(king);
+    __add_moves(move_arr, from_pos, BB_TABLES.king_moves[from_pos] & targets);
+  }
 
-    // Pawns TODO: en passant
-    BITBOARD single_push = (bbs->white_pawns << 8) & bbs->empty_squares;
-    BITBOARD double_push = ((bbs->white_pawns & RANK_2_MASK) << 16) &
-                           bbs->empty_squares & (bbs->empty_squares << 8);
-    while (single_push) {
-      unsigned int to_pos = POP_LSB(single_push);
-      unsigned int from_pos = to_pos - 8;
+  __add_slider_moves(move_arr, own, targets, occupied, backend);
+
+  // Pawns TODO: en passant
+  const int back = us == COLOR_INDEX(WHITE) ? -8 : 8;
+  BITBOARD pawns = own[PIECE_SLOT(PAWN)];
+  BITBOARD single_push = PAWN_FORWARD(pawns, us, 1) & empty_squares;
+  BITBOARD double_push = PAWN_FORWARD(pawns & PAWN_START_RANK(us), us, 2) &
+                         empty_squares & PAWN_FORWARD(empty_squares, us, 1);
+  __add_pawn_moves(move_arr, single_push, back, PAWN_PROMOTION_RANK(us));
+  __add_pawn_moves(move_arr, double_push, 2 * back, 0);
+
+  while (pawns) {
+    unsigned int from_pos = POP_LSB(pawns);
+    BITBOARD captures =
+        BB_TABLES.pawn_captures[us][from_pos] & bbs->occupancy[us ^ 1];
+    while (captures) {
+      unsigned int to_pos = POP_LSB(captures);
       move_info_t move = from_pos | (to_pos << 6);
-      if (to_pos >= 56)
+      if ((1ULL << to_pos) & PAWN_PROMOTION_RANK(us))
         move |= FLAG_PROMOTION;
       move_arr->moves[move_arr->len++] = move;
     }
-    while (double_push) {
-      unsigned int to_pos = POP_LSB(double_push);
-      unsigned int from_pos = to_pos - 16;
-      move_info_t move = from_pos | (to_pos << 6);
-      move_arr->moves[move_arr->len++] = move;
-    }
+  }
+}
 
-    BITBOARD pawns_copy = bbs->white_pawns;
-    while (pawns_copy) {
-      unsigned int from_pos = POP_LSB(pawns_copy);
-      BITBOARD capture_mask = bbs->white_pawn_captures[from_pos];
-      BITBOARD possible_captures = bbs->black_pieces & capture_mask;
-      while (possible_captures) {
-        unsigned int to_pos = POP_LSB(possible_captures);
-        move_info_t move = from_pos | (to_pos << 6);
-        if (to_pos >= 56)
-          move |= FLAG_PROMOTION;
-        move_arr->moves[move_arr->len++] = move;
-      }
+/**
+ * @brief Computes all pseudo-legal moves given the current board.
+ * The moves are set in `move_arr`.
+ *
+ * @param bbs: An initialized ChessBitboards object.
+ * @param move_arr: The array to assign moves.
+ * @param color: The color to generate moves from.
+ */
+HOT_KERNEL void engine_generate_pseudolegal_moves(ChessBitboards *bbs,
+                                                  MoveArray *move_arr,
+                                                  enum PieceColor color) {
+  if (color == NOCOLOR) {
+    move_arr->len = 0;
+  } else if (SLIDER_BACKEND == SLIDERS_OBSTRUCTION) {
+    if (color == WHITE) {
+      __generate_moves(bbs, move_arr, COLOR_INDEX(WHITE), SLIDERS_OBSTRUCTION);
+    } else {
+      __generate_moves(bbs, move_arr, COLOR_INDEX(BLACK), SLIDERS_OBSTRUCTION);
     }
-  } else if (color == BLACK) {
-    //
-    // Black
-
-    // Knights
-    BITBOARD b_knights_copy = bbs->black_knights;
-    while (b_knights_copy) {
-      unsigned int from_pos = POP_LSB(b_knights_copy);
-      BITBOARD b_knight_moves_copy = bbs->knight_moves[from_pos];
-      while (b_knight_moves_copy) {
-        unsigned int to_pos = POP_LSB(b_knight_moves_copy);
-        if ((1ULL << to_pos) & ~bbs->black_pieces) {
-          move_info_t move = from_pos | (to_pos << 6);
-          move_arr->moves[move_arr->len++] = move;
-        }
-      }
+  } else if (SLIDER_BACKEND == SLIDERS_PEXT) {
+    if (color == WHITE) {
+      __generate_moves(bbs, move_arr, COLOR_INDEX(WHITE), SLIDERS_PEXT);
+    } else {
+      __generate_moves(bbs, move_arr, COLOR_INDEX(BLACK), SLIDERS_PEXT);
     }
+  } else {
+    if (color == WHITE) {
+      __generate_moves(bbs, move_arr, COLOR_INDEX(WHITE), SLIDERS_MAGIC);
+    } else {
+      __generate_moves(bbs, move_arr, COLOR_INDEX(BLACK), SLIDERS_MAGIC);
+    }
+  }
+}
 
-    // King
-    BITBOARD b_king_copy = bbs->black_king;
-    while (b_king_copy) {
-      unsigned int from_pos = POP_LSB(b_king_copy);
-      BITBOARD b_king_moves_copy = bbs->king_moves[from_pos];
-      while (b_king_moves_copy) {
-        unsigned int to_pos = POP_LSB(b_king_moves_copy);
-        if ((1ULL << to_pos) & ~bbs->black_pieces) {
-          move_info_t move = from_pos | (to_pos << 6);
-          move_arr->moves[move_arr->len++] = move;
-        }
-      }
+//
+// Batched Move Generation
+// Eight lanes of a PositionBatch at a time: their pawn and king targets are
+// computed in 512-bit vectors, pawns one direction at a time so that the
+// origin of every target is known. Knights and sliders are looked up piece by
+// piece; eight knight directions per lane cost more than the one or two
+// knights a position has. Each set of targets then goes to its move list
+// with vpcompressb, which packs the square numbers of a bitboard into
+// consecutive bytes, so there is no loop and no branch per move. CPUs
+// without AVX-512 VBMI2 run the single generator lane by lane.
+
+/**
+ * @brief Empty a batch.
+ *
+ * @param batch: The batch to clear.
+ */
+void engine_batch_clear(PositionBatch *batch) { batch->len = 0; }
+
+/**
+ * @brief Add a position to a batch.
+ *
+ * @param batch: The batch.
+ * @param bbs: The position to add (copied into the next lane).
+ * @return false if the batch is full, true otherwise.
+ */
+bool engine_batch_add(PositionBatch *batch, const ChessBitboards *bbs) {
+  if (batch->len == POSITION_BATCH_SIZE) {
+    return false;
+  }
+  unsigned int i = batch->len++;
+  for (unsigned int c = 0; c < 2; c++) {
+    for (unsigned int t = 0; t < 6; t++) {
+      batch->pieces[c][t][i] = bbs->pieces[c][t];
     }
+    batch->occupancy[c][i] = bbs->occupancy[c];
+  }
+  batch->all_pieces[i] = bbs->all_pieces;
+  return true;
+}
 
-    // Rooks
-    BITBOARD b_rook_copy = bbs->black_rooks;
-    while (b_rook_copy) {
-      unsigned int from_pos = POP_LSB(b_rook_copy);
-      BITBOARD blocker = bbs->rook_blocker_masks[from_pos] & bbs->all_pieces;
-      BITBOARD magic_index = (blocker * magic->ROOK_MAGICS[from_pos]) >>
-                             magic->ROOK_SHIFTS[from_pos];
-      BITBOARD b_rook_moves_copy = bbs->rook_move_table[from_pos][magic_index];
-      while (b_rook_moves_copy) {
-        unsigned int to_pos = POP_LSB(b_rook_moves_copy);
-        if ((1ULL << to_pos) & ~bbs->black_pieces) {
-          move_info_t move = from_pos | (to_pos << 6);
-          move_arr->moves[move_arr->len++] = move;
-        }
+/// engine_generate_batch() without AVX-512: the single generator on a copy
+/// of each lane.
+static void __generate_batch_scalar(const PositionBatch *batch,
+                                    MoveArray *moves, enum PieceColor color) {
+  ChessBitboards bbs;
+  for (unsigned int i = 0; i < batch->len; i++) {
+    for (unsigned int c = 0; c < 2; c++) {
+      for (unsigned int t = 0; t < 6; t++) {
+        bbs.pieces[c][t] = batch->pieces[c][t][i];
       }
+      bbs.occupancy[c] = batch->occupancy[c][i];
     }
+    bbs.all_pieces = batch->all_pieces[i];
+    engine_generate_pseudolegal_moves(&bbs, &moves[i], color);
+  }
+}
 
-    // Bishop
-    BITBOARD b_bishop_copy = bbs->black_bishops;
-    while (b_bishop_copy) {
-      unsigned int from_pos = POP_LSB(b_bishop_copy);
-      BITBOARD blocker = bbs->bishop_blocker_masks[from_pos] & bbs->all_pieces;
-      BITBOARD magic_index = (blocker * magic->BISHOP_MAGICS[from_pos]) >>
-                             magic->BISHOP_SHIFTS[from_pos];
-      BITBOARD b_bishop_moves_copy =
-          bbs->bishop_move_table[from_pos][magic_index];
-      while (b_bishop_moves_copy) {
-        unsigned int to_pos = POP_LSB(b_bishop_moves_copy);
-        if ((1ULL << to_pos) & ~bbs->black_pieces) {
-          move_info_t move = from_pos | (to_pos << 6);
-          move_arr->moves[move_arr->len++] = move;
-        }
-      }
+#if HAVE_BATCH_AVX512
+/// One step of a piece: the bit delta (positive is a left shift) and the
+/// squares it may land on without wrapping around the board.
+typedef struct {
+  int delta;
+  BITBOARD landing;
+} Step;
+
+#define NOT_A (~FILE_A_MASK)
+#define NOT_H (~FILE_H_MASK)
+
+static const Step KING_STEPS[8] = {{8, ~0ULL}, {-8, ~0ULL}, {-1, NOT_A},
+                                   {1, NOT_H}, {7, NOT_A},  {9, NOT_H},
+                                   {-9, NOT_A}, {-7, NOT_H}};
+/// Pawn captures by color index: towards the h-file, towards the a-file.
+static const Step PAWN_CAPTURE_STEPS[2][2] = {{{7, NOT_A}, {9, NOT_H}},
+                                              {{-9, NOT_A}, {-7, NOT_H}}};
+
+/// Square numbers, one per byte, for vpcompressb.
+static const unsigned char SQUARE_BYTES[64] __attribute__((aligned(64))) = {
+    0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  10, 11, 12, 13, 14, 15,
+    16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31,
+    32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47,
+    48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63};
+
+/**
+ * @brief Append a move to each of at most 16 squares of `targets`. The move
+ * to square `to` is ((to & keep) + add) | (to << 6): with `keep` 0 every move
+ * comes from square `add`, with `keep` 63 from `add` squares away (and `add`
+ * may carry FLAG_PROMOTION).
+ */
+BATCH_AVX512 static inline __attribute__((always_inline)) void
+__emit_moves(MoveArray *move_arr, BITBOARD targets, short keep, short add) {
+  unsigned int count = __builtin_popcountll(targets);
+  assert(count <= 16);
+  __m512i squares =
+      _mm512_maskz_compress_epi8(targets, _mm512_load_si512(SQUARE_BYTES));
+  __m256i to = _mm256_cvtepu8_epi16(_mm512_castsi512_si128(squares));
+  __m256i from = _mm256_add_epi16(
+      _mm256_and_si256(to, _mm256_set1_epi16(keep)), _mm256_set1_epi16(add));
+  _mm256_mask_storeu_epi16(move_arr->moves + move_arr->len,
+                           (__mmask16)((1U << count) - 1),
+                           _mm256_or_si256(from, _mm256_slli_epi16(to, 6)));
+  move_arr->len += count;
+}
+
+/// Append a pawn move to every square of `targets`, coming from `from_offset`
+/// squares away and flagged as a promotion on `promotion_rank`.
+BATCH_AVX512 static inline __attribute__((always_inline)) void
+__emit_pawn_moves(MoveArray *move_arr, BITBOARD targets, int from_offset,
+                  BITBOARD promotion_rank) {
+  __emit_moves(move_arr, targets & ~promotion_rank, 63, from_offset);
+  if (targets & promotion_rank) {
+    __emit_moves(move_arr, targets & promotion_rank, 63,
+                 from_offset + FLAG_PROMOTION);
+  }
+}
+
+/// A step of every lane of a vector, masked to the landing squares.
+BATCH_AVX512 static inline __attribute__((always_inline)) __m512i
+__step_lanes(__m512i bb, Step step) {
+  __m512i moved = step.delta > 0 ? _mm512_slli_epi64(bb, step.delta)
+                                 : _mm512_srli_epi64(bb, -step.delta);
+  return _mm512_and_si512(moved, _mm512_set1_epi64(step.landing));
+}
+
+/// Move every lane of a vector `ranks` ranks forward for color index `us`.
+#define PAWN_FORWARD_LANES(bb, us, ranks)                                      \
+  ((us) == COLOR_INDEX(WHITE) ? _mm512_slli_epi64(bb, 8 * (ranks))             \
+                              : _mm512_srli_epi64(bb, 8 * (ranks)))
+
+/**
+ * @brief The batched move generator for one side. `us` and `backend` are
+ * compile-time constants at every call site.
+ */
+BATCH_AVX512 static inline __attribute__((always_inline)) void
+__generate_batch(const PositionBatch *batch, MoveArray *moves,
+                 const unsigned int us, const enum SliderBackend backend) {
+  const int back = us == COLOR_INDEX(WHITE) ? -8 : 8;
+  const __m512i ALL = _mm512_set1_epi64(-1);
+
+  for (unsigned int base = 0; base < batch->len; base += 8) {
+    //
+    // Targets of eight lanes (those past batch->len are computed, not used)
+    const __m512i pawns =
+        _mm512_load_si512(&batch->pieces[us][PIECE_SLOT(PAWN)][base]);
+    const __m512i kings =
+        _mm512_load_si512(&batch->pieces[us][PIECE_SLOT(KING)][base]);
+    const __m512i them = _mm512_load_si512(&batch->occupancy[us ^ 1][base]);
+    const __m512i targets = _mm512_andnot_si512(
+        _mm512_load_si512(&batch->occupancy[us][base]), ALL);
+    const __m512i empty =
+        _mm512_andnot_si512(_mm512_load_si512(&batch->all_pieces[base]), ALL);
+
+    BITBOARD push[8] __attribute__((aligned(64)));
+    BITBOARD double_push[8] __attribute__((aligned(64)));
+    BITBOARD captures[2][8] __attribute__((aligned(64)));
+    BITBOARD king[8] __attribute__((aligned(64)));
+
+    _mm512_store_si512(
+        push, _mm512_and_si512(PAWN_FORWARD_LANES(pawns, us, 1), empty));
+    __m512i start =
+        _mm512_and_si512(pawns, _mm512_set1_epi64(PAWN_START_RANK(us)));
+    _mm512_store_si512(
+        double_push,
+        _mm512_and_si512(
+            _mm512_and_si512(PAWN_FORWARD_LANES(start, us, 2), empty),
+            PAWN_FORWARD_LANES(empty, us, 1)));
+    for (unsigned int d = 0; d < 2; d++) {
+      _mm512_store_si512(
+          captures[d],
+          _mm512_and_si512(__step_lanes(pawns, PAWN_CAPTURE_STEPS[us][d]),
+                           them));
+    }
+    // One king per side: its targets need no direction to find the origin
+    __m512i king_targets = _mm512_setzero_si512();
+    for (unsigned int d = 0; d < 8; d++) {
+      king_targets =
+          _mm512_or_si512(king_targets, __step_lanes(kings, KING_STEPS[d]));
     }
+    _mm512_store_si512(king, _mm512_and_si512(king_targets, targets));
 
-    // Queen
-    BITBOARD b_queen_copy = bbs->black_queens;
-    while (b_queen_copy) {
-      unsigned int from_pos = POP_LSB(b_queen_copy);
-
-      // Diagonals
-      BITBOARD diag_blocker =
-          bbs->bishop_blocker_masks[from_pos] & bbs->all_pieces;
-      BITBOARD diag_magic_index =
-          (diag_blocker * magic->BISHOP_MAGICS[from_pos]) >>
-          magic->BISHOP_SHIFTS[from_pos];
-      BITBOARD b_diag_moves_copy =
-          bbs->bishop_move_table[from_pos][diag_magic_index];
-      while (b_diag_moves_copy) {
-        unsigned int to_pos = POP_LSB(b_diag_moves_copy);
-        if ((1ULL << to_pos) & ~bbs->black_pieces) {
-          move_info_t move = from_pos | (to_pos << 6);
-          move_arr->moves[move_arr->len++] = move;
-        }
+    //
+    // Move lists
+    for (unsigned int j = 0; j < 8 && base + j < batch->len; j++) {
+      const unsigned int i = base + j;
+      MoveArray *move_arr = &moves[i];
+      move_arr->len = 0;
+
+      const BITBOARD lane_targets = ~batch->occupancy[us][i];
+      const BITBOARD occupied = batch->all_pieces[i];
+
+      BITBOARD own_king = batch->pieces[us][PIECE_SLOT(KING)][i];
+      if (own_king) {
+        __emit_moves(move_arr, king[j], 0, __builtin_ctzll(own_king));
       }
 
-      // Straights
-      BITBOARD straight_blocker =
-          bbs->rook_blocker_masks[from_pos] & bbs->all_pieces;
-      BITBOARD straight_magic_index =
-          (straight_blocker * magic->ROOK_MAGICS[from_pos]) >>
-          magic->ROOK_SHIFTS[from_pos];
-      BITBOARD b_straight_moves_copy =
-          bbs->rook_move_table[from_pos][straight_magic_index];
-      while (b_straight_moves_copy) {
-        unsigned int to_pos = POP_LSB(b_straight_moves_copy);
-        if ((1ULL << to_pos) & ~bbs->black_pieces) {
-          move_info_t move = from_pos | (to_pos << 6);
-          move_arr->moves[move_arr->len++] = move;
-        }
+      // Knights and sliders piece by piece, as in __generate_moves()
+      BITBOARD knights = batch->pieces[us][PIECE_SLOT(KNIGHT)][i];
+      while (knights) {
+        unsigned int from_pos = POP_LSB(knights);
+        __emit_moves(move_arr, BB_TABLES.knight_moves[from_pos] & lane_targets,
+                     0, from_pos);
+      }
+      BITBOARD rooks = batch->pieces[us][PIECE_SLOT(ROOK)][i];
+      while (rooks) {
+        unsigned int from_pos = POP_LSB(rooks);
+        __emit_moves(move_arr,
+                     ROOK_MOVES(from_pos, occupied, backend) & lane_targets,
+                     0, from_pos);
+      }
+      BITBOARD bishops = batch->pieces[us][PIECE_SLOT(BISHOP)][i];
+      while (bishops) {
+        unsigned int from_pos = POP_LSB(bishops);
+        __emit_moves(move_arr,
+                     BISHOP_MOVES(from_pos, occupied, backend) & lane_targets,
+                     0, from_pos);
+      }
+      BITBOARD queens = batch->pieces[us][PIECE_SLOT(QUEEN)][i];
+      while (queens) {
+        unsigned int from_pos = POP_LSB(queens);
+        __emit_moves(move_arr,
+                     BISHOP_MOVES(from_pos, occupied, backend) & lane_targets,
+                     0, from_pos);
+        __emit_moves(move_arr,
+                     ROOK_MOVES(from_pos, occupied, backend) & lane_targets,
+                     0, from_pos);
+      }
+
+      __emit_pawn_moves(move_arr, push[j], back, PAWN_PROMOTION_RANK(us));
+      __emit_pawn_moves(move_arr, double_push[j], 2 * back, 0);
+      for (unsigned int d = 0; d < 2; d++) {
+        __emit_pawn_moves(move_arr, captures[d][j],
+                          -PAWN_CAPTURE_STEPS[us][d].delta,
+                          PAWN_PROMOTION_RANK(us));
       }
     }
+  }
+}
 
-    // Pawns TODO: en passant
-    BITBOARD single_push = (bbs->black_pawns >> 8) & bbs->empty_squares;
-    BITBOARD double_push = ((bbs->black_pawns & RANK_7_MASK) >> 16) &
-                           bbs->empty_squares & (bbs->empty_squares >> 8);
-    while (single_push) {
-      unsigned int to_pos = POP_LSB(single_push);
-      unsigned int from_pos = to_pos + 8;
-      move_info_t move = from_pos | (to_pos << 6);
-      if (to_pos <= 7)
-        move |= FLAG_PROMOTION;
-      move_arr->moves[move_arr->len++] = move;
+/// __generate_batch() for the side to move and the current slider backend.
+BATCH_AVX512 static void __generate_batch_avx512(const PositionBatch *batch,
+                                                 MoveArray *moves,
+                                                 enum PieceColor color) {
+  if (SLIDER_BACKEND == SLIDERS_OBSTRUCTION) {
+    if (color == WHITE) {
+      __generate_batch(batch, moves, COLOR_INDEX(WHITE), SLIDERS_OBSTRUCTION);
+    } else {
+      __generate_batch(batch, moves, COLOR_INDEX(BLACK), SLIDERS_OBSTRUCTION);
     }
-    while (double_push) {
-      unsigned int to_pos = POP_LSB(double_push);
-      unsigned int from_pos = to_pos + 16;
-      move_info_t move = from_pos | (to_pos << 6);
-      move_arr->moves[move_arr->len++] = move;
+  } else if (SLIDER_BACKEND == SLIDERS_PEXT) {
+    if (color == WHITE) {
+      __generate_batch(batch, moves, COLOR_INDEX(WHITE), SLIDERS_PEXT);
+    } else {
+      __generate_batch(batch, moves, COLOR_INDEX(BLACK), SLIDERS_PEXT);
     }
+  } else {
+    if (color == WHITE) {
+      __generate_batch(batch, moves, COLOR_INDEX(WHITE), SLIDERS_MAGIC);
+    } else {
+      __generate_batch(batch, moves, COLOR_INDEX(BLACK), SLIDERS_MAGIC);
+    }
+  }
+}
+#endif
 
-    BITBOARD pawns_copy = bbs->black_pawns;
-    while (pawns_copy) {
-      unsigned int from_pos = POP_LSB(pawns_copy);
-      BITBOARD capture_mask = bbs->black_pawn_captures[from_pos];
-      BITBOARD possible_captures = bbs->white_pieces & capture_mask;
-      while (possible_captures) {
-        unsigned int to_pos = POP_LSB(possible_captures);
-        move_info_t move = from_pos | (to_pos << 6);
-        if (to_pos <= 7)
-          move |= FLAG_PROMOTION;
-        move_arr->moves[move_arr->len++] = move;
-      }
+/**
+ * @brief Computes the pseudo-legal moves of every position in a batch, all
+ * with the same color to move. moves[i] gets the same moves as
+ * engine_generate_pseudolegal_moves() gives for position i, although not
+ * necessarily in the same order.
+ *
+ * @param batch: The positions.
+ * @param moves: batch->len arrays to assign the moves.
+ * @param color: The color to generate moves for.
+ */
+void engine_generate_batch(const PositionBatch *batch, MoveArray *moves,
+                           enum PieceColor color) {
+  if (color == NOCOLOR) {
+    for (unsigned int i = 0; i < batch->len; i++) {
+      moves[i].len = 0;
     }
+    return;
+  }
+#if HAVE_BATCH_AVX512
+  if (BATCH_AVX512_SUPPORTED) {
+    __generate_batch_avx512(batch, moves, color);
+    return;
   }
+#endif
+  __generate_batch_scalar(batch, moves, color);
+}
+
+/**
+ * @brief Name the kernel engine_generate_batch() uses on this CPU.
+ *
+ * @return "avx512" with AVX-512 VBMI2, "scalar" otherwise.
+ */
+const char *engine_batch_kernel() {
+  return BATCH_AVX512_SUPPORTED ? "avx512" : "scalar";
 }
 
 /**
  * @brief Determine if a color is in check.
  *
  * @param bbs: An existing ChessBitboards object.
- * @param magic: An initialized MagicInfo object.
  * @param color: The color in question.
  * @return Will return true if the color in question is in check, and false
  * otherwise.
  */
-bool engine_color_in_check(ChessBitboards *bbs, MagicInfo *magic_info,
-                           enum PieceColor color) {
-  MoveArray potential_moves;
-
-  if (color == WHITE) {
-    //
-    // Is white in check?
-    engine_generate_pseudolegal_moves(bbs, magic_info, &potential_moves, BLACK);
-
-    for (unsigned int i = 0; i < potential_moves.len; i++) {
-      unsigned int to_pos = GET_TO_POS(potential_moves.moves[i]);
-      if ((1ULL << to_pos) & bbs->white_king) {
-        return true;
-      }
-    }
-  } else if (color == BLACK) {
-    //
-    // Is black in check?
-    engine_generate_pseudolegal_moves(bbs, magic_info, &potential_moves, WHITE);
-
-    for (unsigned int i = 0; i < potential_moves.len; i++) {
-      unsigned int to_pos = GET_TO_POS(potential_moves.moves[i]);
-      if ((1ULL << to_pos) & bbs->black_king) {
-        return true;
-      }
-    }
+HOT_KERNEL bool engine_color_in_check(ChessBitboards *bbs,
+                                      enum PieceColor color) {
+  if (color == NOCOLOR) {
+    return false;
   }
 
-  return false;
+  // One set-wise attack map of the other side instead of generating its moves
+  BITBOARD attacked = attacks_by_color(bbs, color == WHITE ? BLACK : WHITE);
+  return (attacked & bbs->pieces[COLOR_INDEX(color)][PIECE_SLOT(KING)]) != 0;
 }
 
 /**
  * @brief Determine if a color is in checkmate or stalemate.
  *
  * @param bbs: An existing ChessBitboards object.
- * @param magic: An initialized MagicInfo object.
  * @param color: The color in question.
  * @return 1 if checkmate, 2 if stalemate, 0 otherwise.
  */
-int engine_check_game_over(ChessBitboards *bbs, MagicInfo *magic,
-                           enum PieceColor color) {
+int engine_check_game_over(ChessBitboards *bbs, enum PieceColor color) {
   MoveArray moves;
-  engine_generate_pseudolegal_moves(bbs, magic, &moves, color);
+  engine_generate_pseudolegal_moves(bbs, &moves, color);
 
   for (unsigned int i = 0; i < moves.len; i++) {
     move_info_t move = moves.moves[i];
-    unsigned int from_pos = GET_FROM_POS(move);
-    unsigned int to_pos = GET_TO_POS(move);
-
-    // Make the move
-    Piece captured = engine_move(bbs, from_pos, to_pos);
-
-    bool still_in_check = engine_color_in_check(bbs, magic, color);
-
-    // Undo the move — move piece back, restore capture
-    if (move & FLAG_PROMOTION)
-      engine_undo_promotion(bbs, to_pos, color);
-    engine_move(bbs, to_pos, from_pos);
-    engine_undo_capture(bbs, &captured, to_pos);
+    UndoInfo undo;
+    engine_make(bbs, move, &undo);
+    bool still_in_check = engine_color_in_check(bbs, color);
+    engine_unmake(bbs, move, &undo);
 
     if (!still_in_check) {
       return 0; // Found at least one legal move, game not over
@@ -489,12 +1183,19 @@ int engine_check_game_over(ChessBitboards *bbs, MagicInfo *magic,
   }
 
   // No legal moves found
-  if (engine_color_in_check(bbs, magic, color)) {
+  if (engine_color_in_check(bbs, color)) {
     return 1; // Checkmate
   }
   return 2; // Stalemate
 }
 
+/// Piece for every mailbox piece code (see PIECE_CODE).
+static const Piece PIECE_FROM_CODE[16] = {
+    {EMPTY, NOCOLOR}, {PAWN, WHITE},   {BISHOP, WHITE},  {KNIGHT, WHITE},
+    {ROOK, WHITE},    {QUEEN, WHITE},  {KING, WHITE},    {EMPTY, NOCOLOR},
+    {EMPTY, NOCOLOR}, {PAWN, BLACK},   {BISHOP, BLACK},  {KNIGHT, BLACK},
+    {ROOK, BLACK},    {QUEEN, BLACK},  {KING, BLACK},    {EMPTY, NOCOLOR}};
+
 /**
  * @brief Get the Piece at a certain square position.
  *
@@ -503,254 +1204,424 @@ int engine_check_game_over(ChessBitboards *bbs, MagicInfo *magic,
  * @return The Piece at position `pos`.
  */
 Piece __get_piece_at(ChessBitboards *bbs, unsigned int pos) {
-  BITBOARD mask = 1ULL << pos;
-
-  if ((bbs->all_pieces & mask) == 0)
-    return (Piece){.type = EMPTY, .color = NOCOLOR};
-
-  // White pieces
-  if (bbs->white_pawns & mask)
-    return (Piece){.type = PAWN, .color = WHITE};
-  if (bbs->white_bishops & mask)
-    return (Piece){.type = BISHOP, .color = WHITE};
-  if (bbs->white_knights & mask)
-    return (Piece){.type = KNIGHT, .color = WHITE};
-  if (bbs->white_rooks & mask)
-    return (Piece){.type = ROOK, .color = WHITE};
-  if (bbs->white_queens & mask)
-    return (Piece){.type = QUEEN, .color = WHITE};
-  if (bbs->white_king & mask)
-    return (Piece){.type = KING, .color = WHITE};
-
-  // Black
-  if (bbs->black_pawns & mask)
-    return (Piece){.type = PAWN, .color = BLACK};
-  if (bbs->black_bishops & mask)
-    return (Piece){.type = BISHOP, .color = BLACK};
-  if (bbs->black_knights & mask)
-    return (Piece){.type = KNIGHT, .color = BLACK};
-  if (bbs->black_rooks & mask)
-    return (Piece){.type = ROOK, .color = BLACK};
-  if (bbs->black_queens & mask)
-    return (Piece){.type = QUEEN, .color = BLACK};
-  if (bbs->black_king & mask)
-    return (Piece){.type = KING, .color = BLACK};
-
-  return (Piece){.type = EMPTY, .color = NOCOLOR};
-}
-
-void __update_capture_bitboards(ChessBitboards *bbs, Piece *piece,
-                                unsigned int to_pos) {
-  if (piece->color == NOCOLOR)
-    return;
+  return PIECE_FROM_CODE[BB_CODE_AT(bbs, pos)];
+}
 
-  if (piece->color == WHITE) {
-    // White
-    if (piece->type == PAWN) {
-      clear_bit(&bbs->white_pawns, to_pos);
-    } else if (piece->type == BISHOP) {
-      clear_bit(&bbs->white_bishops, to_pos);
-    } else if (piece->type == KNIGHT) {
-      clear_bit(&bbs->white_knights, to_pos);
-    } else if (piece->type == ROOK) {
-      clear_bit(&bbs->white_rooks, to_pos);
-    } else if (piece->type == QUEEN) {
-      clear_bit(&bbs->white_queens, to_pos);
-    } else if (piece->type == KING) {
-      clear_bit(&bbs->white_king, to_pos);
-    }
+/**
+ * @brief Get the Piece at a certain square position.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @param pos: The square position.
+ * @return The Piece at position `pos`.
+ */
+Piece engine_piece_at(ChessBitboards *bbs, unsigned int pos) {
+  return __get_piece_at(bbs, pos);
+}
 
-    clear_bit(&bbs->white_pieces, to_pos);
-
-  } else if (piece->color == BLACK) {
-    // Black
-    if (piece->type == PAWN) {
-      clear_bit(&bbs->black_pawns, to_pos);
-    } else if (piece->type == BISHOP) {
-      clear_bit(&bbs->black_bishops, to_pos);
-    } else if (piece->type == KNIGHT) {
-      clear_bit(&bbs->black_knights, to_pos);
-    } else if (piece->type == ROOK) {
-      clear_bit(&bbs->black_rooks, to_pos);
-    } else if (piece->type == QUEEN) {
-      clear_bit(&bbs->black_queens, to_pos);
-    } else if (piece->type == KING) {
-      clear_bit(&bbs->black_king, to_pos);
-    }
+/// Piece type added to a pawn's code when a move is flagged as a promotion
+/// (auto-queen), indexed by (move & FLAG_PROMOTION) != 0.
+static const unsigned char PROMOTION_DELTA[2] = {0, QUEEN - PAWN};
 
-    clear_bit(&bbs->black_pieces, to_pos);
-  }
+/// Index of a piece code's bitboard in the flattened ChessBitboards::pieces.
+/// EMPTY maps to the first one, where its capture mask is always 0.
+static const unsigned char PIECE_CODE_BITBOARD[16] = {
+    0, 0, 1, 2, 3, 4,  5,  0,  // white
+    0, 6, 7, 8, 9, 10, 11, 0}; // black
+
+/**
+ * @brief XOR a move in or out of the bitboards. Making and taking back a move
+ * are the same operation, and a capture of EMPTY is masked to a no-op instead
+ * of branched around.
+ */
+static inline void __toggle_move(ChessBitboards *bbs, BITBOARD from_mask,
+                                 BITBOARD to_mask, unsigned char moving,
+                                 unsigned char captured, unsigned char placed) {
+  unsigned int us = PIECE_CODE_COLOR_INDEX(moving);
+  BITBOARD capture_mask =
+      to_mask & -(BITBOARD)(captured != PIECE_CODE(EMPTY, NOCOLOR));
+  BITBOARD *pieces = &bbs->pieces[0][0];
+
+  pieces[PIECE_CODE_BITBOARD[captured]] ^= capture_mask;
+  bbs->occupancy[us ^ 1] ^= capture_mask;
+
+  pieces[PIECE_CODE_BITBOARD[moving]] ^= from_mask;
+  pieces[PIECE_CODE_BITBOARD[placed]] ^= to_mask;
+  bbs->occupancy[us] ^= from_mask | to_mask;
+  bbs->all_pieces = bbs->occupancy[0] | bbs->occupancy[1];
+}
+
+/// Zobrist key of a piece code on a square (0 for an empty square).
+#define PIECE_KEY(code, pos)                                                   \
+  ZOBRIST_PIECES[PIECE_CODE_COLOR_INDEX(code)][PIECE_CODE_TYPE(code)][pos]
+/// Zobrist key of a piece code on a square if it is a pawn, 0 otherwise.
+#define PAWN_KEY(code, pos)                                                    \
+  (PIECE_KEY(code, pos) & -(unsigned long long)(PIECE_CODE_TYPE(code) == PAWN))
 
-  clear_bit(&bbs->all_pieces, to_pos);
-  set_bit(&bbs->empty_squares, to_pos);
+/**
+ * @brief Apply a move to the bitboards, the mailbox, the hashes and the
+ * incremental scores of a position.
+ */
+static inline void __apply_move(ChessBitboards *bbs, unsigned int from_pos,
+                                unsigned int to_pos, unsigned char moving,
+                                unsigned char captured, unsigned char placed) {
+  __toggle_move(bbs, 1ULL << from_pos, 1ULL << to_pos, moving, captured,
+                placed);
+
+  BB_SET_CODE(bbs, from_pos, PIECE_CODE(EMPTY, NOCOLOR));
+  BB_SET_CODE(bbs, to_pos, placed);
+  bbs->hash ^= PIECE_KEY(captured, to_pos) ^ PIECE_KEY(moving, from_pos) ^
+               PIECE_KEY(placed, to_pos);
+  bbs->pawn_hash ^= PAWN_KEY(captured, to_pos) ^ PAWN_KEY(moving, from_pos) ^
+                    PAWN_KEY(placed, to_pos);
+  bbs->mg_score += EVAL_MG[placed][to_pos] - EVAL_MG[moving][from_pos] -
+                   EVAL_MG[captured][to_pos];
+  bbs->eg_score += EVAL_EG[placed][to_pos] - EVAL_EG[moving][from_pos] -
+                   EVAL_EG[captured][to_pos];
+  bbs->phase += EVAL_PHASE[placed] - EVAL_PHASE[moving] - EVAL_PHASE[captured];
+#ifdef NNUE_EVAL
+  nnue_make(bbs, moving, captured, placed, from_pos, to_pos);
+#endif
 }
 
 /**
  * @brief Make a move and update all relevant bitboards in bbs.
  *
  * @param bbs: An existing ChessBitboards object.
- * @param from_pos: Where the piece to move originates.
- * @param to_pos: Where the piece to move lands.
- * @return The captured piece.
- */
-Piece engine_move(ChessBitboards *bbs, unsigned int from_pos,
-                  unsigned int to_pos) {
-  Piece moving_piece = __get_piece_at(bbs, from_pos);
-  Piece captured_piece = __get_piece_at(bbs, to_pos);
-
-  if (moving_piece.color == WHITE) {
-    // White
-    if (moving_piece.type == PAWN) {
-      set_bit(&bbs->white_pawns, to_pos);
-      clear_bit(&bbs->white_pawns, from_pos);
-    } else if (moving_piece.type == BISHOP) {
-      set_bit(&bbs->white_bishops, to_pos);
-      clear_bit(&bbs->white_bishops, from_pos);
-    } else if (moving_piece.type == KNIGHT) {
-      set_bit(&bbs->white_knights, to_pos);
-      clear_bit(&bbs->white_knights, from_pos);
-    } else if (moving_piece.type == ROOK) {
-      set_bit(&bbs->white_rooks, to_pos);
-      clear_bit(&bbs->white_rooks, from_pos);
-    } else if (moving_piece.type == QUEEN) {
-      set_bit(&bbs->white_queens, to_pos);
-      clear_bit(&bbs->white_queens, from_pos);
-    } else if (moving_piece.type == KING) {
-      set_bit(&bbs->white_king, to_pos);
-      clear_bit(&bbs->white_king, from_pos);
-    }
+ * @param move: The move to make. Promotions are taken from its flags.
+ * @param undo: Filled with what engine_unmake() needs to take the move back.
+ */
+void engine_make(ChessBitboards *bbs, move_info_t move, UndoInfo *undo) {
+  unsigned int from_pos = GET_FROM_POS(move);
+  unsigned int to_pos = GET_TO_POS(move);
 
-    set_bit(&bbs->white_pieces, to_pos);
-    clear_bit(&bbs->white_pieces, from_pos);
-
-    __update_capture_bitboards(bbs, &captured_piece, to_pos);
-
-  } else if (moving_piece.color == BLACK) {
-    // Black
-    if (moving_piece.type == PAWN) {
-      set_bit(&bbs->black_pawns, to_pos);
-      clear_bit(&bbs->black_pawns, from_pos);
-    } else if (moving_piece.type == BISHOP) {
-      set_bit(&bbs->black_bishops, to_pos);
-      clear_bit(&bbs->black_bishops, from_pos);
-    } else if (moving_piece.type == KNIGHT) {
-      set_bit(&bbs->black_knights, to_pos);
-      clear_bit(&bbs->black_knights, from_pos);
-    } else if (moving_piece.type == ROOK) {
-      set_bit(&bbs->black_rooks, to_pos);
-      clear_bit(&bbs->black_rooks, from_pos);
-    } else if (moving_piece.type == QUEEN) {
-      set_bit(&bbs->black_queens, to_pos);
-      clear_bit(&bbs->black_queens, from_pos);
-    } else if (moving_piece.type == KING) {
-      set_bit(&bbs->black_king, to_pos);
-      clear_bit(&bbs->black_king, from_pos);
-    }
+  unsigned char moving = BB_CODE_AT(bbs, from_pos);
+  unsigned char captured = BB_CODE_AT(bbs, to_pos);
+  unsigned char placed =
+      moving + PROMOTION_DELTA[(move & FLAG_PROMOTION) != 0];
+
+  undo->moving = moving;
+  undo->captured = captured;
+  undo->promotion = (placed != moving) * placed;
+  undo->hash = bbs->hash;
+  undo->pawn_hash = bbs->pawn_hash;
+  undo->mg_score = bbs->mg_score;
+  undo->eg_score = bbs->eg_score;
+  undo->phase = bbs->phase;
+
+  __apply_move(bbs, from_pos, to_pos, moving, captured, placed);
+}
 
-    set_bit(&bbs->black_pieces, to_pos);
-    clear_bit(&bbs->black_pieces, from_pos);
+/**
+ * @brief Copy a position and make a move on the copy (copy-make). No undo
+ * record is written: the original position is the way back.
+ *
+ * @param from: The position before the move; left unchanged.
+ * @param to: Set to the position after the move (must not be `from`).
+ * @param move: The move to make. Promotions are taken from its flags.
+ */
+void engine_make_copy(const ChessBitboards *from, ChessBitboards *to,
+                      move_info_t move) {
+  unsigned int from_pos = GET_FROM_POS(move);
+  unsigned int to_pos = GET_TO_POS(move);
 
-    __update_capture_bitboards(bbs, &captured_piece, to_pos);
-  }
+  unsigned char moving = BB_CODE_AT(from, from_pos);
+  unsigned char captured = BB_CODE_AT(from, to_pos);
+  unsigned char placed =
+      moving + PROMOTION_DELTA[(move & FLAG_PROMOTION) != 0];
 
-  set_bit(&bbs->all_pieces, to_pos);
-  clear_bit(&bbs->all_pieces, from_pos);
+  *to = *from;
+  __apply_move(to, from_pos, to_pos, moving, captured, placed);
+}
 
-  clear_bit(&bbs->empty_squares, to_pos);
-  set_bit(&bbs->empty_squares, from_pos);
+/**
+ * @brief Take back a move made with engine_make().
+ *
+ * @param bbs: The ChessBitboards object the move was made on.
+ * @param move: The move to take back.
+ * @param undo: The record filled by engine_make().
+ */
+void engine_unmake(ChessBitboards *bbs, move_info_t move,
+                   const UndoInfo *undo) {
+  unsigned int from_pos = GET_FROM_POS(move);
+  unsigned int to_pos = GET_TO_POS(move);
 
-  // Pawn promotion (auto-queen)
-  if ((bbs->white_pawns & (0xFFULL << 56))) {
-    // white pawn reached rank 8
-    BITBOARD promo_pawns = bbs->white_pawns & (0xFFULL << 56);
-    bbs->white_pawns &= ~promo_pawns;
-    bbs->white_queens |= promo_pawns;
-  }
-  if ((bbs->black_pawns & 0xFFULL)) {
-    // black pawn reached rank 1
-    BITBOARD promo_pawns = bbs->black_pawns & 0xFFULL;
-    bbs->black_pawns &= ~promo_pawns;
-    bbs->black_queens |= promo_pawns;
+#ifdef NNUE_EVAL
+  nnue_unmake(bbs, undo->moving, undo->captured, BB_CODE_AT(bbs, to_pos),
+              from_pos, to_pos);
+#endif
+  __toggle_move(bbs, 1ULL << from_pos, 1ULL << to_pos, undo->moving,
+                undo->captured, BB_CODE_AT(bbs, to_pos));
+
+  BB_SET_CODE(bbs, from_pos, undo->moving);
+  BB_SET_CODE(bbs, to_pos, undo->captured);
+  bbs->hash = undo->hash;
+  bbs->pawn_hash = undo->pawn_hash;
+  bbs->mg_score = undo->mg_score;
+  bbs->eg_score = undo->eg_score;
+  bbs->phase = undo->phase;
+}
+
+/**
+ * @brief Count the leaf nodes of the legal move tree (perft).
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @param depth: The number of half-moves to expand.
+ * @param color: The color to move.
+ * @return The number of leaf nodes at `depth`.
+ */
+unsigned long long engine_perft(ChessBitboards *bbs, unsigned int depth,
+                                enum PieceColor color) {
+  if (depth == 0) {
+    return 1;
   }
 
-  return captured_piece;
+  MoveArray moves;
+  engine_generate_pseudolegal_moves(bbs, &moves, color);
+
+  unsigned long long nodes = 0;
+  for (unsigned int i = 0; i < moves.len; i++) {
+    UndoInfo undo;
+    engine_make(bbs, moves.moves[i], &undo);
+    if (!engine_color_in_check(bbs, color)) {
+      nodes += engine_perft(bbs, depth - 1, color == WHITE ? BLACK : WHITE);
+    }
+    engine_unmake(bbs, moves.moves[i], &undo);
+  }
+  return nodes;
 }
 
+/// Positions the bench is run on (the usual perft test suite).
+static char *BENCH_FENS[] = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+    "r2q1rk1/pP1p2pp/Q4n2/bbp1p3/Np6/1B3NBn/pPPP1PPP/R3K2R b KQ - 0 1",
+    "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8"};
+#define NUM_BENCH_FENS (sizeof(BENCH_FENS) / sizeof(BENCH_FENS[0]))
+
+/// Names of the slider backends, by SliderBackend.
+static const char *SLIDER_BACKEND_NAMES[] = {"magic", "pext", "obstruction"};
+
 /**
- * @brief Replace the piece that may have been captured.
+ * @brief Time perft over the standard perft test positions with a slider
+ * backend. The current backend is restored afterwards.
  *
- * @param bbs: An existing ChessBitboards object.
- * @param captured: The captured piece to be re-placed back.
- * @param captured_pos: The position which the piece was captured at.
+ * @param depth: The perft depth.
+ * @param backend: The slider backend to run with.
+ * @param result: Filled with the backend name, nodes, time and speed.
+ * @return false if the backend is not supported, true otherwise.
  */
-void engine_undo_capture(ChessBitboards *bbs, Piece *captured,
-                         unsigned int captured_pos) {
-  if (captured->color == NOCOLOR)
+bool engine_bench(unsigned int depth, enum SliderBackend backend,
+                  BenchResult *result) {
+  enum SliderBackend initial = engine_slider_backend();
+  result->backend = SLIDER_BACKEND_NAMES[backend];
+  if (!engine_set_slider_backend(backend)) {
+    return false;
+  }
+
+  ChessBitboards bbs;
+  result->nodes = 0;
+  clock_t start = clock();
+  for (unsigned int i = 0; i < NUM_BENCH_FENS; i++) {
+    enum PieceColor turn =
+        strchr(BENCH_FENS[i], ' ')[1] == 'b' ? BLACK : WHITE;
+    bb_init_chess_boards(&bbs, BENCH_FENS[i]);
+    result->nodes += engine_perft(&bbs, depth, turn);
+  }
+  double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+  result->ms = elapsed * 1000.0;
+  result->nps = elapsed > 0 ? result->nodes / elapsed : 0.0;
+
+  engine_set_slider_backend(initial);
+  return true;
+}
+
+/// Append the legal positions `depth` half-moves from bbs to positions.
+static void __collect_positions(ChessBitboards *bbs, unsigned int depth,
+                                enum PieceColor color,
+                                ChessBitboards **positions,
+                                unsigned int *len, unsigned int *cap) {
+  if (depth == 0) {
+    if (*len == *cap) {
+      *cap = *cap ? *cap * 2 : 1024;
+      *positions = realloc(*positions, *cap * sizeof(ChessBitboards));
+    }
+    (*positions)[(*len)++] = *bbs;
     return;
+  }
 
-  if (captured->color == WHITE) {
-    // White
-    if (captured->type == PAWN) {
-      set_bit(&bbs->white_pawns, captured_pos);
-    } else if (captured->type == BISHOP) {
-      set_bit(&bbs->white_bishops, captured_pos);
-    } else if (captured->type == KNIGHT) {
-      set_bit(&bbs->white_knights, captured_pos);
-    } else if (captured->type == ROOK) {
-      set_bit(&bbs->white_rooks, captured_pos);
-    } else if (captured->type == QUEEN) {
-      set_bit(&bbs->white_queens, captured_pos);
-    } else if (captured->type == KING) {
-      set_bit(&bbs->white_king, captured_pos);
+  MoveArray moves;
+  engine_generate_pseudolegal_moves(bbs, &moves, color);
+  for (unsigned int i = 0; i < moves.len; i++) {
+    UndoInfo undo;
+    engine_make(bbs, moves.moves[i], &undo);
+    if (!engine_color_in_check(bbs, color)) {
+      __collect_positions(bbs, depth - 1, color == WHITE ? BLACK : WHITE,
+                          positions, len, cap);
     }
+    engine_unmake(bbs, moves.moves[i], &undo);
+  }
+}
 
-    set_bit(&bbs->white_pieces, captured_pos);
-
-  } else if (captured->color == BLACK) {
-    // Black
-    if (captured->type == PAWN) {
-      set_bit(&bbs->black_pawns, captured_pos);
-    } else if (captured->type == BISHOP) {
-      set_bit(&bbs->black_bishops, captured_pos);
-    } else if (captured->type == KNIGHT) {
-      set_bit(&bbs->black_knights, captured_pos);
-    } else if (captured->type == ROOK) {
-      set_bit(&bbs->black_rooks, captured_pos);
-    } else if (captured->type == QUEEN) {
-      set_bit(&bbs->black_queens, captured_pos);
-    } else if (captured->type == KING) {
-      set_bit(&bbs->black_king, captured_pos);
+/**
+ * @brief Time the piece-square evaluation of the positions two half-moves
+ * into the standard perft test positions, one position at a time and with
+ * eval_batch().
+ *
+ * @param rounds: The number of times every position is evaluated.
+ * @param result: Filled with the position count and both times.
+ * @return false if the two disagree on a score, true otherwise.
+ */
+bool engine_bench_eval(unsigned int rounds, EvalBenchResult *result) {
+  ChessBitboards *positions = NULL;
+  unsigned int len = 0, cap = 0;
+  for (unsigned int i = 0; i < NUM_BENCH_FENS; i++) {
+    enum PieceColor turn =
+        strchr(BENCH_FENS[i], ' ')[1] == 'b' ? BLACK : WHITE;
+    ChessBitboards bbs;
+    bb_init_chess_boards(&bbs, BENCH_FENS[i]);
+    __collect_positions(&bbs, 2, turn, &positions, &len, &cap);
+  }
+
+  PackedPosition *packed = malloc(len * sizeof(PackedPosition));
+  int *single = malloc(len * sizeof(int));
+  int *batch = malloc(len * sizeof(int));
+  for (unsigned int i = 0; i < len; i++) {
+    eval_pack(&positions[i], &packed[i]);
+  }
+
+  clock_t start = clock();
+  for (unsigned int r = 0; r < rounds; r++) {
+    for (unsigned int i = 0; i < len; i++) {
+      eval_compute(&positions[i]);
+      single[i] = eval_tapered(&positions[i]);
     }
+  }
+  result->single_ms = (double)(clock() - start) / CLOCKS_PER_SEC * 1000.0;
 
-    set_bit(&bbs->black_pieces, captured_pos);
+  start = clock();
+  for (unsigned int r = 0; r < rounds; r++) {
+    eval_batch(packed, batch, len);
   }
+  result->batch_ms = (double)(clock() - start) / CLOCKS_PER_SEC * 1000.0;
+
+  bool equal = memcmp(single, batch, len * sizeof(int)) == 0;
+  result->positions = len;
+  free(batch);
+  free(single);
+  free(packed);
+  free(positions);
+  return equal;
+}
 
-  set_bit(&bbs->all_pieces, captured_pos);
-  clear_bit(&bbs->empty_squares, captured_pos);
+/// qsort() order of moves, to compare move lists regardless of order.
+static int __compare_moves(const void *a, const void *b) {
+  return (int)*(const move_info_t *)a - (int)*(const move_info_t *)b;
 }
 
-void engine_undo_promotion(ChessBitboards *bbs, unsigned int pos,
-                           enum PieceColor color) {
-  if (color == WHITE) {
-    clear_bit(&bbs->white_queens, pos);
-    set_bit(&bbs->white_pawns, pos);
-  } else {
-    clear_bit(&bbs->black_queens, pos);
-    set_bit(&bbs->black_pawns, pos);
+/// Whether two move lists hold the same moves (both are sorted).
+static bool __same_moves(MoveArray *a, MoveArray *b) {
+  qsort(a->moves, a->len, sizeof(move_info_t), __compare_moves);
+  qsort(b->moves, b->len, sizeof(move_info_t), __compare_moves);
+  return a->len == b->len &&
+         memcmp(a->moves, b->moves, a->len * sizeof(move_info_t)) == 0;
+}
+
+/**
+ * @brief Time move generation for the positions two half-moves into the
+ * standard perft test positions, one position at a time and in batches.
+ *
+ * @param rounds: The number of times every position is generated.
+ * @param result: Filled with the position and move counts and both times.
+ * @return false if the two generators disagree on a move list, true
+ * otherwise.
+ */
+bool engine_bench_movegen(unsigned int rounds, MovegenBenchResult *result) {
+  // Two half-moves in, the side to move is the one of the root position
+  ChessBitboards *positions[2] = {NULL, NULL};
+  unsigned int len[2] = {0, 0}, cap[2] = {0, 0};
+  for (unsigned int i = 0; i < NUM_BENCH_FENS; i++) {
+    enum PieceColor turn =
+        strchr(BENCH_FENS[i], ' ')[1] == 'b' ? BLACK : WHITE;
+    ChessBitboards bbs;
+    bb_init_chess_boards(&bbs, BENCH_FENS[i]);
+    unsigned int c = COLOR_INDEX(turn);
+    __collect_positions(&bbs, 2, turn, &positions[c], &len[c], &cap[c]);
+  }
+
+  MoveArray *moves = malloc(POSITION_BATCH_SIZE * sizeof(MoveArray));
+  PositionBatch *batch = aligned_alloc(64, sizeof(PositionBatch));
+  unsigned long long single_moves = 0, batch_moves = 0;
+
+  clock_t start = clock();
+  for (unsigned int r = 0; r < rounds; r++) {
+    for (unsigned int c = 0; c < 2; c++) {
+      enum PieceColor color = c == COLOR_INDEX(WHITE) ? WHITE : BLACK;
+      for (unsigned int i = 0; i < len[c]; i++) {
+        engine_generate_pseudolegal_moves(&positions[c][i], moves, color);
+        single_moves += moves->len;
+      }
+    }
+  }
+  result->single_ms = (double)(clock() - start) / CLOCKS_PER_SEC * 1000.0;
+
+  // Filling the batches is timed too; callers pay for it as well
+  start = clock();
+  for (unsigned int r = 0; r < rounds; r++) {
+    for (unsigned int c = 0; c < 2; c++) {
+      enum PieceColor color = c == COLOR_INDEX(WHITE) ? WHITE : BLACK;
+      for (unsigned int i = 0; i < len[c]; i += POSITION_BATCH_SIZE) {
+        engine_batch_clear(batch);
+        for (unsigned int j = i; j < len[c] && j < i + POSITION_BATCH_SIZE;
+             j++) {
+          engine_batch_add(batch, &positions[c][j]);
+        }
+        engine_generate_batch(batch, moves, color);
+        for (unsigned int j = 0; j < batch->len; j++) {
+          batch_moves += moves[j].len;
+        }
+      }
+    }
   }
+  result->batch_ms = (double)(clock() - start) / CLOCKS_PER_SEC * 1000.0;
+
+  // Same moves for every position, not only the same number
+  bool equal = single_moves == batch_moves;
+  for (unsigned int c = 0; c < 2 && equal; c++) {
+    enum PieceColor color = c == COLOR_INDEX(WHITE) ? WHITE : BLACK;
+    for (unsigned int i = 0; i < len[c] && equal;
+         i += POSITION_BATCH_SIZE) {
+      engine_batch_clear(batch);
+      for (unsigned int j = i; j < len[c] && j < i + POSITION_BATCH_SIZE;
+           j++) {
+        engine_batch_add(batch, &positions[c][j]);
+      }
+      engine_generate_batch(batch, moves, color);
+      for (unsigned int j = 0; j < batch->len && equal; j++) {
+        MoveArray single;
+        engine_generate_pseudolegal_moves(&positions[c][i + j], &single,
+                                          color);
+        equal = __same_moves(&single, &moves[j]);
+      }
+    }
+  }
+
+  result->positions = len[0] + len[1];
+  result->moves = single_moves / (rounds ? rounds : 1);
+  free(batch);
+  free(moves);
+  free(positions[0]);
+  free(positions[1]);
+  return equal;
 }
 
 /**
- * @brief Returns a String of the move in chess notation (i.e., e2e4)
+ * @brief Write a move in chess notation (i.e., e2e4) without allocating.
  *
  * @param move: The MoveInfo value.
- * @return A String in chess notation. NOTE: this must be freed using
- * str_free().
+ * @param notation: A buffer of at least MOVE_NOTATION_SIZE bytes.
  */
-String move_info_to_chess_notation(move_info_t move) {
-  char buffer[6] = {0};
-  String str;
-
+void engine_move_notation(move_info_t move, char *notation) {
   unsigned int from_pos = GET_FROM_POS(move);
   unsigned int from_rank = from_pos / 8 + 1;
   unsigned int from_file = 7 - from_pos % 8;
@@ -761,15 +1632,64 @@ String move_info_to_chess_notation(move_info_t move) {
 
   const char FILE_CHARS[8] = {'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h'};
 
-  buffer[0] = FILE_CHARS[from_file];
-  buffer[1] = '0' + from_rank;
-  buffer[2] = FILE_CHARS[to_file];
-  buffer[3] = '0' + to_rank;
+  notation[0] = FILE_CHARS[from_file];
+  notation[1] = '0' + from_rank;
+  notation[2] = FILE_CHARS[to_file];
+  notation[3] = '0' + to_rank;
+  notation[4] = '\0';
 
   if (move & FLAG_PROMOTION) {
-    buffer[4] = 'q'; // always queen for now
+    notation[4] = 'q'; // always queen for now
+    notation[5] = '\0';
+  }
+}
+
+/**
+ * @brief Returns a String of the move in chess notation (i.e., e2e4)
+ *
+ * @param move: The MoveInfo value.
+ * @return A String in chess notation. NOTE: this must be freed using
+ * str_free().
+ */
+String move_info_to_chess_notation(move_info_t move) {
+  char buffer[MOVE_NOTATION_SIZE];
+  engine_move_notation(move, buffer);
+  return str_create(buffer);
+}
+
+/**
+ * @brief Convert a move in chess notation (i.e., e2e4, a7a8q) to the matching
+ * pseudo-legal move of `color`, including its flags.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @param notation: The move in long algebraic notation.
+ * @param color: The color making the move.
+ * @param move: Set to the matching move on success.
+ * @return true if the notation matches a pseudo-legal move, false otherwise.
+ */
+bool engine_parse_move(ChessBitboards *bbs, const char *notation,
+                       enum PieceColor color, move_info_t *move) {
+  if (!notation[0] || !notation[1] || !notation[2] || !notation[3]) {
+    return false;
+  }
+  if (notation[0] < 'a' || notation[0] > 'h' || notation[1] < '1' ||
+      notation[1] > '8' || notation[2] < 'a' || notation[2] > 'h' ||
+      notation[3] < '1' || notation[3] > '8') {
+    return false;
   }
 
-  str = str_create(buffer);
-  return str;
+  // Inverse of move_info_to_chess_notation (file 'a' maps to index 7)
+  unsigned int from_pos = (notation[1] - '1') * 8 + (7 - (notation[0] - 'a'));
+  unsigned int to_pos = (notation[3] - '1') * 8 + (7 - (notation[2] - 'a'));
+
+  MoveArray moves;
+  engine_generate_pseudolegal_moves(bbs, &moves, color);
+  for (unsigned int i = 0; i < moves.len; i++) {
+    if (GET_FROM_POS(moves.moves[i]) == from_pos &&
+        GET_TO_POS(moves.moves[i]) == to_pos) {
+      *move = moves.moves[i];
+      return true;
+    }
+  }
+  return false;
 }
@@ -0,0 +1,456 @@
+#include "eval.h"
+#include "attacks.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+//
+// Piece-Square Tables
+// From white's point of view: row 0 is the 8th rank, column 0 the a-file.
+// Black pieces use the same tables mirrored vertically.
+
+// Pawns
+static const int pawn_mg_table[8][8] = {
+    {0, 0, 0, 0, 0, 0, 0, 0},         {50, 50, 50, 50, 50, 50, 50, 50},
+    {10, 10, 20, 30, 30, 20, 10, 10}, {5, 5, 10, 25, 25, 10, 5, 5},
+    {0, 0, 0, 20, 20, 0, 0, 0},       {5, -5, -10, 0, 0, -10, -5, 5},
+    {5, 10, 10, -20, -20, 10, 10, 5}, {0, 0, 0, 0, 0, 0, 0, 0}};
+
+// Pawns (endgame): only how far they have advanced matters
+static const int pawn_eg_table[8][8] = {
+    {0, 0, 0, 0, 0, 0, 0, 0},         {80, 80, 80, 80, 80, 80, 80, 80},
+    {50, 50, 50, 50, 50, 50, 50, 50}, {30, 30, 30, 30, 30, 30, 30, 30},
+    {15, 15, 15, 15, 15, 15, 15, 15}, {5, 5, 5, 5, 5, 5, 5, 5},
+    {0, 0, 0, 0, 0, 0, 0, 0},         {0, 0, 0, 0, 0, 0, 0, 0}};
+
+// Knights
+static const int knight_table[8][8] = {
+    {-50, -40, -30, -30, -30, -30, -40, -50},
+    {-40, -20, 0, 0, 0, 0, -20, -40},
+    {-30, 0, 10, 15, 15, 10, 0, -30},
+    {-30, 5, 15, 20, 20, 15, 5, -30},
+    {-30, 0, 15, 20, 20, 15, 0, -30},
+    {-30, 5, 10, 15, 15, 10, 5, -30},
+    {-40, -20, 0, 5, 5, 0, -20, -40},
+    {-50, -40, -30, -30, -30, -30, -40, -50}};
+
+// Bishops
+static const int bishop_table[8][8] = {
+    {-20, -10, -10, -10, -10, -10, -10, -20},
+    {-10, 0, 0, 0, 0, 0, 0, -10},
+    {-10, 0, 10, 10, 10, 10, 0, -10},
+    {-10, 5, 5, 10, 10, 5, 5, -10},
+    {-10, 0, 5, 10, 10, 5, 0, -10},
+    {-10, 10, 10, 10, 10, 10, 10, -10},
+    {-10, 5, 0, 0, 0, 0, 5, -10},
+    {-20, -10, -10, -10, -10, -10, -10, -20}};
+
+// Rooks
+static const int rook_table[8][8] = {
+    {0, 0, 0, 0, 0, 0, 0, 0},   {5, 10, 10, 10, 10, 10, 10, 5},
+    {-5, 0, 0, 0, 0, 0, 0, -5}, {-5, 0, 0, 0, 0, 0, 0, -5},
+    {-5, 0, 0, 0, 0, 0, 0, -5}, {-5, 0, 0, 0, 0, 0, 0, -5},
+    {-5, 0, 0, 0, 0, 0, 0, -5}, {0, 0, 0, 5, 5, 0, 0, 0}};
+
+// Queens
+static const int queen_table[8][8] = {{-20, -10, -10, -5, -5, -10, -10, -20},
+                                      {-10, 0, 0, 0, 0, 0, 0, -10},
+                                      {-10, 0, 5, 5, 5, 5, 0, -10},
+                                      {-5, 0, 5, 5, 5, 5, 0, -5},
+                                      {0, 0, 5, 5, 5, 5, 0, -5},
+                                      {-10, 5, 5, 5, 5, 5, 0, -10},
+                                      {-10, 0, 5, 0, 0, 0, 0, -10},
+                                      {-20, -10, -10, -5, -5, -10, -10, -20}};
+
+// King (middlegame): stay castled behind the pawns
+static const int king_mg_table[8][8] = {
+    {-30, -40, -40, -50, -50, -40, -40, -30},
+    {-30, -40, -40, -50, -50, -40, -40, -30},
+    {-30, -40, -40, -50, -50, -40, -40, -30},
+    {-30, -40, -40, -50, -50, -40, -40, -30},
+    {-20, -30, -30, -40, -40, -30, -30, -20},
+    {-10, -20, -20, -20, -20, -20, -20, -10},
+    {20, 20, 0, 0, 0, 0, 20, 20},
+    {20, 30, 10, 0, 0, 10, 30, 20}};
+
+// King (endgame): head for the centre
+static const int king_eg_table[8][8] = {
+    {-50, -40, -30, -20, -20, -30, -40, -50},
+    {-30, -20, -10, 0, 0, -10, -20, -30},
+    {-30, -10, 20, 30, 30, 20, -10, -30},
+    {-30, -10, 30, 40, 40, 30, -10, -30},
+    {-30, -10, 30, 40, 40, 30, -10, -30},
+    {-30, -10, 20, 30, 30, 20, -10, -30},
+    {-30, -30, 0, 0, 0, 0, -30, -30},
+    {-50, -30, -30, -30, -30, -30, -30, -50}};
+
+/// Tables by piece type; the other pieces use one table for both halves.
+static const int (*const MG_TABLES[8])[8] = {
+    NULL,       pawn_mg_table, bishop_table,  knight_table,
+    rook_table, queen_table,   king_mg_table, NULL};
+static const int (*const EG_TABLES[8])[8] = {
+    NULL,       pawn_eg_table, bishop_table,  knight_table,
+    rook_table, queen_table,   king_eg_table, NULL};
+
+/// Material value by piece type. Both kings are always on the board, so the
+/// king is worth nothing here.
+const int EVAL_PIECE_VALUES[8] = {0, 100, 300, 300, 500, 900, 0, 0};
+
+int EVAL_MG[16][64];
+int EVAL_EG[16][64];
+
+const int EVAL_PHASE[16] = {0, 0, 1, 1, 2, 4, 0, 0,  // white
+                            0, 0, 1, 1, 2, 4, 0, 0}; // black
+
+/// A middlegame and an endgame score in one int, mg * 65536 + eg. Adding
+/// packed scores adds both halves as long as each fits in 16 bits.
+#define PACK_SCORE(mg, eg) ((int)((unsigned int)(mg) << 16) + (eg))
+
+/// EVAL_MG and EVAL_EG packed into one int (for eval_batch()).
+static int PACKED_SCORES[16][64];
+
+/**
+ * @brief Fill EVAL_MG and EVAL_EG from the piece-square tables. Only the first
+ * call does any work.
+ */
+void eval_init() {
+  static bool initialized = false;
+  if (initialized) {
+    return;
+  }
+
+  for (unsigned int t = PAWN; t <= KING; t++) {
+    for (unsigned int sq = 0; sq < 64; sq++) {
+      unsigned int rank = sq / 8;
+      unsigned int file_idx = 7 - sq % 8;
+      EVAL_MG[PIECE_CODE(t, WHITE)][sq] =
+          EVAL_PIECE_VALUES[t] + MG_TABLES[t][7 - rank][file_idx];
+      EVAL_EG[PIECE_CODE(t, WHITE)][sq] =
+          EVAL_PIECE_VALUES[t] + EG_TABLES[t][7 - rank][file_idx];
+      EVAL_MG[PIECE_CODE(t, BLACK)][sq] =
+          -(EVAL_PIECE_VALUES[t] + MG_TABLES[t][rank][file_idx]);
+      EVAL_EG[PIECE_CODE(t, BLACK)][sq] =
+          -(EVAL_PIECE_VALUES[t] + EG_TABLES[t][rank][file_idx]);
+    }
+  }
+
+  for (unsigned int code = 0; code < 16; code++) {
+    for (unsigned int sq = 0; sq < 64; sq++) {
+      PACKED_SCORES[code][sq] =
+          PACK_SCORE(EVAL_MG[code][sq], EVAL_EG[code][sq]);
+    }
+  }
+
+  initialized = true;
+}
+
+/**
+ * @brief Compute the piece-square scores and the game phase of a position
+ * from scratch into bbs->mg_score, bbs->eg_score and bbs->phase.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ */
+void eval_compute(ChessBitboards *bbs) {
+  eval_init();
+
+  bbs->mg_score = 0;
+  bbs->eg_score = 0;
+  bbs->phase = 0;
+  for (unsigned int sq = 0; sq < 64; sq++) {
+    unsigned char code = BB_CODE_AT(bbs, sq);
+    bbs->mg_score += EVAL_MG[code][sq];
+    bbs->eg_score += EVAL_EG[code][sq];
+    bbs->phase += EVAL_PHASE[code];
+  }
+}
+
+/**
+ * @brief Blend the middlegame and endgame scores of a position by its game
+ * phase.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @return The tapered score, positive when white is better.
+ */
+int eval_tapered(const ChessBitboards *bbs) {
+  // Promotions can take the phase above the starting position's
+  int phase = bbs->phase < PHASE_MAX ? bbs->phase : PHASE_MAX;
+  return (bbs->mg_score * phase + bbs->eg_score * (PHASE_MAX - phase)) /
+         PHASE_MAX;
+}
+
+//
+// Pawn Structure
+
+/// Passed pawn bonus by rank, counted from the pawn's own side (0 = 1st).
+static const int PASSED_MG[8] = {0, 5, 10, 15, 25, 40, 60, 0};
+static const int PASSED_EG[8] = {0, 10, 20, 35, 60, 100, 150, 0};
+
+#define ISOLATED_MG (-10)
+#define ISOLATED_EG (-15)
+#define DOUBLED_MG (-10)   // per pawn behind another of its color on a file
+#define DOUBLED_EG (-25)
+#define SHIELD_MG 10       // per pawn right in front of its king
+
+static PawnEntry PAWN_TABLE[PAWN_TABLE_SIZE];
+
+/// Every square at or above a square of `bb` on its file.
+static inline BITBOARD __north_fill(BITBOARD bb) {
+  bb |= bb << 8;
+  bb |= bb << 16;
+  return bb | bb << 32;
+}
+
+/// Every square at or below a square of `bb` on its file.
+static inline BITBOARD __south_fill(BITBOARD bb) {
+  bb |= bb >> 8;
+  bb |= bb >> 16;
+  return bb | bb >> 32;
+}
+
+/// The neighbours of the squares of `bb` on the adjacent files.
+static inline BITBOARD __adjacent_files(BITBOARD bb) {
+  return ((bb << 1) & ~FILE_H_MASK) | ((bb >> 1) & ~FILE_A_MASK);
+}
+
+/**
+ * @brief Evaluate the pawns of one color into a pawn hash table entry.
+ *
+ * @param entry: The entry to fill (its key is set by the caller).
+ * @param own: The pawns of the color.
+ * @param enemy: The pawns of the other color.
+ * @param color: The color.
+ */
+static void __evaluate_pawns(PawnEntry *entry, BITBOARD own, BITBOARD enemy,
+                             enum PieceColor color) {
+  unsigned int us = COLOR_INDEX(color);
+  int sign = color == WHITE ? 1 : -1;
+
+  // Squares in front of the enemy pawns, seen from `color`, on their files
+  // and the adjacent ones: an own pawn on none of them is passed.
+  BITBOARD enemy_front = color == WHITE ? __south_fill(enemy >> 8)
+                                        : __north_fill(enemy << 8);
+  BITBOARD passed = own & ~(enemy_front | __adjacent_files(enemy_front));
+  entry->passed[us] = passed;
+
+  BITBOARD attacks = attacks_pawns(own, color);
+  entry->attack_spans[us] =
+      color == WHITE ? __north_fill(attacks) : __south_fill(attacks);
+
+  int mg = 0;
+  int eg = 0;
+  while (passed) {
+    unsigned int sq = POP_LSB(passed);
+    unsigned int rank = color == WHITE ? sq / 8 : 7 - sq / 8;
+    mg += PASSED_MG[rank];
+    eg += PASSED_EG[rank];
+  }
+
+  // Pawns with no own pawn on either neighbouring file
+  BITBOARD files = __south_fill(__north_fill(own));
+  int isolated = __builtin_popcountll(own & ~__adjacent_files(files));
+  mg += ISOLATED_MG * isolated;
+  eg += ISOLATED_EG * isolated;
+
+  // Pawns with another own pawn somewhere in front of them
+  int doubled = __builtin_popcountll(own & __south_fill(own >> 8));
+  mg += DOUBLED_MG * doubled;
+  eg += DOUBLED_EG * doubled;
+
+  entry->mg_score += sign * mg;
+  entry->eg_score += sign * eg;
+}
+
+/**
+ * @brief Find the pawn structure of a position in the pawn hash table,
+ * evaluating and storing it on a miss.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @return The entry of the position's pawns (valid until the next probe).
+ */
+const PawnEntry *eval_probe_pawns(const ChessBitboards *bbs) {
+  PawnEntry *entry = &PAWN_TABLE[bbs->pawn_hash & (PAWN_TABLE_SIZE - 1)];
+  if (entry->key == bbs->pawn_hash) {
+    // Also covers positions without pawns: key 0 and an all-zero entry
+    return entry;
+  }
+
+  BITBOARD white = bbs->pieces[COLOR_INDEX(WHITE)][PIECE_SLOT(PAWN)];
+  BITBOARD black = bbs->pieces[COLOR_INDEX(BLACK)][PIECE_SLOT(PAWN)];
+  entry->key = bbs->pawn_hash;
+  entry->mg_score = 0;
+  entry->eg_score = 0;
+  __evaluate_pawns(entry, white, black, WHITE);
+  __evaluate_pawns(entry, black, white, BLACK);
+  return entry;
+}
+
+/**
+ * @brief Number of own pawns on the two ranks in front of a king, on its file
+ * and the adjacent ones.
+ */
+static inline int __shield_pawns(const ChessBitboards *bbs,
+                                 enum PieceColor color) {
+  const BITBOARD *own = bbs->pieces[COLOR_INDEX(color)];
+  BITBOARD king = own[PIECE_SLOT(KING)];
+  BITBOARD files = king | __adjacent_files(king);
+  BITBOARD shield = color == WHITE ? (files << 8) | (files << 16)
+                                   : (files >> 8) | (files >> 16);
+  return __builtin_popcountll(shield & own[PIECE_SLOT(PAWN)]);
+}
+
+/**
+ * @brief The tapered pawn score of a position: its cached pawn structure plus
+ * the pawn shields in front of both kings.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @return The score, positive when white is better.
+ */
+int eval_pawns(const ChessBitboards *bbs) {
+  const PawnEntry *entry = eval_probe_pawns(bbs);
+
+  // The shield depends on the king too, so it is not cached. Like every
+  // middlegame term it fades out as the pieces come off.
+  int shield = __shield_pawns(bbs, WHITE) - __shield_pawns(bbs, BLACK);
+  int mg = entry->mg_score + SHIELD_MG * shield;
+  int phase = bbs->phase < PHASE_MAX ? bbs->phase : PHASE_MAX;
+  return (mg * phase + entry->eg_score * (PHASE_MAX - phase)) / PHASE_MAX;
+}
+
+//
+// Batch Evaluation
+
+/// Positions handed out to a thread at a time.
+#define EVAL_CHUNK 64
+/// Fewest positions worth a thread of their own.
+#define EVAL_MIN_THREAD_POSITIONS 16384
+#define EVAL_MAX_THREADS 64
+
+/**
+ * @brief Pack a position for eval_batch().
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @param packed: Filled with the packed position.
+ * @return false if the position has more than 32 pieces, true otherwise.
+ */
+bool eval_pack(const ChessBitboards *bbs, PackedPosition *packed) {
+  memset(packed, 0, sizeof(*packed));
+  if (__builtin_popcountll(bbs->all_pieces) > 32) {
+    return false;
+  }
+  packed->occupancy = bbs->all_pieces;
+  BITBOARD occupied = bbs->all_pieces;
+  for (unsigned int k = 0; occupied; k++) {
+    unsigned int sq = POP_LSB(occupied);
+    packed->codes[k / 2] |= BB_CODE_AT(bbs, sq) << (4 * (k % 2));
+  }
+  return true;
+}
+
+/**
+ * @brief eval_tapered() of up to EVAL_CHUNK packed positions. Each piece adds
+ * its packed score straight from the table, so the codes are read once, 4 bits
+ * at a time from two registers.
+ */
+HOT_KERNEL static void __evaluate_chunk(const PackedPosition *in, int *out,
+                                        unsigned int n) {
+  for (unsigned int i = 0; i < n; i++) {
+    BITBOARD occupied = in[i].occupancy;
+    uint64_t low, high;
+    memcpy(&low, in[i].codes, 8);
+    memcpy(&high, in[i].codes + 8, 8);
+    int score = 0;
+    int phase = 0;
+    while (occupied) {
+      unsigned int sq = POP_LSB(occupied);
+      unsigned int code = low & 15;
+      score += PACKED_SCORES[code][sq];
+      phase += EVAL_PHASE[code];
+      low = (low >> 4) | (high << 60);
+      high >>= 4;
+    }
+
+    int eg = (int16_t)(uint16_t)score;
+    int mg = (score - eg) / 65536;
+    int p = phase < PHASE_MAX ? phase : PHASE_MAX;
+    out[i] = (mg * p + eg * (PHASE_MAX - p)) / PHASE_MAX;
+  }
+}
+
+/// One thread's share of an eval_batch() call.
+typedef struct {
+  const PackedPosition *in;
+  int *out;
+  size_t n;
+} EvalBatchJob;
+
+static void *__eval_batch_thread(void *arg) {
+  const EvalBatchJob *job = arg;
+  for (size_t i = 0; i < job->n; i += EVAL_CHUNK) {
+    unsigned int n = job->n - i < EVAL_CHUNK ? job->n - i : EVAL_CHUNK;
+    __evaluate_chunk(job->in + i, job->out + i, n);
+  }
+  return NULL;
+}
+
+static unsigned int EVAL_BATCH_THREADS = 0;
+
+/**
+ * @brief Set the number of threads eval_batch() may use.
+ *
+ * @param threads: The thread count, 0 for one per online CPU (the default).
+ */
+void eval_set_batch_threads(unsigned int threads) {
+  EVAL_BATCH_THREADS = threads;
+}
+
+/**
+ * @brief The tapered piece-square score (see eval_tapered()) of many
+ * positions. Large batches are split across threads by chunks.
+ *
+ * @param in: The packed positions.
+ * @param out: Filled with one score per position, positive when white is
+ * better.
+ * @param n: The number of positions.
+ */
+void eval_batch(const PackedPosition *in, int *out, size_t n) {
+  eval_init();
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t threads = EVAL_BATCH_THREADS ? EVAL_BATCH_THREADS
+                   : cpus > 0         ? (size_t)cpus
+                                      : 1;
+  if (threads > n / EVAL_MIN_THREAD_POSITIONS) {
+    threads = n / EVAL_MIN_THREAD_POSITIONS;
+  }
+  threads = threads < 1                  ? 1
+            : threads > EVAL_MAX_THREADS ? EVAL_MAX_THREADS
+                                         : threads;
+
+  // Whole chunks per thread; the calling thread takes the first share
+  size_t chunks = (n + EVAL_CHUNK - 1) / EVAL_CHUNK;
+  size_t share = (chunks + threads - 1) / threads * EVAL_CHUNK;
+  EvalBatchJob jobs[EVAL_MAX_THREADS];
+  pthread_t ids[EVAL_MAX_THREADS];
+  bool started[EVAL_MAX_THREADS] = {false};
+  for (size_t t = 0; t < threads; t++) {
+    size_t first = t * share < n ? t * share : n;
+    jobs[t].in = in + first;
+    jobs[t].out = out + first;
+    jobs[t].n = n - first < share ? n - first : share;
+  }
+  for (size_t t = 1; t < threads; t++) {
+    // Builds without threads (e.g. WASM) fail here and run the share below
+    started[t] =
+        pthread_create(&ids[t], NULL, __eval_batch_thread, &jobs[t]) == 0;
+  }
+  __eval_batch_thread(&jobs[0]);
+  for (size_t t = 1; t < threads; t++) {
+    if (started[t]) {
+      pthread_join(ids[t], NULL);
+    } else {
+      __eval_batch_thread(&jobs[t]);
+    }
+  }
+}
@@ -1,65 +1,206 @@
+#include "annotate.h"
 #include "bitboard.h"
 #include "engine.h"
 #include "magic_info.h"
+#include "nnue.h"
+#include "search.h"
 #include "uci.h"
 #include "utils.h"
 #include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #define RANK_LEN 8
 #define DEFAULT_FEN "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
 
 void test_bitboards();
 
-#define MAX_RESPONSE 1024
-static char response[MAX_RESPONSE];
+#define TT_SIZE_MB 16
+// The evaluation cache only pays for itself in front of the network; the
+// classical evaluation costs about as much as a cache miss.
+#ifdef NNUE_EVAL
+#define EVAL_CACHE_SIZE_KB 64
+#else
+#define EVAL_CACHE_SIZE_KB 0
+#endif
 
 int main(int argc, char **argv) {
-  if (argc == 2) {
-    if (str_eq(argv[1], "debug")) {
-      //
-      // DEBUGGING
-      // Bitboard test
-      test_bitboards();
-    } else if (str_eq(argv[1], "rook_magic")) {
-      ChessBitboards chess_bitboards;
-      bb_init_chess_boards(&chess_bitboards, DEFAULT_FEN);
-      compute_and_export_magics(chess_bitboards.rook_blocker_masks, 14,
-                                "rook-magics.out");
-    } else if (str_eq(argv[1], "bishop_magic")) {
-      ChessBitboards chess_bitboards;
-      bb_init_chess_boards(&chess_bitboards, DEFAULT_FEN);
-      compute_and_export_magics(chess_bitboards.bishop_blocker_masks, 14,
-                                "bishop-magics.out");
-    }
+  if (argc == 2 && str_eq(argv[1], "debug")) {
+    //
+    // DEBUGGING
+    // Bitboard test
+    test_bitboards();
     return 0;
   }
 
   //
   // Engine Setup
   ChessBitboards chess_bitboards;
-  bb_init_chess_boards(&chess_bitboards, DEFAULT_FEN);
-  BITBOARD *rook_move_table[64], *bishop_move_table[64];
   MagicInfo magic_info = init_magic_info();
-  engine_setup(&chess_bitboards, rook_move_table, bishop_move_table,
-               &magic_info);
-  chess_bitboards.rook_move_table = rook_move_table;
-  chess_bitboards.bishop_move_table = bishop_move_table;
+  engine_setup(&magic_info);
+  // Processes started with the same table file share one copy of the tables
+  const char *table_file = getenv("IRONPAWN_TABLE_FILE");
+  if (table_file != NULL && !engine_map_tables(table_file)) {
+    fprintf(stderr, "could not map or write table file %s\n", table_file);
+  }
+#ifdef NNUE_EVAL
+  // A network replaces the handcrafted evaluation
+  const char *nnue_file = getenv("IRONPAWN_NNUE");
+  if (nnue_file != NULL && !nnue_load(nnue_file)) {
+    fprintf(stderr, "could not load network %s\n", nnue_file);
+  }
+#endif
+  bb_init_chess_boards(&chess_bitboards, DEFAULT_FEN);
+  search_init(TT_SIZE_MB, EVAL_CACHE_SIZE_KB);
+
+  if (argc == 2 && str_eq(argv[1], "verify_tables")) {
+    bool equal = engine_verify_tables();
+    printf("verify_tables %s\n", equal ? "ok" : "MISMATCH");
+    engine_cleanup();
+    return equal ? 0 : 1;
+  }
+
+#ifdef NNUE_EVAL
+  if (argc == 3 && str_eq(argv[1], "write_test_net")) {
+    // ./ironpawn write_test_net <file>
+    nnue_load_test_net();
+    bool written = nnue_save(argv[2]);
+    if (!written) {
+      fprintf(stderr, "could not write network %s\n", argv[2]);
+    }
+    search_cleanup();
+    engine_cleanup();
+    return written ? 0 : 1;
+  }
+
+  if (argc == 2 && str_eq(argv[1], "verify_nnue")) {
+    // Checks the network (the bundled test network unless IRONPAWN_NNUE is
+    // set) over a few move trees, with each backend making the moves.
+    const char *FENS[3] = {
+        DEFAULT_FEN,
+        "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+        "8/2p5/3k4/8/4P3/4K3/8/8 w - - 0 1"};
+    if (!nnue_loaded()) {
+      nnue_load_test_net();
+    }
+    enum NnueBackend current = nnue_backend();
+    bool equal = true;
+    for (unsigned int b = NNUE_SCALAR; b <= NNUE_SIMD128; b++) {
+      if (!nnue_set_backend(b)) {
+        continue;
+      }
+      for (unsigned int i = 0; i < 3 && equal; i++) {
+        bb_init_chess_boards(&chess_bitboards, (char *)FENS[i]);
+        equal = nnue_verify(&chess_bitboards, 3, WHITE);
+      }
+    }
+    nnue_set_backend(current);
+    printf("verify_nnue %s\n", equal ? "ok" : "MISMATCH");
+    search_cleanup();
+    engine_cleanup();
+    return equal ? 0 : 1;
+  }
+#endif
+
+  if (argc >= 3 && str_eq(argv[1], "perft")) {
+    // ./ironpawn perft <depth> ["<fen>"]
+    const char *fen = argc >= 4 ? argv[3] : DEFAULT_FEN;
+    unsigned int depth = strtoul(argv[2], NULL, 10);
+
+    FenState state;
+    enum FenError error = bb_parse_fen(&chess_bitboards, &state, fen, NULL);
+    if (error != FEN_OK) {
+      fprintf(stderr, "invalid fen (%s): %s\n", bb_fen_error_string(error),
+              fen);
+      search_cleanup();
+      engine_cleanup();
+      return 1;
+    }
+    enum PieceColor turn = state.turn;
+    clock_t start = clock();
+    unsigned long long nodes = engine_perft(&chess_bitboards, depth, turn);
+    double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("perft depth %u nodes %llu time %.0f ms nps %.0f\n", depth, nodes,
+           elapsed * 1000.0, elapsed > 0 ? nodes / elapsed : 0.0);
+
+    search_cleanup();
+    engine_cleanup();
+    return 0;
+  }
+
+  if (argc >= 2 && str_eq(argv[1], "bench")) {
+    // ./ironpawn bench [depth]
+    // Runs perft over the bench positions once per slider backend, then
+    // times per-position against batched move generation and evaluation.
+    unsigned int depth = argc >= 3 ? strtoul(argv[2], NULL, 10) : 4;
+    const enum SliderBackend BACKENDS[3] = {SLIDERS_MAGIC, SLIDERS_PEXT,
+                                            SLIDERS_OBSTRUCTION};
+    printf("bench cpu %s\n", engine_cpu_level());
+    for (unsigned int b = 0; b < 3; b++) {
+      BenchResult result;
+      if (!engine_bench(depth, BACKENDS[b], &result)) {
+        printf("bench backend %s unsupported\n", result.backend);
+        continue;
+      }
+      printf("bench backend %s depth %u nodes %llu time %.0f ms nps %.0f\n",
+             result.backend, depth, result.nodes, result.ms, result.nps);
+    }
+
+    // Move generation alone, one position at a time and in batches
+    MovegenBenchResult movegen;
+    bool agree = engine_bench_movegen(100, &movegen);
+    printf("bench movegen %s positions %u moves %llu single %.0f ms "
+           "batch %.0f ms%s\n",
+           engine_batch_kernel(), movegen.positions, movegen.moves,
+           movegen.single_ms, movegen.batch_ms, agree ? "" : " MISMATCH");
+
+    // Piece-square evaluation, one position at a time and in batches
+    EvalBenchResult eval;
+    agree = engine_bench_eval(1000, &eval);
+    printf("bench eval positions %u single %.0f ms batch %.0f ms%s\n",
+           eval.positions, eval.single_ms, eval.batch_ms,
+           agree ? "" : " MISMATCH");
+
+    search_cleanup();
+    engine_cleanup();
+    return 0;
+  }
+
+  if (argc == 2 && str_eq(argv[1], "verify_annotate")) {
+    bool flagged = annotate_verify(&chess_bitboards);
+    printf("verify_annotate %s\n", flagged ? "ok" : "MISMATCH");
+    search_cleanup();
+    engine_cleanup();
+    return flagged ? 0 : 1;
+  }
+
+  if (argc >= 3 && str_eq(argv[1], "annotate")) {
+    // ./ironpawn annotate <game file> [depth]
+    unsigned int depth = argc >= 4 ? strtoul(argv[3], NULL, 10) : 6;
+    int status = annotate_file(&chess_bitboards, argv[2], depth);
+    search_cleanup();
+    engine_cleanup();
+    return status == 0 ? 0 : 1;
+  }
 
   //
   // Main Loop
   printf("IronPawn by Dante Grieco\n");
-  while (1) {
-    String input = str_create("");
-    str_read_from_stdin(&input, 100);
-    if (process_uci_command(&input, &chess_bitboards, &magic_info, response,
-                            MAX_RESPONSE) == -1) {
+  // One line buffer for the whole session; it only grows for longer lines
+  String input = str_dead();
+  size_t input_cap = 0;
+  while (str_read_line(&input, &input_cap, stdin)) {
+    if (process_uci_command(input.data, &chess_bitboards, stdout) == -1) {
       break;
     }
-    printf("%s", response);
+    fflush(stdout);
   }
+  str_free(&input);
 
   // Engine Cleanup
-  engine_cleanup(rook_move_table, bishop_move_table);
+  search_cleanup();
+  engine_cleanup();
 
   return 0;
 }
@@ -68,61 +209,62 @@ int main(int argc, char **argv) {
 /**/
 void test_bitboards() {
   ChessBitboards bbs;
+  bb_init_tables();
   bb_init_chess_boards(&bbs, DEFAULT_FEN);
   printf("White pawns:\n");
-  bb_print(bbs.white_pawns);
+  bb_print(bbs.pieces[COLOR_INDEX(WHITE)][PIECE_SLOT(PAWN)]);
   printf("\n");
 
   printf("White bishops:\n");
-  bb_print(bbs.white_bishops);
+  bb_print(bbs.pieces[COLOR_INDEX(WHITE)][PIECE_SLOT(BISHOP)]);
   printf("\n");
 
   printf("White knights:\n");
-  bb_print(bbs.white_knights);
+  bb_print(bbs.pieces[COLOR_INDEX(WHITE)][PIECE_SLOT(KNIGHT)]);
   printf("\n");
 
   printf("White rooks:\n");
-  bb_print(bbs.white_rooks);
+  bb_print(bbs.pieces[COLOR_INDEX(WHITE)][PIECE_SLOT(ROOK)]);
   printf("\n");
 
   printf("White queens:\n");
-  bb_print(bbs.white_queens);
+  bb_print(bbs.pieces[COLOR_INDEX(WHITE)][PIECE_SLOT(QUEEN)]);
   printf("\n");
 
   printf("White king:\n");
-  bb_print(bbs.white_king);
+  bb_print(bbs.pieces[COLOR_INDEX(WHITE)][PIECE_SLOT(KING)]);
   printf("\n");
 
   printf("Black pawns:\n");
-  bb_print(bbs.black_pawns);
+  bb_print(bbs.pieces[COLOR_INDEX(BLACK)][PIECE_SLOT(PAWN)]);
   printf("\n");
 
   printf("Black bishops:\n");
-  bb_print(bbs.black_bishops);
+  bb_print(bbs.pieces[COLOR_INDEX(BLACK)][PIECE_SLOT(BISHOP)]);
   printf("\n");
 
   printf("Black knights:\n");
-  bb_print(bbs.black_knights);
+  bb_print(bbs.pieces[COLOR_INDEX(BLACK)][PIECE_SLOT(KNIGHT)]);
   printf("\n");
 
   printf("Black rooks:\n");
-  bb_print(bbs.black_rooks);
+  bb_print(bbs.pieces[COLOR_INDEX(BLACK)][PIECE_SLOT(ROOK)]);
   printf("\n");
 
   printf("Black queens:\n");
-  bb_print(bbs.black_queens);
+  bb_print(bbs.pieces[COLOR_INDEX(BLACK)][PIECE_SLOT(QUEEN)]);
   printf("\n");
 
   printf("Black king:\n");
-  bb_print(bbs.black_king);
+  bb_print(bbs.pieces[COLOR_INDEX(BLACK)][PIECE_SLOT(KING)]);
   printf("\n");
 
   printf("All white pieces:\n");
-  bb_print(bbs.white_pieces);
+  bb_print(bbs.occupancy[COLOR_INDEX(WHITE)]);
   printf("\n");
 
   printf("All black pieces:\n");
-  bb_print(bbs.black_pieces);
+  bb_print(bbs.occupancy[COLOR_INDEX(BLACK)]);
   printf("\n");
 
   printf("All pieces:\n");
@@ -130,23 +272,23 @@ void test_bitboards() {
   printf("\n");
 
   printf("All empty squares:\n");
-  bb_print(bbs.empty_squares);
+  bb_print(~bbs.all_pieces);
   printf("\n");
 
   // Precomputation table tests
   int knight_pos = (4 * RANK_LEN) + 4;
   printf("Knight at position %d:\n", knight_pos);
-  bb_pretty_print(bbs.knight_moves[knight_pos]);
+  bb_pretty_print(BB_TABLES.knight_moves[knight_pos]);
   printf("\n");
 
   int king_pos = (4 * RANK_LEN) + 4;
   printf("King at position %d:\n", king_pos);
-  bb_pretty_print(bbs.king_moves[king_pos]);
+  bb_pretty_print(BB_TABLES.king_moves[king_pos]);
   printf("\n");
 
   int rook_pos = (4 * RANK_LEN) + 4;
   printf("Rook at position %d:\n", rook_pos);
-  bb_pretty_print(bbs.rook_blocker_masks[rook_pos]);
+  bb_pretty_print(BB_TABLES.rook_magics[rook_pos].mask);
   printf("\n");
 }
 
@@ -2,91 +2,119 @@
 
 void __set_magic_info_from_array(unsigned long long *magics,
                                  unsigned int *shifts,
+                                 unsigned int *offsets,
                                  unsigned long long *magic_buffer,
-                                 unsigned int *shift_buffer) {
+                                 unsigned int *shift_buffer,
+                                 unsigned int *offset_buffer) {
   for (unsigned int i = 0; i < 64; i++) {
     magics[i] = magic_buffer[i];
     shifts[i] = shift_buffer[i];
+    offsets[i] = offset_buffer[i];
   }
 }
 
 /**
- * @brief Initialize the *_MAGICS and *_SHIFTS arrays.
+ * @brief Initialize the *_MAGICS, *_SHIFTS and *_OFFSETS arrays.
  */
 MagicInfo init_magic_info() {
-  // NOTE: Since this is the only function, I will keep this in the header (for
-  // now).
+  // Generated by tools/find_magics.c (make magics) with
+  // seed 0x1f2e3d4c5b6a7988, minimal shifts, span tries 10000000.
+  // Tables may overlap as long as the entries they share agree
+  // (engine_setup() asserts this).
 
   MagicInfo magic_info;
 
   //
   // Rook info
   unsigned long long r_magic_buffer[64] = {
-      108088864960249872,  432363439883585664,  585472354055620896,
-      2384656277839022112, 4683746120742998017, 3467772262915047456,
-      36029346791580160,   324264670731092096,  757589904382803968,
-      1225260608285327360, 297246406396153888,  14108950389719328,
-      316693713389600,     18084930999615492,   3377845758329104,
-      9570166392234115,    39616786726978,      9007478496837640,
-      4756366377493725189, 72980117849092,      58411622342658,
-      1726370711339392,    578718049742389314,  158398396055617,
-      1125968760555648,    11294187752275968,   1444776130396192,
-      5225310264034856960, 1443416875013767424, 1152958956738709632,
-      140754936676360,     1725133903380496,    90072550895517952,
-      2251869071082496,    1229491537315890178, 9728479152048258,
-      181833659622883344,  144722187851431940,  1153702158399963458,
-      9009673726329668,    36064256270041088,   22536690911938560,
-      74344582619891714,   23643915263414272,   1297178546866884616,
-      18014949409325057,   2310355474727374880, 2305843558973726722,
-      576498239851757696,  99083796009730112,   2454461831276920864,
-      148671856321372176,  4613942216691155464, 1152956697569132676,
-      2594091528381538306, 35188767854593,      3611922162849454146,
-      720892874606252585,  308848967987233938,  290554743749882386,
-      1152947893171127813, 24189399489538,      844975239594315,
-      72062077994303562};
+      580973148179144720,  612524753059577866,  36046391354589192,
+      324267969532134528,  144150385601349120,  216174448577872008,
+      864693332046512196,  720580347019927681,  4644372549208193,
+      1156299758382482432, 2305983815423623297, 45317539986670368,
+      4612249007136178464, 1229764209823187200, 73183513306202256,
+      72620621372137604,   36172283290583098,   432489051031879682,
+      144680337325170817,  36284034715648,      955186982869271552,
+      297378862684177408,  567348025622672,     2199162160129,
+      633333730148640,     18049609725136904,   2308129997695502593,
+      288235895186788352,  6935545633765853200, 4400202383872,
+      18111722468999696,   844708398006532,     2305852080595665029,
+      72620823231366144,   9007267982614656,    2306476353714655265,
+      879617925711888,     2201179128832,       522039855120,
+      5260204503851860228, 828662468879335424,  211106536108032,
+      2269529455525952,    1152928102751010840, 18016598808199200,
+      18577352810692626,   275414949904,        576605888381583361,
+      648523848605565104,  8937870213376,       4611690562511182336,
+      1152922342310084800, 562952445954560,     12384903320569088,
+      432345599796314784,  1369095158599001248, 1729391332513841410,
+      4611688492472475777, 396317395758743818,  4688247212304500817,
+      576495938865332498,  166351745629552641,  73656209412,
+      144115257399347270};
   unsigned int r_shift_buffer[64] = {
-      52, 52, 52, 52, 52, 52, 52, 52, 52, 52, 52, 52, 52, 52, 52, 52,
-      52, 52, 52, 52, 52, 52, 52, 52, 52, 52, 52, 52, 52, 52, 52, 52,
-      52, 52, 52, 52, 52, 52, 52, 52, 52, 52, 52, 52, 52, 52, 52, 52,
-      52, 52, 52, 52, 52, 52, 51, 51, 51, 51, 51, 51, 51, 51, 51, 51};
+      52, 53, 53, 53, 53, 53, 53, 52, 53, 54, 54, 54, 54, 54, 54, 53,
+      53, 54, 54, 54, 54, 54, 54, 53, 53, 54, 54, 54, 54, 54, 54, 53,
+      53, 54, 54, 54, 54, 54, 54, 53, 53, 54, 54, 54, 54, 54, 54, 53,
+      53, 54, 54, 54, 54, 54, 54, 53, 52, 53, 53, 53, 53, 53, 53, 52};
+  unsigned int r_offset_buffer[64] = {
+      4096, 34787, 16356, 18404, 49113, 36834, 38881, 0,
+      40928, 78673, 65362, 79692, 94001, 80713, 81736, 20452,
+      22500, 66386, 67410, 68434, 69458, 70482, 82759, 24548,
+      26596, 71506, 72530, 83782, 84806, 73554, 74578, 28644,
+      42973, 85828, 75602, 86851, 87868, 76626, 88891, 45020,
+      30692, 97053, 77650, 90936, 91959, 89915, 99585, 47067,
+      63386, 98047, 95022, 98909, 96043, 92980, 100307, 59327,
+      12260, 57281, 53207, 61362, 51159, 32740, 55241, 8179};
 
-  __set_magic_info_from_array(magic_info.ROOK_MAGICS, magic_info.ROOK_SHIFTS,
-                              r_magic_buffer, r_shift_buffer);
+  __set_magic_info_from_array(
+      magic_info.ROOK_MAGICS, magic_info.ROOK_SHIFTS,
+      magic_info.ROOK_OFFSETS, r_magic_buffer, r_shift_buffer,
+      r_offset_buffer);
 
   //
   // Bishop info
   unsigned long long b_magic_buffer[64] = {
-      2310628647601472130, 299075753754793,     290271611340864,
-      1155322975515314176, 2306005754259296256, 4611972475901968388,
-      4611694819086959104, 1225260608052809748, 4760588531674415240,
-      2306705117071613985, 288303253165244416,  72101853759799296,
-      216208928692764672,  582092452280673040,  4630845559438098432,
-      2257297506174498,    4521209669615976,    2603090007921033610,
-      1732205820017639945, 600780059066403,     2269410257568768,
-      1227266083917421568, 596181628435824897,  540713435634377728,
-      70506720069122,      4616190718174577672, 2370371293703848704,
-      1134700431278272,    4506348473584640,    111463025346564,
-      1154047473233690896, 1126455036610568,    5658159856747008,
-      396616117842362384,  4683779415316959360, 612494084942332160,
-      9009415457899528,    289798314365355016,  1170988718329208961,
-      4613093410558050561, 180328505278532,     36037627639500936,
-      4865022517703631112, 2313445547476993,    450360255096815681,
-      5769128861954607136, 9609766001705540,    299489512730918916,
-      1191492376871370792, 2377971007060314636, 91198717365862402,
-      5215169476639064068, 1152991881961947204, 9007749815894097,
-      5836737719225556993, 2386943194127475203, 70437799567360,
-      6926958475203317762, 1297036710165742364, 40814009351472417,
-      1170971362903326758, 1153001116659634568, 5092946584142342,
-      1238577927462357028};
+      615305678998814722,  2396550605400703004, 651898864903684096,
+      180989243787314336,  189579998179361184,  288454698032267264,
+      180707502067844608,  2361030259496726529, 36033779752769569,
+      5334522865042606084, 207737349323359234,  5189844572914615296,
+      288372786563385344,  576461579488133122,  4830682638493220880,
+      4926091334582596,    85568448804958976,   38298206555607072,
+      2251868542081028,    1126896407938048,    4647996325323867168,
+      4613973003556900864, 604608320879263952,  76631635864453127,
+      6933361995706204292, 2365568554419454020, 26560346226976,
+      1468182274624200768, 145685357797380,     579850549211430976,
+      4766498904897274016, 36310551727591440,   36120195031368712,
+      148640962619900416,  1152930506858824800, 328973913928368640,
+      1125968760668288,    4503772232024256,    1315122218140959746,
+      3530861691158085824, 4647719286863824898, 2377918772314900480,
+      5838919116596981768, 2377970989579375616, 5067241344205824,
+      576636675915120832,  18024312511926528,   2909538768694282752,
+      585488022209331201,  144115480708792977,  162701405722251281,
+      1152927012367679488, 2308094822013043840, 49821758110351616,
+      144258271757275680,  36031013776796944,   4613946760396677248,
+      40532401227055776,   72127962943720448,   2918332592921133849,
+      149437103569469826,  56296105650295169,   2900318447927888134,
+      2882498447057896960};
   unsigned int b_shift_buffer[64] = {
-      56, 56, 56, 56, 56, 56, 56, 56, 56, 56, 56, 56, 56, 56, 56, 56,
-      56, 56, 56, 56, 56, 56, 56, 56, 56, 56, 56, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55, 55, 55, 55, 55, 55, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55, 55, 55, 55, 55, 55, 55, 55, 55, 55, 55};
+      58, 59, 59, 59, 59, 59, 59, 58, 59, 59, 59, 59, 59, 59, 59, 59,
+      59, 59, 57, 57, 57, 57, 59, 59, 59, 59, 57, 55, 55, 57, 59, 59,
+      59, 59, 57, 55, 55, 57, 59, 59, 59, 59, 57, 57, 57, 57, 59, 59,
+      59, 59, 59, 59, 59, 59, 59, 59, 58, 59, 59, 59, 59, 59, 59, 58};
+  unsigned int b_offset_buffer[64] = {
+      104845, 105354, 97423, 105039, 105125, 59671, 105367, 104896,
+      105384, 105410, 59818, 98080, 60109, 60258, 105426, 105435,
+      60695, 59381, 103354, 103481, 103608, 104364, 59963, 60404,
+      104951, 104981, 103735, 101307, 101819, 103860, 61141, 105236,
+      60548, 105153, 103986, 102331, 102843, 104487, 105070, 105181,
+      97940, 105337, 104113, 104239, 104611, 104727, 60839, 60991,
+      105453, 105469, 105288, 105012, 105213, 105263, 105486, 105503,
+      64367, 105520, 59527, 105097, 61281, 105312, 105542, 64323};
 
-  __set_magic_info_from_array(magic_info.BISHOP_MAGICS,
-                              magic_info.BISHOP_SHIFTS, b_magic_buffer,
-                              b_shift_buffer);
+  __set_magic_info_from_array(
+      magic_info.BISHOP_MAGICS, magic_info.BISHOP_SHIFTS,
+      magic_info.BISHOP_OFFSETS, b_magic_buffer, b_shift_buffer,
+      b_offset_buffer);
+
+  magic_info.ARENA_SIZE = 105569;
 
   return magic_info;
 }
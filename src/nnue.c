@@ -0,0 +1,605 @@
+#include "nnue.h"
+
+#ifdef NNUE_EVAL
+#include "engine.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_AVX2 1
+#include <immintrin.h>
+#else
+#define HAVE_AVX2 0
+#endif
+
+#ifdef __wasm_simd128__
+#define HAVE_SIMD128 1
+#include <wasm_simd128.h>
+#else
+#define HAVE_SIMD128 0
+#endif
+
+//
+// Network
+
+/// Largest output of the first two layers (their smallest is 0).
+#define CLIP_MAX 127
+
+/// The parameters of a network, in the layout of a network file.
+typedef struct __attribute__((aligned(64))) {
+  int16_t ft_weights[NNUE_FEATURES][NNUE_HALF_DIMS]; // by feature
+  int16_t ft_biases[NNUE_HALF_DIMS];
+  int8_t hidden_weights[NNUE_HIDDEN][2 * NNUE_HALF_DIMS]; // by neuron
+  int32_t hidden_biases[NNUE_HIDDEN];
+  int8_t output_weights[NNUE_HIDDEN];
+  int32_t output_bias;
+  uint32_t hidden_shift; // right shift of the second layer sums
+  int32_t output_scale;  // the output is multiplied by this...
+  uint32_t output_shift; // ...then shifted right by this
+} NnueNet;
+
+#define NNUE_FILE_MAGIC "IRONNNUE"
+#define NNUE_FILE_VERSION 1
+
+/// Header of a network file, followed by an NnueNet.
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t features;
+  uint32_t half_dims;
+  uint32_t hidden;
+} NnueFileHeader;
+
+static NnueNet NET;
+static bool NET_LOADED = false;
+
+/// First layer row of an empty square, so that a move without a capture
+/// updates the accumulators like any other.
+static const int16_t ZERO_ROW[NNUE_HALF_DIMS] __attribute__((aligned(64)));
+
+static inline int __clip(int value) {
+  return value < 0 ? 0 : value > CLIP_MAX ? CLIP_MAX : value;
+}
+
+//
+// Features
+
+/// Whether a side views the board mirrored: its king stands on the a-d files.
+#define MIRRORED(king_pos) ((king_pos) % 8 >= 4)
+
+/// Square of a side's king (0 if the position has none).
+static inline unsigned int __king_pos(const ChessBitboards *bbs,
+                                      unsigned int side) {
+  BITBOARD king = bbs->pieces[side][PIECE_SLOT(KING)];
+  return king ? __builtin_ctzll(king) : 0;
+}
+
+/**
+ * @brief The first layer row of a piece on a square, seen by a side.
+ *
+ * @param side: The color index of the side whose view is taken.
+ * @param king_pos: The square of that side's king.
+ * @param code: The piece code (EMPTY gives ZERO_ROW).
+ * @param pos: The square of the piece.
+ */
+static inline const int16_t *__feature_row(unsigned int side,
+                                           unsigned int king_pos,
+                                           unsigned char code,
+                                           unsigned int pos) {
+  if (code == PIECE_CODE(EMPTY, NOCOLOR)) {
+    return ZERO_ROW;
+  }
+  unsigned int relative = PIECE_CODE_COLOR_INDEX(code) != side;
+  unsigned int view = pos ^ (side ? 56 : 0) ^ (MIRRORED(king_pos) ? 7 : 0);
+  return NET.ft_weights[relative * 384 + (PIECE_CODE_TYPE(code) - 1) * 64 +
+                        view];
+}
+
+//
+// Scalar
+
+static void __update_scalar(int16_t *acc, const int16_t *add1,
+                            const int16_t *add2, const int16_t *sub1,
+                            const int16_t *sub2) {
+  for (unsigned int i = 0; i < NNUE_HALF_DIMS; i++) {
+    acc[i] += add1[i] + add2[i] - sub1[i] - sub2[i];
+  }
+}
+
+static int __propagate_scalar(const int16_t acc[2][NNUE_HALF_DIMS]) {
+  uint8_t input[2 * NNUE_HALF_DIMS];
+  for (unsigned int i = 0; i < 2 * NNUE_HALF_DIMS; i++) {
+    input[i] = __clip(acc[i / NNUE_HALF_DIMS][i % NNUE_HALF_DIMS]);
+  }
+
+  int output = NET.output_bias;
+  for (unsigned int n = 0; n < NNUE_HIDDEN; n++) {
+    int sum = 0;
+    for (unsigned int i = 0; i < 2 * NNUE_HALF_DIMS; i++) {
+      sum += input[i] * NET.hidden_weights[n][i];
+    }
+    output += __clip((sum + NET.hidden_biases[n]) >> NET.hidden_shift) *
+              NET.output_weights[n];
+  }
+  return output;
+}
+
+//
+// AVX2
+// 16 accumulator entries or 32 clipped inputs per vector. The clipped inputs
+// fit in unsigned bytes, so the second layer multiplies bytes by bytes and
+// adds pairs (maddubs), which cannot saturate: 2 * 127 * 128 < 32768.
+
+#if HAVE_AVX2
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static void __update_avx2(int16_t *acc, const int16_t *add1,
+                               const int16_t *add2, const int16_t *sub1,
+                               const int16_t *sub2) {
+  for (unsigned int i = 0; i < NNUE_HALF_DIMS; i += 16) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(acc + i));
+    v = _mm256_add_epi16(v, _mm256_loadu_si256((const __m256i *)(add1 + i)));
+    v = _mm256_add_epi16(v, _mm256_loadu_si256((const __m256i *)(add2 + i)));
+    v = _mm256_sub_epi16(v, _mm256_loadu_si256((const __m256i *)(sub1 + i)));
+    v = _mm256_sub_epi16(v, _mm256_loadu_si256((const __m256i *)(sub2 + i)));
+    _mm256_storeu_si256((__m256i *)(acc + i), v);
+  }
+}
+
+AVX2 static int __propagate_avx2(const int16_t acc[2][NNUE_HALF_DIMS]) {
+  const __m256i CLIP = _mm256_set1_epi16(CLIP_MAX);
+  const __m256i ONES = _mm256_set1_epi16(1);
+
+  __m256i input[2];
+  for (unsigned int side = 0; side < 2; side++) {
+    __m256i low = _mm256_min_epi16(
+        _mm256_loadu_si256((const __m256i *)acc[side]), CLIP);
+    __m256i high = _mm256_min_epi16(
+        _mm256_loadu_si256((const __m256i *)(acc[side] + 16)), CLIP);
+    // packus clips at 0 but interleaves the 128-bit halves of its operands
+    input[side] =
+        _mm256_permute4x64_epi64(_mm256_packus_epi16(low, high), 0xD8);
+  }
+
+  int output = NET.output_bias;
+  for (unsigned int n = 0; n < NNUE_HIDDEN; n++) {
+    const int8_t *weights = NET.hidden_weights[n];
+    __m256i sum = _mm256_add_epi32(
+        _mm256_madd_epi16(
+            _mm256_maddubs_epi16(
+                input[0], _mm256_loadu_si256((const __m256i *)weights)),
+            ONES),
+        _mm256_madd_epi16(
+            _mm256_maddubs_epi16(
+                input[1], _mm256_loadu_si256((const __m256i *)(weights + 32))),
+            ONES));
+    __m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum),
+                                 _mm256_extracti128_si256(sum, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4E));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xB1));
+    output += __clip((_mm_cvtsi128_si32(half) + NET.hidden_biases[n]) >>
+                     NET.hidden_shift) *
+              NET.output_weights[n];
+  }
+  return output;
+}
+#endif
+
+//
+// WASM SIMD128
+// 8 accumulator entries or 16 clipped inputs per vector. The second layer
+// widens inputs and weights to 16 bits and adds pairs of products (dot).
+
+#if HAVE_SIMD128
+static void __update_simd128(int16_t *acc, const int16_t *add1,
+                             const int16_t *add2, const int16_t *sub1,
+                             const int16_t *sub2) {
+  for (unsigned int i = 0; i < NNUE_HALF_DIMS; i += 8) {
+    v128_t v = wasm_v128_load(acc + i);
+    v = wasm_i16x8_add(v, wasm_v128_load(add1 + i));
+    v = wasm_i16x8_add(v, wasm_v128_load(add2 + i));
+    v = wasm_i16x8_sub(v, wasm_v128_load(sub1 + i));
+    v = wasm_i16x8_sub(v, wasm_v128_load(sub2 + i));
+    wasm_v128_store(acc + i, v);
+  }
+}
+
+static int __propagate_simd128(const int16_t acc[2][NNUE_HALF_DIMS]) {
+  const v128_t CLIP = wasm_i16x8_splat(CLIP_MAX);
+  const int16_t *entries = acc[0];
+
+  v128_t input[2 * NNUE_HALF_DIMS / 16];
+  for (unsigned int i = 0; i < 2 * NNUE_HALF_DIMS / 16; i++) {
+    // The narrowing clips at 0
+    input[i] = wasm_u8x16_narrow_i16x8(
+        wasm_i16x8_min(wasm_v128_load(entries + 16 * i), CLIP),
+        wasm_i16x8_min(wasm_v128_load(entries + 16 * i + 8), CLIP));
+  }
+
+  int output = NET.output_bias;
+  for (unsigned int n = 0; n < NNUE_HIDDEN; n++) {
+    v128_t sum = wasm_i32x4_splat(0);
+    for (unsigned int i = 0; i < 2 * NNUE_HALF_DIMS / 16; i++) {
+      v128_t weights = wasm_v128_load(NET.hidden_weights[n] + 16 * i);
+      sum = wasm_i32x4_add(
+          sum, wasm_i32x4_dot_i16x8(wasm_u16x8_extend_low_u8x16(input[i]),
+                                    wasm_i16x8_extend_low_i8x16(weights)));
+      sum = wasm_i32x4_add(
+          sum, wasm_i32x4_dot_i16x8(wasm_u16x8_extend_high_u8x16(input[i]),
+                                    wasm_i16x8_extend_high_i8x16(weights)));
+    }
+    int total = wasm_i32x4_extract_lane(sum, 0) +
+                wasm_i32x4_extract_lane(sum, 1) +
+                wasm_i32x4_extract_lane(sum, 2) +
+                wasm_i32x4_extract_lane(sum, 3);
+    output += __clip((total + NET.hidden_biases[n]) >> NET.hidden_shift) *
+              NET.output_weights[n];
+  }
+  return output;
+}
+#endif
+
+//
+// Backend Selection
+
+static enum NnueBackend NNUE_BACKEND = NNUE_SCALAR;
+static void (*UPDATE)(int16_t *, const int16_t *, const int16_t *,
+                      const int16_t *, const int16_t *) = __update_scalar;
+static int (*PROPAGATE)(const int16_t[2][NNUE_HALF_DIMS]) =
+    __propagate_scalar;
+
+/**
+ * @brief Determine if an NNUE backend can be used by this build and CPU.
+ *
+ * @param backend: The backend in question.
+ * @return true if nnue_set_backend(backend) can be used.
+ */
+bool nnue_backend_supported(enum NnueBackend backend) {
+  switch (backend) {
+  case NNUE_SCALAR:
+    return true;
+  case NNUE_AVX2:
+#if HAVE_AVX2
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+  case NNUE_SIMD128:
+    return HAVE_SIMD128;
+  }
+  return false;
+}
+
+/**
+ * @brief Use a backend for the accumulator updates and the inference.
+ *
+ * @param backend: The backend to switch to.
+ * @return false if the backend is not supported (the current one is kept),
+ * true otherwise.
+ */
+bool nnue_set_backend(enum NnueBackend backend) {
+  if (!nnue_backend_supported(backend)) {
+    return false;
+  }
+  UPDATE = __update_scalar;
+  PROPAGATE = __propagate_scalar;
+#if HAVE_AVX2
+  if (backend == NNUE_AVX2) {
+    UPDATE = __update_avx2;
+    PROPAGATE = __propagate_avx2;
+  }
+#endif
+#if HAVE_SIMD128
+  if (backend == NNUE_SIMD128) {
+    UPDATE = __update_simd128;
+    PROPAGATE = __propagate_simd128;
+  }
+#endif
+  NNUE_BACKEND = backend;
+  return true;
+}
+
+/**
+ * @brief Get the NNUE backend in use.
+ *
+ * @return The current NnueBackend.
+ */
+enum NnueBackend nnue_backend() { return NNUE_BACKEND; }
+
+/**
+ * @brief Use the fastest supported NNUE backend (called by engine_setup()).
+ */
+void nnue_setup() {
+  if (!nnue_set_backend(NNUE_AVX2) && !nnue_set_backend(NNUE_SIMD128)) {
+    nnue_set_backend(NNUE_SCALAR);
+  }
+}
+
+//
+// Network Files
+
+/**
+ * @brief Load a network from a file written by nnue_save(). Positions set up
+ * before the call keep accumulators of the previous network.
+ *
+ * @param path: The network file.
+ * @return false if the file is missing or does not match this build's layer
+ * sizes (the current network is kept), true otherwise.
+ */
+bool nnue_load(const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    return false;
+  }
+
+  NnueFileHeader header;
+  NnueNet *net = malloc(sizeof(NnueNet));
+  bool loaded = fread(&header, sizeof(header), 1, fp) == 1 &&
+                memcmp(header.magic, NNUE_FILE_MAGIC, 8) == 0 &&
+                header.version == NNUE_FILE_VERSION &&
+                header.features == NNUE_FEATURES &&
+                header.half_dims == NNUE_HALF_DIMS &&
+                header.hidden == NNUE_HIDDEN &&
+                fread(net, sizeof(NnueNet), 1, fp) == 1 &&
+                fgetc(fp) == EOF && net->hidden_shift < 32 &&
+                net->output_shift < 64;
+  fclose(fp);
+
+  if (loaded) {
+    NET = *net;
+    NET_LOADED = true;
+  }
+  free(net);
+  return loaded;
+}
+
+/**
+ * @brief Write the current network to a file.
+ *
+ * @param path: The network file.
+ * @return true on success.
+ */
+bool nnue_save(const char *path) {
+  NnueFileHeader header = {.version = NNUE_FILE_VERSION,
+                           .features = NNUE_FEATURES,
+                           .half_dims = NNUE_HALF_DIMS,
+                           .hidden = NNUE_HIDDEN};
+  memcpy(header.magic, NNUE_FILE_MAGIC, 8);
+
+  FILE *fp = fopen(path, "wb");
+  if (fp == NULL) {
+    return false;
+  }
+  bool written = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+                 fwrite(&NET, sizeof(NnueNet), 1, fp) == 1;
+  return fclose(fp) == 0 && written;
+}
+
+/**
+ * @brief Load the bundled test network: it counts material only (pawn 100,
+ * minor pieces 300, rook 500, queen 900), up to a difference of 1270.
+ */
+void nnue_load_test_net() {
+  // Piece values in tens of centipawns, by PieceType
+  static const int8_t VALUES[7] = {0, 10, 30, 30, 50, 90, 0};
+
+  memset(&NET, 0, sizeof(NET));
+  // First layer: entry relative * 6 + type - 1 counts the pieces of a type.
+  // The other entries get fixed pseudo-random weights that no later layer
+  // reads, so that nnue_verify() still sees which square every feature is on.
+  unsigned long long seed = 0x9e3779b97f4a7c15ULL;
+  for (unsigned int feature = 0; feature < NNUE_FEATURES; feature++) {
+    for (unsigned int i = 12; i < NNUE_HALF_DIMS; i++) {
+      seed ^= seed << 13;
+      seed ^= seed >> 7;
+      seed ^= seed << 17;
+      NET.ft_weights[feature][i] = (int16_t)(seed % 16) - 8;
+    }
+  }
+  for (unsigned int relative = 0; relative < 2; relative++) {
+    for (unsigned int type = PAWN; type <= KING; type++) {
+      for (unsigned int pos = 0; pos < 64; pos++) {
+        NET.ft_weights[relative * 384 + (type - 1) * 64 + pos]
+                      [relative * 6 + type - 1] = 1;
+      }
+    }
+  }
+
+  // Second layer: neurons 0 and 1 are white's material lead and deficit,
+  // from white's accumulator; 2 and 3 black's, from black's.
+  for (unsigned int side = 0; side < 2; side++) {
+    for (unsigned int relative = 0; relative < 2; relative++) {
+      for (unsigned int type = PAWN; type <= KING; type++) {
+        int value = relative ? -VALUES[type] : VALUES[type];
+        unsigned int input = side * NNUE_HALF_DIMS + relative * 6 + type - 1;
+        NET.hidden_weights[2 * side][input] = value;
+        NET.hidden_weights[2 * side + 1][input] = -value;
+      }
+    }
+  }
+
+  // Output: 5 * (lead - deficit) from both views, so 10 per 10 centipawns
+  static const int8_t OUTPUT_WEIGHTS[4] = {5, -5, -5, 5};
+  memcpy(NET.output_weights, OUTPUT_WEIGHTS, sizeof(OUTPUT_WEIGHTS));
+  NET.output_scale = 1;
+  NET_LOADED = true;
+}
+
+/**
+ * @brief Determine if a network has been loaded.
+ *
+ * @return true if nnue_evaluate() should be used for static evaluation.
+ */
+bool nnue_loaded() { return NET_LOADED; }
+
+//
+// Accumulators
+
+/// Rebuild one side's accumulator from scratch.
+static void __refresh_side(ChessBitboards *bbs, unsigned int side) {
+  int16_t *acc = bbs->nnue_accumulator[side];
+  unsigned int king_pos = __king_pos(bbs, side);
+  memcpy(acc, NET.ft_biases, sizeof(NET.ft_biases));
+
+  BITBOARD pieces = bbs->all_pieces;
+  while (pieces) {
+    unsigned int pos = POP_LSB(pieces);
+    UPDATE(acc, __feature_row(side, king_pos, BB_CODE_AT(bbs, pos), pos),
+           ZERO_ROW, ZERO_ROW, ZERO_ROW);
+  }
+  bbs->nnue_dirty[side] = 0;
+}
+
+/**
+ * @brief Rebuild both accumulators of a position from scratch.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ */
+void nnue_refresh(ChessBitboards *bbs) {
+  __refresh_side(bbs, 0);
+  __refresh_side(bbs, 1);
+}
+
+/// Whether a move takes a side's king across the d/e file boundary, which
+/// changes that side's view of every piece.
+static inline bool __crosses(unsigned int side, unsigned char moving,
+                             unsigned int from_pos, unsigned int to_pos) {
+  return PIECE_CODE_TYPE(moving) == KING &&
+         PIECE_CODE_COLOR_INDEX(moving) == side &&
+         MIRRORED(from_pos) != MIRRORED(to_pos);
+}
+
+/**
+ * @brief Update the accumulators for a move whose pieces have already been
+ * moved on the bitboards (called by engine_make()).
+ *
+ * @param bbs: The ChessBitboards object the move was made on.
+ * @param moving: Piece code of the moving piece.
+ * @param captured: Piece code of the captured piece (0 if none).
+ * @param placed: Piece code that lands on `to_pos` (differs on promotions).
+ * @param from_pos: The square the piece left.
+ * @param to_pos: The square the piece landed on.
+ */
+void nnue_make(ChessBitboards *bbs, unsigned char moving,
+               unsigned char captured, unsigned char placed,
+               unsigned int from_pos, unsigned int to_pos) {
+  for (unsigned int side = 0; side < 2; side++) {
+    if (bbs->nnue_dirty[side]) {
+      continue;
+    }
+    if (__crosses(side, moving, from_pos, to_pos)) {
+      bbs->nnue_dirty[side] = 1;
+      continue;
+    }
+    unsigned int king_pos = __king_pos(bbs, side);
+    UPDATE(bbs->nnue_accumulator[side],
+           __feature_row(side, king_pos, placed, to_pos), ZERO_ROW,
+           __feature_row(side, king_pos, moving, from_pos),
+           __feature_row(side, king_pos, captured, to_pos));
+  }
+}
+
+/**
+ * @brief Reverse nnue_make() before the pieces are moved back (called by
+ * engine_unmake()). A clean accumulator is always exact, even if it was
+ * rebuilt after the move, so it can be updated back; one whose king crosses
+ * back is left dirty.
+ *
+ * @param bbs, moving, captured, placed, from_pos, to_pos: As passed to
+ * nnue_make().
+ */
+void nnue_unmake(ChessBitboards *bbs, unsigned char moving,
+                 unsigned char captured, unsigned char placed,
+                 unsigned int from_pos, unsigned int to_pos) {
+  for (unsigned int side = 0; side < 2; side++) {
+    if (__crosses(side, moving, from_pos, to_pos)) {
+      bbs->nnue_dirty[side] = 1;
+      continue;
+    }
+    if (bbs->nnue_dirty[side]) {
+      continue;
+    }
+    unsigned int king_pos = __king_pos(bbs, side);
+    UPDATE(bbs->nnue_accumulator[side],
+           __feature_row(side, king_pos, moving, from_pos),
+           __feature_row(side, king_pos, captured, to_pos),
+           __feature_row(side, king_pos, placed, to_pos), ZERO_ROW);
+  }
+}
+
+/**
+ * @brief Evaluate a position with the loaded network, rebuilding dirty
+ * accumulators first.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @return The score, positive when white is better.
+ */
+int nnue_evaluate(ChessBitboards *bbs) {
+  for (unsigned int side = 0; side < 2; side++) {
+    if (bbs->nnue_dirty[side]) {
+      __refresh_side(bbs, side);
+    }
+  }
+  long long output = PROPAGATE(bbs->nnue_accumulator);
+  return (int)((output * NET.output_scale) >> NET.output_shift);
+}
+
+/**
+ * @brief Walk the legal move tree of a position and check that the
+ * incrementally updated accumulators match rebuilt ones, and that every
+ * supported backend gives the same score.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @param depth: The number of half-moves to expand.
+ * @param color: The color to move.
+ * @return true if everything matched.
+ */
+bool nnue_verify(ChessBitboards *bbs, unsigned int depth,
+                 enum PieceColor color) {
+  int score = nnue_evaluate(bbs);
+  ChessBitboards rebuilt = *bbs;
+  nnue_refresh(&rebuilt);
+  if (memcmp(bbs->nnue_accumulator, rebuilt.nnue_accumulator,
+             sizeof(rebuilt.nnue_accumulator)) != 0) {
+    return false;
+  }
+
+  enum NnueBackend current = NNUE_BACKEND;
+  bool equal = true;
+  for (unsigned int b = NNUE_SCALAR; b <= NNUE_SIMD128; b++) {
+    if (nnue_set_backend(b)) {
+      ChessBitboards copy = *bbs;
+      copy.nnue_dirty[0] = copy.nnue_dirty[1] = 1;
+      equal = equal && nnue_evaluate(&copy) == score;
+    }
+  }
+  nnue_set_backend(current);
+  if (!equal || depth == 0) {
+    return equal;
+  }
+
+  short before[2][NNUE_HALF_DIMS];
+  memcpy(before, bbs->nnue_accumulator, sizeof(before));
+
+  MoveArray moves;
+  engine_generate_pseudolegal_moves(bbs, &moves, color);
+  for (unsigned int i = 0; i < moves.len && equal; i++) {
+    UndoInfo undo;
+    engine_make(bbs, moves.moves[i], &undo);
+    equal = engine_color_in_check(bbs, color) ||
+            nnue_verify(bbs, depth - 1, color == WHITE ? BLACK : WHITE);
+    engine_unmake(bbs, moves.moves[i], &undo);
+  }
+
+  // Taking the moves back restores every accumulator that is still clean
+  for (unsigned int side = 0; side < 2 && equal; side++) {
+    equal = bbs->nnue_dirty[side] ||
+            memcmp(before[side], bbs->nnue_accumulator[side],
+                   sizeof(before[side])) == 0;
+  }
+  return equal;
+}
+
+#endif // NNUE_EVAL
@@ -1,286 +1,825 @@
 #include "search.h"
+#include "attacks.h"
 #include "bitboard.h"
 #include "engine.h"
-#include "magic_info.h"
+#include "eval.h"
+#include "nnue.h"
 #include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_MATE_DEPTH 256
+
+/// Nodes between two looks at the clock for search_iterative()'s timer.
+#define REPORT_CHECK_NODES 4096
+
+//
+// Transposition Table
+
+/// TT_MOVE_ONLY marks a score that depends on a draw by repetition below the
+/// node: it holds for this search path only, so only the move is reused.
+enum TTFlag { TT_EXACT, TT_LOWER, TT_UPPER, TT_MOVE_ONLY };
+
+/// Searches (of the same game) told apart by the TT entries, see tt_generation.
+#define TT_GENERATIONS 64
+
+typedef struct {
+  unsigned long long key;
+  int score;
+  move_info_t best_move;
+  unsigned char depth;
+  unsigned char flag : 2;       // an enum TTFlag
+  unsigned char generation : 6; // tt_generation of the search that stored it
+} TTEntry;
+
+_Static_assert(sizeof(TTEntry) == 16, "TTEntry must stay 16 bytes");
+
+static TTEntry *tt = NULL;
+static size_t tt_mask = 0;
+/// Counts the searches modulo TT_GENERATIONS; search_hashfull() only counts
+/// the entries the running (or last) one stored.
+static unsigned char tt_generation = 0;
+/// Set during search_scoring_move(): scores of earlier searches do not end a
+/// node, only their moves are reused (see __tt_probe()).
+static bool tt_own_scores_only = false;
+
+//
+// History Table
+// Indexed by [color index][from][to]; bumped when a quiet move causes a
+// cutoff. Kept between searches so consecutive positions start warm.
+static int history[2][64][64];
+
+#define HISTORY_MAX (1 << 20)
 
 //
-// Position Tables
-
-// White Pawns
-const int white_pawn_table[8][8] = {
-    {0, 0, 0, 0, 0, 0, 0, 0},         {50, 50, 50, 50, 50, 50, 50, 50},
-    {10, 10, 20, 30, 30, 20, 10, 10}, {5, 5, 10, 25, 25, 10, 5, 5},
-    {0, 0, 0, 20, 20, 0, 0, 0},       {5, -5, -10, 0, 0, -10, -5, 5},
-    {5, 10, 10, -20, -20, 10, 10, 5}, {0, 0, 0, 0, 0, 0, 0, 0}};
-
-// Black Pawns
-const int black_pawn_table[8][8] = {
-    {0, 0, 0, 0, 0, 0, 0, 0},         {5, 10, 10, -20, -20, 10, 10, 5},
-    {5, -5, -10, 0, 0, -10, -5, 5},   {0, 0, 0, 20, 20, 0, 0, 0},
-    {5, 5, 10, 25, 25, 10, 5, 5},     {10, 10, 20, 30, 30, 20, 10, 10},
-    {50, 50, 50, 50, 50, 50, 50, 50}, {0, 0, 0, 0, 0, 0, 0, 0}};
-
-// White Knights
-const int white_knight_table[8][8] = {{-50, -40, -30, -30, -30, -30, -40, -50},
-                                      {-40, -20, 0, 0, 0, 0, -20, -40},
-                                      {-30, 0, 10, 15, 15, 10, 0, -30},
-                                      {-30, 5, 15, 20, 20, 15, 5, -30},
-                                      {-30, 0, 15, 20, 20, 15, 0, -30},
-                                      {-30, 5, 10, 15, 15, 10, 5, -30},
-                                      {-40, -20, 0, 5, 5, 0, -20, -40},
-                                      {-50, -40, -30, -30, -30, -30, -40, -50}};
-
-// Black Knights
-const int black_knight_table[8][8] = {{-50, -40, -30, -30, -30, -30, -40, -50},
-                                      {-40, -20, 0, 5, 5, 0, -20, -40},
-                                      {-30, 5, 10, 15, 15, 10, 5, -30},
-                                      {-30, 0, 15, 20, 20, 15, 0, -30},
-                                      {-30, 5, 15, 20, 20, 15, 5, -30},
-                                      {-30, 0, 10, 15, 15, 10, 0, -30},
-                                      {-40, -20, 0, 0, 0, 0, -20, -40},
-                                      {-50, -40, -30, -30, -30, -30, -40, -50}};
-
-// White Bishops
-const int white_bishop_table[8][8] = {{-20, -10, -10, -10, -10, -10, -10, -20},
-                                      {-10, 0, 0, 0, 0, 0, 0, -10},
-                                      {-10, 0, 10, 10, 10, 10, 0, -10},
-                                      {-10, 5, 5, 10, 10, 5, 5, -10},
-                                      {-10, 0, 5, 10, 10, 5, 0, -10},
-                                      {-10, 10, 10, 10, 10, 10, 10, -10},
-                                      {-10, 5, 0, 0, 0, 0, 5, -10},
-                                      {-20, -10, -10, -10, -10, -10, -10, -20}};
-
-// Black Bishops
-const int black_bishop_table[8][8] = {{-20, -10, -10, -10, -10, -10, -10, -20},
-                                      {-10, 5, 0, 0, 0, 0, 5, -10},
-                                      {-10, 10, 10, 10, 10, 10, 10, -10},
-                                      {-10, 0, 5, 10, 10, 5, 0, -10},
-                                      {-10, 5, 5, 10, 10, 5, 5, -10},
-                                      {-10, 0, 10, 10, 10, 10, 0, -10},
-                                      {-10, 0, 0, 0, 0, 0, 0, -10},
-                                      {-20, -10, -10, -10, -10, -10, -10, -20}};
-
-// White Rooks
-const int white_rook_table[8][8] = {
-    {0, 0, 0, 0, 0, 0, 0, 0},   {5, 10, 10, 10, 10, 10, 10, 5},
-    {-5, 0, 0, 0, 0, 0, 0, -5}, {-5, 0, 0, 0, 0, 0, 0, -5},
-    {-5, 0, 0, 0, 0, 0, 0, -5}, {-5, 0, 0, 0, 0, 0, 0, -5},
-    {-5, 0, 0, 0, 0, 0, 0, -5}, {0, 0, 0, 5, 5, 0, 0, 0}};
-
-// Black Rooks
-const int black_rook_table[8][8] = {
-    {0, 0, 0, 5, 5, 0, 0, 0},       {-5, 0, 0, 0, 0, 0, 0, -5},
-    {-5, 0, 0, 0, 0, 0, 0, -5},     {-5, 0, 0, 0, 0, 0, 0, -5},
-    {-5, 0, 0, 0, 0, 0, 0, -5},     {-5, 0, 0, 0, 0, 0, 0, -5},
-    {5, 10, 10, 10, 10, 10, 10, 5}, {0, 0, 0, 0, 0, 0, 0, 0}};
-
-// White Queens
-const int white_queen_table[8][8] = {{-20, -10, -10, -5, -5, -10, -10, -20},
-                                     {-10, 0, 0, 0, 0, 0, 0, -10},
-                                     {-10, 0, 5, 5, 5, 5, 0, -10},
-                                     {-5, 0, 5, 5, 5, 5, 0, -5},
-                                     {0, 0, 5, 5, 5, 5, 0, -5},
-                                     {-10, 5, 5, 5, 5, 5, 0, -10},
-                                     {-10, 0, 5, 0, 0, 0, 0, -10},
-                                     {-20, -10, -10, -5, -5, -10, -10, -20}};
-
-// Black Queens
-const int black_queen_table[8][8] = {{-20, -10, -10, -5, -5, -10, -10, -20},
-                                     {-10, 0, 5, 0, 0, 0, 0, -10},
-                                     {-10, 5, 5, 5, 5, 5, 0, -10},
-                                     {0, 0, 5, 5, 5, 5, 0, -5},
-                                     {-5, 0, 5, 5, 5, 5, 0, -5},
-                                     {-10, 0, 5, 5, 5, 5, 0, -10},
-                                     {-10, 0, 0, 0, 0, 0, 0, -10},
-                                     {-20, -10, -10, -5, -5, -10, -10, -20}};
-
-// TODO: King table
+// Game History
+// Node keys (see __node_key()) of the game's positions before the root since
+// its last capture or pawn move, set by search_set_history(), and of the
+// positions on the search path by ply. A node that repeats one of them is
+// scored as a draw.
+static const unsigned long long *game_keys = NULL;
+static size_t game_keys_len = 0;
+static unsigned long long path_keys[MAX_SEARCH_DEPTH + 1];
+/// Draws by repetition scored so far; a node whose subtree scored one does
+/// not store its score.
+static unsigned long long repetition_draws = 0;
+
+//
+// Progress Reports
+// Counters of the running search, and the callback search_iterative() reports
+// them to (NULL during search()).
+
+static unsigned long long nodes = 0;
+static unsigned int root_depth = 0; // depth of the running iteration
+static unsigned int seldepth = 0;   // deepest ply reached
+static move_info_t root_move = 0;   // root move being searched, and its number
+static unsigned int root_move_number = 0;
+
+// Triangular principal variation table: the best line found from each ply of
+// the running iteration, rebuilt from the line of the ply below whenever a
+// node's best move changes.
+static move_info_t pv_table[MAX_SEARCH_DEPTH + 1][MAX_SEARCH_DEPTH];
+static unsigned int pv_length[MAX_SEARCH_DEPTH + 1];
+
+static SearchInfoCallback report_callback = NULL;
+static void *report_data = NULL;
+static unsigned int report_interval_ms = 0;
+static unsigned long long start_ms = 0;
+static unsigned long long last_report_ms = 0;
+
+//
+// Evaluation Cache
+// Static evaluations by position hash; lossy, a new entry always replaces the
+// old one. The low bits of the hash index the cache, the high 32 bits are
+// kept to recognise the position. The evaluation does not depend on the side
+// to move, so the hash without it is used.
+
+/// Check value of a position hash. The lowest bit is always set, so that an
+/// empty (all-zero) entry never matches.
+#define EVAL_CACHE_CHECK(hash) ((unsigned int)((hash) >> 32) | 1)
+
+typedef struct {
+  unsigned int check; // EVAL_CACHE_CHECK() of the position hash, 0 if empty
+  int score;
+} EvalCacheEntry;
+
+static EvalCacheEntry *eval_cache = NULL;
+static size_t eval_cache_mask = 0;
+static EvalCacheStats eval_cache_stats = {0, 0};
+
+//
+// Evaluation
+
+/// Score per square of mobility (see attacks_mobility()).
+#define MOBILITY_WEIGHT 2
 
 /**
- * @brief Computes a positional bonus of a given bitboard,
- * and adds the bonus to the raw_score value.
+ * @brief The static evaluation of a position: its tapered piece-square score
+ * (kept up to date by engine_make()), its pawn structure (cached in the pawn
+ * hash table) and mobility, or the network's score once one is loaded in
+ * NNUE_EVAL builds.
  *
- * @param score: A pointer to the score value in __eval
- * @param color: The color of the bitboard.
- * @param bb: A bitboard to compute the positional bonus
- * @param table: The table to use for computation.
+ * @param bbs: An existing ChessBitboards object.
+ * @return The score, positive when white is better.
  */
-void __compute_position_bonus(int *score, enum PieceColor color, BITBOARD bb,
-                              const int table[8][8]) {
-  while (bb) {
-    unsigned int lsb = POP_LSB(bb);
-    unsigned int rank_idx = 7 - (lsb / 8);
-    unsigned int file_idx = 7 - (lsb % 8);
-    if (color == WHITE) {
-      *score += table[rank_idx][file_idx];
-    } else if (color == BLACK) {
-      *score -= table[rank_idx][file_idx];
-    }
+HOT_KERNEL int __evaluate(ChessBitboards *bbs) {
+#ifdef NNUE_EVAL
+  if (nnue_loaded()) {
+    return nnue_evaluate(bbs);
   }
+#endif
+  return eval_tapered(bbs) + eval_pawns(bbs) +
+         MOBILITY_WEIGHT *
+             (attacks_mobility(bbs, WHITE) - attacks_mobility(bbs, BLACK));
 }
 
+/**
+ * @brief __evaluate() through the evaluation cache.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @return The score, positive when white is better.
+ */
 int __eval(ChessBitboards *bbs) {
-  // White evals
-  int w_pawn_score = __builtin_popcountll(bbs->white_pawns) * 100;
-  int w_bishop_score = __builtin_popcountll(bbs->white_bishops) * 300;
-  int w_knight_score = __builtin_popcountll(bbs->white_knights) * 300;
-  int w_rook_score = __builtin_popcountll(bbs->white_rooks) * 500;
-  int w_queen_score = __builtin_popcountll(bbs->white_queens) * 900;
-  int w_king_score = __builtin_popcountll(bbs->white_king) * 9999900;
-
-  // Black evals
-  int b_pawn_score = __builtin_popcountll(bbs->black_pawns) * -100;
-  int b_bishop_score = __builtin_popcountll(bbs->black_bishops) * -300;
-  int b_knight_score = __builtin_popcountll(bbs->black_knights) * -300;
-  int b_rook_score = __builtin_popcountll(bbs->black_rooks) * -500;
-  int b_queen_score = __builtin_popcountll(bbs->black_queens) * -900;
-  int b_king_score = __builtin_popcountll(bbs->black_king) * -9999900;
-
-  int score = (w_pawn_score + w_bishop_score + w_knight_score + w_rook_score +
-               w_queen_score + w_king_score + b_pawn_score + b_bishop_score +
-               b_knight_score + b_rook_score + b_queen_score + b_king_score);
-
-  //
-  // Position Tables
-  __compute_position_bonus(&score, WHITE, bbs->white_pawns, white_pawn_table);
-  __compute_position_bonus(&score, BLACK, bbs->black_pawns, black_pawn_table);
-  __compute_position_bonus(&score, WHITE, bbs->white_knights,
-                           white_knight_table);
-  __compute_position_bonus(&score, BLACK, bbs->black_knights,
-                           black_knight_table);
-  __compute_position_bonus(&score, WHITE, bbs->white_bishops,
-                           white_bishop_table);
-  __compute_position_bonus(&score, BLACK, bbs->black_bishops,
-                           black_bishop_table);
-  __compute_position_bonus(&score, WHITE, bbs->white_rooks, white_rook_table);
-  __compute_position_bonus(&score, BLACK, bbs->black_rooks, black_rook_table);
-  __compute_position_bonus(&score, WHITE, bbs->white_queens, white_queen_table);
-  __compute_position_bonus(&score, BLACK, bbs->black_queens, black_queen_table);
+  if (!eval_cache) {
+    return __evaluate(bbs);
+  }
 
+  EvalCacheEntry *entry = &eval_cache[bbs->hash & eval_cache_mask];
+  unsigned int check = EVAL_CACHE_CHECK(bbs->hash);
+  eval_cache_stats.probes++;
+  if (entry->check == check) {
+    eval_cache_stats.hits++;
+    return entry->score;
+  }
+
+  int score = __evaluate(bbs);
+  entry->check = check;
+  entry->score = score;
   return score;
 }
 
+/**
+ * @brief Allocate the transposition table and the evaluation cache, and reset
+ * the history table.
+ *
+ * @param tt_size_mb: The transposition table size in megabytes (rounded down
+ * to a power of two number of entries).
+ * @param eval_cache_kb: The evaluation cache size in kilobytes (rounded down
+ * to a power of two number of entries); 0 disables the cache.
+ */
+void search_init(size_t tt_size_mb, size_t eval_cache_kb) {
+  search_cleanup();
+
+  size_t num_entries = 1;
+  while (num_entries * 2 * sizeof(TTEntry) <= tt_size_mb * 1024 * 1024) {
+    num_entries *= 2;
+  }
+
+  tt = (TTEntry *)calloc(num_entries, sizeof(TTEntry));
+  if (!tt) {
+    fprintf(stderr, "Unable to allocate the transposition table.\n");
+    exit(1);
+  }
+  tt_mask = num_entries - 1;
+  tt_generation = 0;
+  memset(history, 0, sizeof(history));
+
+  if (eval_cache_kb > 0) {
+    num_entries = 1;
+    while (num_entries * 2 * sizeof(EvalCacheEntry) <= eval_cache_kb * 1024) {
+      num_entries *= 2;
+    }
+    eval_cache = (EvalCacheEntry *)calloc(num_entries, sizeof(EvalCacheEntry));
+    if (!eval_cache) {
+      fprintf(stderr, "Unable to allocate the evaluation cache.\n");
+      exit(1);
+    }
+    eval_cache_mask = num_entries - 1;
+  }
+  eval_cache_stats = (EvalCacheStats){0, 0};
+}
+
+/**
+ * @brief Clear the transposition table, the evaluation cache and the history
+ * table (i.e., for a new game).
+ */
+void search_clear() {
+  if (tt) {
+    memset(tt, 0, (tt_mask + 1) * sizeof(TTEntry));
+  }
+  tt_generation = 0;
+  if (eval_cache) {
+    memset(eval_cache, 0, (eval_cache_mask + 1) * sizeof(EvalCacheEntry));
+  }
+  memset(history, 0, sizeof(history));
+}
+
+/**
+ * @brief Free the transposition table and the evaluation cache.
+ */
+void search_cleanup() {
+  if (tt) {
+    free(tt);
+    tt = NULL;
+    tt_mask = 0;
+  }
+  if (eval_cache) {
+    free(eval_cache);
+    eval_cache = NULL;
+    eval_cache_mask = 0;
+  }
+}
+
+/// Hash of the position including the side to move.
+unsigned long long __node_key(ChessBitboards *bbs, enum PieceColor turn) {
+  return bbs->hash ^ (turn == BLACK ? ZOBRIST_BLACK_TO_MOVE : 0);
+}
+
+/**
+ * @brief Set the positions of the game before the root that the search treats
+ * as drawn by repetition.
+ *
+ * @param keys: Node keys of the positions (bbs->hash, XORed with
+ * ZOBRIST_BLACK_TO_MOVE when black is to move). Not copied: they must stay
+ * valid until the next call.
+ * @param len: The number of keys, 0 to detect no repetitions.
+ */
+void search_set_history(const unsigned long long *keys, size_t len) {
+  game_keys = keys;
+  game_keys_len = len;
+}
+
+/// Check if a node repeats a position of the search path above it (with the
+/// same side to move, so every other ply from 4 plies up) or of the game
+/// before the root.
+bool __repeats(unsigned long long key, unsigned int ply) {
+  for (int p = (int)ply - 4; p >= 0; p -= 2) {
+    if (path_keys[p] == key)
+      return true;
+  }
+  for (size_t i = 0; i < game_keys_len; i++) {
+    if (game_keys[i] == key)
+      return true;
+  }
+  return false;
+}
+
+/// Mate scores are stored relative to the node so that they stay correct
+/// when the entry is reached with a different remaining depth.
+int __score_to_tt(int score, unsigned int depth) {
+  if (score >= MATE_SCORE - MAX_MATE_DEPTH)
+    return score - (int)depth;
+  if (score <= -MATE_SCORE + MAX_MATE_DEPTH)
+    return score + (int)depth;
+  return score;
+}
+
+int __score_from_tt(int score, unsigned int depth) {
+  if (score >= MATE_SCORE - MAX_MATE_DEPTH)
+    return score + (int)depth;
+  if (score <= -MATE_SCORE + MAX_MATE_DEPTH)
+    return score - (int)depth;
+  return score;
+}
+
+/**
+ * @brief Look a position up in the transposition table.
+ *
+ * @param key: The position key (see __node_key()).
+ * @param depth: The remaining search depth.
+ * @param a: alpha (maximizer's best).
+ * @param b: beta (minimizer's best).
+ * @param tt_move: Set to the stored best move if the position is found.
+ * @param score: Set to the stored score if it was searched to this depth and
+ * can be used with this window.
+ * @return true if `score` was set and the search of this node can stop.
+ */
+HOT_KERNEL bool __tt_probe(unsigned long long key, unsigned int depth, int a,
+                           int b, move_info_t *tt_move, int *score) {
+  if (!tt)
+    return false;
+
+  TTEntry *entry = &tt[key & tt_mask];
+  if (entry->key != key)
+    return false;
+
+  *tt_move = entry->best_move;
+  if (entry->depth < depth)
+    return false;
+  if (tt_own_scores_only && entry->generation != tt_generation)
+    return false;
+
+  *score = __score_from_tt(entry->score, depth);
+  return entry->flag == TT_EXACT || (entry->flag == TT_LOWER && *score >= b) ||
+         (entry->flag == TT_UPPER && *score <= a);
+}
+
+void __tt_store(unsigned long long key, unsigned int depth, int score,
+                int a_orig, int b_orig, move_info_t best_move,
+                bool repetition) {
+  if (!tt)
+    return;
+
+  TTEntry *entry = &tt[key & tt_mask];
+  if (entry->key == key && entry->depth > depth &&
+      (!tt_own_scores_only || entry->generation == tt_generation))
+    return; // keep the deeper result for this position
+
+  entry->key = key;
+  entry->score = __score_to_tt(score, depth);
+  entry->best_move = best_move;
+  entry->depth = depth;
+  entry->generation = tt_generation;
+  entry->flag = repetition        ? TT_MOVE_ONLY
+                : score <= a_orig ? TT_UPPER
+                : score >= b_orig ? TT_LOWER
+                                  : TT_EXACT;
+}
+
+//
+// Move Ordering
+
+/**
+ * @brief Assign an ordering score to each move: the hash move first, then
+ * promotions and captures (most valuable victim, least valuable attacker),
+ * then quiet moves by history.
+ */
+void __score_moves(ChessBitboards *bbs, MoveArray *moves, int *scores,
+                   move_info_t tt_move, enum PieceColor turn) {
+  for (unsigned int i = 0; i < moves->len; i++) {
+    move_info_t move = moves->moves[i];
+    unsigned int from_pos = GET_FROM_POS(move);
+    unsigned int to_pos = GET_TO_POS(move);
+
+    if (move == tt_move) {
+      scores[i] = INT_MAX;
+      continue;
+    }
+
+    int score = 0;
+    enum PieceType victim = PIECE_CODE_TYPE(BB_CODE_AT(bbs, to_pos));
+    if (victim != EMPTY) {
+      enum PieceType attacker = PIECE_CODE_TYPE(BB_CODE_AT(bbs, from_pos));
+      score = (1 << 24) + (int)victim * 8 - (int)attacker;
+    } else {
+      score = history[COLOR_INDEX(turn)][from_pos][to_pos];
+    }
+    if (move & FLAG_PROMOTION)
+      score += 1 << 23;
+    scores[i] = score;
+  }
+}
+
+/// Swap the best remaining move into `start` and return it.
+move_info_t __pick_move(MoveArray *moves, int *scores, unsigned int start) {
+  unsigned int best = start;
+  for (unsigned int i = start + 1; i < moves->len; i++) {
+    if (scores[i] > scores[best])
+      best = i;
+  }
+
+  move_info_t move = moves->moves[best];
+  int score = scores[best];
+  moves->moves[best] = moves->moves[start];
+  scores[best] = scores[start];
+  moves->moves[start] = move;
+  scores[start] = score;
+  return move;
+}
+
+void __update_history(enum PieceColor turn, move_info_t move,
+                      unsigned int depth) {
+  int *entry = &history[COLOR_INDEX(turn)][GET_FROM_POS(move)][GET_TO_POS(move)];
+  *entry += (int)(depth * depth);
+
+  if (*entry >= HISTORY_MAX) {
+    // Age every entry so the table stays bounded and favours recent cutoffs
+    for (unsigned int c = 0; c < 2; c++)
+      for (unsigned int from = 0; from < 64; from++)
+        for (unsigned int to = 0; to < 64; to++)
+          history[c][from][to] /= 2;
+  }
+}
+
+//
+// Progress Reports
+
+/// Milliseconds on a monotonic clock.
+unsigned long long __now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/// Fill the counters shared by every SearchInfo.
+void __fill_info(SearchInfo *info, unsigned int depth) {
+  memset(info, 0, sizeof(*info));
+  info->depth = depth;
+  // Cutoffs and mates can keep the tree short of its nominal depth, and
+  // timer reports come before the new depth's first leaf; UCI wants
+  // seldepth >= depth
+  info->seldepth = seldepth > depth ? seldepth : depth;
+  info->nodes = nodes;
+  info->time_ms = __now_ms() - start_ms;
+  info->nps = nodes * 1000 / (info->time_ms ? info->time_ms : 1);
+  info->hashfull = search_hashfull();
+}
+
+/// Report the root move being searched if the timer has run out.
+void __report_progress() {
+  unsigned long long now = __now_ms();
+  if (now - last_report_ms < report_interval_ms) {
+    return;
+  }
+  last_report_ms = now;
+
+  SearchInfo info;
+  __fill_info(&info, root_depth);
+  info.currmove = root_move;
+  info.currmovenumber = root_move_number;
+  report_callback(&info, report_data);
+}
+
+/// Make `move` the best line from `ply`, followed by the line from the ply
+/// below.
+void __update_pv(unsigned int ply, move_info_t move) {
+  pv_table[ply][0] = move;
+  memcpy(&pv_table[ply][1], pv_table[ply + 1],
+         pv_length[ply + 1] * sizeof(move_info_t));
+  pv_length[ply] = pv_length[ply + 1] + 1;
+}
+
+/// The best move stored in the transposition table for a position, if it is
+/// one of the position's legal moves (0 otherwise).
+move_info_t __tt_pv_move(ChessBitboards *bbs, enum PieceColor turn) {
+  unsigned long long key = __node_key(bbs, turn);
+  if (!tt || tt[key & tt_mask].key != key) {
+    return 0;
+  }
+  move_info_t stored = tt[key & tt_mask].best_move;
+  MoveArray moves;
+  engine_generate_pseudolegal_moves(bbs, &moves, turn);
+  for (unsigned int i = 0; i < moves.len; i++) {
+    if (moves.moves[i] == stored) {
+      ChessBitboards child;
+      engine_make_copy(bbs, &child, stored);
+      return engine_color_in_check(&child, turn) ? 0 : stored;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Copy the principal variation of the last iteration, extended with
+ * the best moves stored in the transposition table where a cutoff ended it
+ * early.
+ *
+ * @param bbs: The root position.
+ * @param turn: The color to move at the root.
+ * @param pv: Filled with the line.
+ * @param max_len: The longest line to follow.
+ * @return The length of the line.
+ */
+unsigned int __extract_pv(ChessBitboards *bbs, enum PieceColor turn,
+                          move_info_t *pv, unsigned int max_len) {
+  // The line's positions alternate between two copies
+  ChessBitboards positions[2];
+  positions[0] = *bbs;
+  unsigned int len = 0;
+  while (len < max_len) {
+    ChessBitboards *position = &positions[len & 1];
+    move_info_t move = len < pv_length[0] ? pv_table[0][len]
+                                          : __tt_pv_move(position, turn);
+    if (move == 0) {
+      break;
+    }
+    engine_make_copy(position, &positions[(len + 1) & 1], move);
+    pv[len++] = move;
+    turn = turn == WHITE ? BLACK : WHITE;
+  }
+  return len;
+}
+
+//
+// Search
+
 /**
  * @brief Standard minimax algorithm w/ alpha-beta pruning.
+ * Moves are made with copy-make: each child position is a copy of its parent
+ * in the next slot of the per-ply position stack, so nothing is undone.
  *
- * @param bbs: An existing ChessBitboards object.
- * @param magic: An existing MagicInfo object.
+ * @param bbs: The current position, an entry of the position stack with at
+ * least `depth` free entries after it.
  * @param depth: The number of half-moves to search.
  * @param turn: the color whose turn it is to move.
  * @param a: alpha (maximizer's best).
  * @param b: beta (minimizer's best).
  * @return An evaluation score of the best path.
  */
-int __minimax(ChessBitboards *bbs, MagicInfo *magic, unsigned int depth,
+int __minimax(ChessBitboards *bbs, unsigned int depth,
               enum PieceColor turn, int a, int b) {
+  if (++nodes % REPORT_CHECK_NODES == 0 && report_callback) {
+    __report_progress();
+  }
+  unsigned int ply = root_depth - depth;
+  if (ply > seldepth) {
+    seldepth = ply;
+  }
+  pv_length[ply] = 0;
+
+  unsigned long long key = __node_key(bbs, turn);
+  if (__repeats(key, ply)) {
+    repetition_draws++;
+    return 0;
+  }
+  path_keys[ply] = key;
+
   if (depth == 0) {
     return __eval(bbs);
   }
 
+  const int a_orig = a;
+  const int b_orig = b;
+  const unsigned long long draws_before = repetition_draws;
+  move_info_t tt_move = 0;
+
+  int tt_score;
+  if (__tt_probe(key, depth, a, b, &tt_move, &tt_score)) {
+    return tt_score;
+  }
+
   int best_eval = turn == WHITE ? INT_MIN : INT_MAX;
+  move_info_t best_move = 0;
 
   bool found_legal_move = false;
   MoveArray potential_moves;
+  int scores[256];
+  ChessBitboards *child = bbs + 1;
 
-  engine_generate_pseudolegal_moves(bbs, magic, &potential_moves, turn);
+  engine_generate_pseudolegal_moves(bbs, &potential_moves, turn);
+  __score_moves(bbs, &potential_moves, scores, tt_move, turn);
 
   for (unsigned int i = 0; i < potential_moves.len; i++) {
-    move_info_t move = potential_moves.moves[i];
-    unsigned int from_pos = GET_FROM_POS(move);
+    move_info_t move = __pick_move(&potential_moves, scores, i);
     unsigned int to_pos = GET_TO_POS(move);
-    Piece captured = engine_move(bbs, from_pos, to_pos);
+    bool is_capture = BB_CODE_AT(bbs, to_pos) != PIECE_CODE(EMPTY, NOCOLOR);
+
+    engine_make_copy(bbs, child, move);
 
     // Skip illegal moves (leaves own king in check)
-    if (engine_color_in_check(bbs, magic, turn)) {
-      if (move & FLAG_PROMOTION)
-        engine_undo_promotion(bbs, to_pos, turn);
-      engine_move(bbs, to_pos, from_pos);
-      engine_undo_capture(bbs, &captured, to_pos);
+    if (engine_color_in_check(child, turn)) {
       continue;
     }
 
     found_legal_move = true;
     int eval =
-        __minimax(bbs, magic, depth - 1, turn == WHITE ? BLACK : WHITE, a, b);
-    best_eval = (turn == WHITE) ? (eval > best_eval ? eval : best_eval)
-                                : (eval < best_eval ? eval : best_eval);
-
-    if (move & FLAG_PROMOTION)
-      engine_undo_promotion(bbs, to_pos, turn);
-    engine_move(bbs, to_pos, from_pos);
-    engine_undo_capture(bbs, &captured, to_pos);
+        __minimax(child, depth - 1, turn == WHITE ? BLACK : WHITE, a, b);
+    if ((turn == WHITE && eval > best_eval) ||
+        (turn == BLACK && eval < best_eval)) {
+      best_eval = eval;
+      best_move = move;
+      __update_pv(ply, move);
+    }
 
     if (turn == WHITE) {
       a = a >= best_eval ? a : best_eval;
     } else {
       b = b <= best_eval ? b : best_eval;
     }
-    if (a >= b)
+    if (a >= b) {
+      if (!is_capture)
+        __update_history(turn, move, depth);
       break;
+    }
   }
 
   // No legal moves: checkmate or stalemate
   if (!found_legal_move) {
-    if (engine_color_in_check(bbs, magic, turn)) {
+    if (engine_color_in_check(bbs, turn)) {
       // Checkmate: worse the deeper it is (prefer faster mates)
-      return turn == WHITE ? -9999900 - (int)depth : 9999900 + (int)depth;
+      return turn == WHITE ? -MATE_SCORE - (int)depth : MATE_SCORE + (int)depth;
     }
     return 0;
   }
 
+  __tt_store(key, depth, best_eval, a_orig, b_orig, best_move,
+             repetition_draws != draws_before);
   return best_eval;
 }
 
 /**
- * @brief Perform a Minimax search of a certain depth.
+ * @brief Search every root move to a depth.
  *
- * @param bbs: An existing ChessBitboards object.
- * @param magic: An existing MagicInfo object.
- * @param depth: The number of half-moves to search.
+ * @param stack: The per-ply position stack, with the root in its first entry.
+ * @param depth: The number of half-moves to search, 1 to MAX_SEARCH_DEPTH.
  * @param turn: the color whose turn it is to move.
+ * @param scored_move: A root move to search first, or 0.
+ * @param scored_eval: Set to the exact evaluation of `scored_move`.
  * @return An EvalResult with the best move and its evaluation value.
- * NOTE: White is the maximizing player; black is minimizing.
  */
-EvalResult search(ChessBitboards *bbs, MagicInfo *magic, unsigned int depth,
-                  enum PieceColor turn) {
+EvalResult __search_root(ChessBitboards *stack, unsigned int depth,
+                         enum PieceColor turn, move_info_t scored_move,
+                         int *scored_eval) {
+  ChessBitboards *bbs = &stack[0];
   move_info_t best_move = 0;
   MoveArray potential_moves;
+  int scores[256];
   int best_eval = turn == WHITE ? INT_MIN : INT_MAX;
+  root_depth = depth;
+  pv_length[0] = 0;
+
+  unsigned long long key = __node_key(bbs, turn);
+  const unsigned long long draws_before = repetition_draws;
+  path_keys[0] = key;
+  move_info_t tt_move = 0;
+  if (scored_move != 0) {
+    // Searched first, so with a full window: its score is exact
+    tt_move = scored_move;
+  } else if (tt && tt[key & tt_mask].key == key) {
+    tt_move = tt[key & tt_mask].best_move;
+  }
 
-  engine_generate_pseudolegal_moves(bbs, magic, &potential_moves, turn);
+  engine_generate_pseudolegal_moves(bbs, &potential_moves, turn);
+  __score_moves(bbs, &potential_moves, scores, tt_move, turn);
 
+  root_move_number = 0;
   for (unsigned int i = 0; i < potential_moves.len; i++) {
-    move_info_t move = potential_moves.moves[i];
-    unsigned int from_pos = GET_FROM_POS(move);
-    unsigned int to_pos = GET_TO_POS(move);
-    Piece captured =
-        engine_move(bbs, from_pos, to_pos); // make the move (simulate it)
+    move_info_t move = __pick_move(&potential_moves, scores, i);
+    engine_make_copy(&stack[0], &stack[1], move);
 
     // Skip illegal moves
-    if (engine_color_in_check(bbs, magic, turn)) {
-      if (move & FLAG_PROMOTION)
-        engine_undo_promotion(bbs, to_pos, turn);
-      engine_move(bbs, to_pos, from_pos);
-      engine_undo_capture(bbs, &captured, to_pos);
+    if (engine_color_in_check(&stack[1], turn)) {
       continue;
     }
-
-    int eval = __minimax(bbs, magic, depth - 1, turn == WHITE ? BLACK : WHITE,
-                         INT_MIN, INT_MAX);
+    root_move = move;
+    root_move_number++;
+
+    // Only a strictly better move can replace the current best, so the
+    // current best can serve as the bound for the remaining moves.
+    int eval = __minimax(&stack[1], depth - 1, turn == WHITE ? BLACK : WHITE,
+                         turn == WHITE ? best_eval : INT_MIN,
+                         turn == BLACK ? best_eval : INT_MAX);
+    if (move == scored_move) {
+      *scored_eval = eval;
+    }
 
     if ((turn == WHITE && eval > best_eval) ||
         (turn == BLACK && eval < best_eval)) {
       best_eval = eval;
       best_move = move;
+      __update_pv(0, move);
     }
+  }
 
-    // reset the move
-    if (move & FLAG_PROMOTION)
-      engine_undo_promotion(bbs, to_pos, turn);
-    engine_move(bbs, to_pos, from_pos);
-    engine_undo_capture(bbs, &captured, to_pos);
+  if (best_move != 0) {
+    __tt_store(key, depth, best_eval, INT_MIN, INT_MAX, best_move,
+               repetition_draws != draws_before);
   }
 
   return (EvalResult){.best_move = best_move, .eval = best_eval};
 }
+
+/// Clamp a requested search depth to 1 to MAX_SEARCH_DEPTH.
+unsigned int __clamp_depth(unsigned int depth) {
+  if (depth == 0) {
+    return 1;
+  }
+  return depth > MAX_SEARCH_DEPTH ? MAX_SEARCH_DEPTH : depth;
+}
+
+/**
+ * @brief Perform a Minimax search of a certain depth.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @param depth: The number of half-moves to search.
+ * @param turn: the color whose turn it is to move.
+ * @return An EvalResult with the best move and its evaluation value.
+ * NOTE: White is the maximizing player; black is minimizing.
+ * NOTE: The transposition and history tables are kept between calls, so
+ * searching related positions one after another is cheaper.
+ */
+EvalResult search(ChessBitboards *bbs, unsigned int depth,
+                  enum PieceColor turn) {
+  eval_cache_stats = (EvalCacheStats){0, 0};
+  tt_generation = (tt_generation + 1) % TT_GENERATIONS;
+  nodes = 0;
+  seldepth = 0;
+
+  // One position per ply; bbs itself is never modified
+  ChessBitboards stack[MAX_SEARCH_DEPTH + 1];
+  stack[0] = *bbs;
+  return __search_root(stack, __clamp_depth(depth), turn, 0, NULL);
+}
+
+/**
+ * @brief Perform a Minimax search of a certain depth like search(), and also
+ * score one root move at the same depth as the others.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @param depth: The number of half-moves to search.
+ * @param turn: the color whose turn it is to move.
+ * @param move: A legal move of the position.
+ * @param move_eval: Set to the exact evaluation of `move`.
+ * @return An EvalResult with the best move and its evaluation value.
+ * NOTE: Transposition table entries of earlier searches only supply their
+ * moves here. Without a quiescence search, a deeper score swings with the
+ * parity of its depth, and the position after `move` is typically the root of
+ * the previous search; its scores would not compare with the other moves'.
+ */
+EvalResult search_scoring_move(ChessBitboards *bbs, unsigned int depth,
+                               enum PieceColor turn, move_info_t move,
+                               int *move_eval) {
+  eval_cache_stats = (EvalCacheStats){0, 0};
+  tt_generation = (tt_generation + 1) % TT_GENERATIONS;
+  nodes = 0;
+  seldepth = 0;
+
+  ChessBitboards stack[MAX_SEARCH_DEPTH + 1];
+  stack[0] = *bbs;
+  tt_own_scores_only = true;
+  EvalResult result =
+      __search_root(stack, __clamp_depth(depth), turn, move, move_eval);
+  tt_own_scores_only = false;
+  return result;
+}
+
+/**
+ * @brief Search with iterative deepening: every depth from 1 up to `depth`,
+ * each starting from the transposition table the one before filled. Progress
+ * is reported after each completed depth, and on a timer in between.
+ *
+ * @param bbs: An existing ChessBitboards object.
+ * @param depth: The last depth to search.
+ * @param turn: the color whose turn it is to move.
+ * @param interval_ms: Time between two timer reports (0 for none).
+ * @param callback: Called with every report.
+ * @param data: Passed to the callback.
+ * @return The EvalResult of the last depth.
+ */
+EvalResult search_iterative(ChessBitboards *bbs, unsigned int depth,
+                            enum PieceColor turn, unsigned int interval_ms,
+                            SearchInfoCallback callback, void *data) {
+  eval_cache_stats = (EvalCacheStats){0, 0};
+  tt_generation = (tt_generation + 1) % TT_GENERATIONS;
+  nodes = 0;
+  seldepth = 0;
+  start_ms = last_report_ms = __now_ms();
+  report_callback = interval_ms > 0 ? callback : NULL;
+  report_data = data;
+  report_interval_ms = interval_ms;
+
+  ChessBitboards stack[MAX_SEARCH_DEPTH + 1];
+  stack[0] = *bbs;
+  EvalResult result = {.best_move = 0, .eval = 0};
+  depth = __clamp_depth(depth);
+  for (unsigned int d = 1; d <= depth; d++) {
+    result = __search_root(stack, d, turn, 0, NULL);
+    if (result.best_move == 0) {
+      break; // no legal move
+    }
+
+    SearchInfo info;
+    __fill_info(&info, d);
+    info.complete = true;
+    info.score = turn == WHITE ? result.eval : -result.eval;
+    int mate_distance = abs(result.eval) - MATE_SCORE;
+    if (mate_distance > -MAX_MATE_DEPTH) {
+      // A mate found with `mate_distance` plies left to search
+      int plies = (int)d - mate_distance;
+      int moves = ((plies < 1 ? 1 : plies) + 1) / 2;
+      info.mate = info.score > 0 ? moves : -moves;
+    }
+    info.pv_len = __extract_pv(bbs, turn, info.pv, d);
+    callback(&info, data);
+    last_report_ms = __now_ms();
+  }
+
+  report_callback = NULL;
+  return result;
+}
+
+/**
+ * @brief Estimate how full the transposition table is.
+ *
+ * @return The share of the first thousand entries stored by the running (or
+ * last) search, in permill.
+ */
+unsigned int search_hashfull() {
+  if (!tt) {
+    return 0;
+  }
+  size_t sample = tt_mask + 1 < 1000 ? tt_mask + 1 : 1000;
+  unsigned int used = 0;
+  for (size_t i = 0; i < sample; i++) {
+    used += tt[i].key != 0 && tt[i].generation == tt_generation;
+  }
+  return used * 1000 / sample;
+}
+
+/**
+ * @brief Get the evaluation cache counters of the last search().
+ *
+ * @return The number of cached evaluations looked up and found.
+ */
+EvalCacheStats search_eval_cache_stats() { return eval_cache_stats; }
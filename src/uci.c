@@ -8,145 +8,431 @@
 
 #define DEFAULT_FEN "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
 
-void handle_uci_init(char *response, const int MAX_RESPONSE) {
-  snprintf(response, MAX_RESPONSE,
-           "id name IronPawn\nid author Dante Grieco\nuciok\n");
+//
+// Game State
+// A GUI repeats the whole game in every "position" command, with a move or two
+// more each turn. The last game is kept with what is needed to take its moves
+// back, so a command with the same starting position only takes back the
+// moves that differ (usually none) and makes the new ones.
+
+/// Longest move list kept, in half-moves.
+#define MAX_GAME_PLIES 2048
+
+typedef struct {
+  bool valid;                  // false until a "position" command succeeded
+  char start[FEN_BUFFER_SIZE]; // the starting FEN as sent, or "startpos"
+  FenState state;              // FEN fields of the current position
+  unsigned long long hash;     // hash of the current position, to notice
+                               // changes made outside of "position"
+  size_t plies;                // moves made from the starting position
+  char notation[MAX_GAME_PLIES][MOVE_NOTATION_SIZE]; // the moves as sent
+  move_info_t moves[MAX_GAME_PLIES];
+  UndoInfo undo[MAX_GAME_PLIES];
+  FenState states[MAX_GAME_PLIES];         // FEN fields before each move
+  unsigned long long keys[MAX_GAME_PLIES]; // node key before each move
+} UciGame;
+
+static UciGame game = {
+    .state = {.turn = WHITE,
+              .castling = CASTLE_WHITE_KING | CASTLE_WHITE_QUEEN |
+                          CASTLE_BLACK_KING | CASTLE_BLACK_QUEEN,
+              .en_passant = -1,
+              .halfmove_clock = 0,
+              .fullmove_number = 1}};
+
+/// Castling rights lost when a piece leaves or is captured on a square.
+unsigned char __castling_lost(unsigned int sq) {
+  switch (sq) {
+  case 3: // e1
+    return CASTLE_WHITE_KING | CASTLE_WHITE_QUEEN;
+  case 0: // h1
+    return CASTLE_WHITE_KING;
+  case 7: // a1
+    return CASTLE_WHITE_QUEEN;
+  case 59: // e8
+    return CASTLE_BLACK_KING | CASTLE_BLACK_QUEEN;
+  case 56: // h8
+    return CASTLE_BLACK_KING;
+  case 63: // a8
+    return CASTLE_BLACK_QUEEN;
+  }
+  return 0;
 }
 
-// TODO: handle moves
-void handle_position(Vec *tokens, ChessBitboards *bbs, char *response,
-                     const int MAX_RESPONSE) {
-  String board_str = str_dead();
-  Vec moves = vec_dead();
-  if (tokens->len <= 1) {
+/// Advance the FEN fields of a position past a move made with engine_make().
+void __advance_state(FenState *state, move_info_t move, const UndoInfo *undo) {
+  unsigned int from_pos = GET_FROM_POS(move);
+  unsigned int to_pos = GET_TO_POS(move);
+  bool pawn_move = PIECE_CODE_TYPE(undo->moving) == PAWN;
+
+  state->castling &= ~(__castling_lost(from_pos) | __castling_lost(to_pos));
+  state->en_passant = pawn_move && (from_pos ^ to_pos) == 16
+                          ? (int)(from_pos + to_pos) / 2
+                          : -1;
+  state->halfmove_clock =
+      pawn_move || undo->captured ? 0 : state->halfmove_clock + 1;
+  if (state->turn == BLACK) {
+    state->fullmove_number++;
+  }
+  state->turn = state->turn == WHITE ? BLACK : WHITE;
+}
+
+/// Node key (as used by the search) of a position and side to move.
+unsigned long long __game_key(const ChessBitboards *bbs,
+                              enum PieceColor turn) {
+  return bbs->hash ^ (turn == BLACK ? ZOBRIST_BLACK_TO_MOVE : 0);
+}
+
+/**
+ * @brief Make the legal move of a notation on the game's current position.
+ *
+ * @return false if the move is illegal or the game is too long.
+ */
+bool __game_push(ChessBitboards *bbs, StrView word) {
+  size_t ply = game.plies;
+  enum PieceColor turn = game.state.turn;
+  char notation[MOVE_NOTATION_SIZE];
+  move_info_t move;
+  if (ply == MAX_GAME_PLIES || word.len >= MOVE_NOTATION_SIZE) {
+    return false;
+  }
+  memcpy(notation, word.data, word.len);
+  notation[word.len] = '\0';
+  if (!engine_parse_move(bbs, notation, turn, &move)) {
+    return false;
+  }
+
+  unsigned long long key = __game_key(bbs, turn);
+  engine_make(bbs, move, &game.undo[ply]);
+  if (engine_color_in_check(bbs, turn)) {
+    engine_unmake(bbs, move, &game.undo[ply]);
+    return false;
+  }
+
+  strcpy(game.notation[ply], notation);
+  game.moves[ply] = move;
+  game.states[ply] = game.state;
+  game.keys[ply] = key;
+  __advance_state(&game.state, move, &game.undo[ply]);
+  game.plies++;
+  return true;
+}
+
+/// Take back the game's last move.
+void __game_pop(ChessBitboards *bbs) {
+  size_t ply = --game.plies;
+  engine_unmake(bbs, game.moves[ply], &game.undo[ply]);
+  game.state = game.states[ply];
+}
+
+void handle_uci_init(FILE *out) {
+  fprintf(out, "id name IronPawn\nid author Dante Grieco\nuciok\n");
+}
+
+/// Read the number after an option of a command, or keep `fallback` if there
+/// is none.
+long __next_number(const char **cursor, long fallback) {
+  StrView word;
+  if (!str_next_word(cursor, &word)) {
+    return fallback;
+  }
+  // NOTE: using strtol can enable unexpected results if negative values are
+  // passed.
+  return strtol(word.data, NULL, 10);
+}
+
+/**
+ * @brief Handle "position [startpos | fen <fen>] [moves <m1> <m2> ...]".
+ * When the starting position is the one of the last command, only the moves
+ * that differ from its move list are taken back and made.
+ *
+ * @param args: The rest of the command line after "position".
+ */
+void handle_position(const char *args, ChessBitboards *bbs, FILE *out) {
+  const char *cursor = args;
+  StrView word;
+  if (!str_next_word(&cursor, &word)) {
     return;
   }
-  if (str_eq(vec_get(tokens, 1), "startpos")) {
-    board_str = str_create(DEFAULT_FEN);
-    int moves_idx = vec_indexof(tokens, STRING, "moves");
-    if (moves_idx != -1) {
-      moves = vec_refsubvec(tokens, moves_idx + 1, -1);
+
+  // The starting position: "startpos", or the FEN as sent, which runs up to
+  // "moves" or the end of the line
+  StrView start = word;
+  char fen[FEN_BUFFER_SIZE];
+  if (strview_eq(word, "startpos")) {
+    snprintf(fen, FEN_BUFFER_SIZE, "%s", DEFAULT_FEN);
+    while (str_next_word(&cursor, &word) && !strview_eq(word, "moves")) {
     }
-  } else if (str_eq(vec_get(tokens, 1), "fen")) {
-    int fen_idx = vec_indexof(tokens, STRING, "fen");
-    int moves_idx = vec_indexof(tokens, STRING, "moves");
-    if (moves_idx != -1) {
-      Vec fen = vec_refsubvec(tokens, fen_idx + 1, moves_idx);
-      board_str = str_create_from_strvec(&fen);
-      moves = vec_refsubvec(tokens, moves_idx + 1, -1);
-    } else {
-      Vec fen = vec_refsubvec(tokens, fen_idx + 1, -1);
-      board_str = str_create_from_strvec(&fen);
+  } else if (strview_eq(word, "fen")) {
+    start = (StrView){.data = cursor, .len = 0};
+    while (str_next_word(&cursor, &word) && !strview_eq(word, "moves")) {
+      if (start.len == 0) {
+        start.data = word.data;
+      }
+      start.len = word.data + word.len - start.data;
+    }
+    if (start.len >= FEN_BUFFER_SIZE) {
+      fprintf(out, "info string invalid fen (too long)\n");
+      return;
     }
+    memcpy(fen, start.data, start.len);
+    fen[start.len] = '\0';
   } else {
-    snprintf(response, MAX_RESPONSE, "Unknown command: %s\n",
-             str_create_from_strvec(tokens).data);
-    str_free(&board_str);
-    vec_freeref(&moves);
+    fprintf(out, "Unknown command: position %s\n", args);
     return;
   }
-  bb_init_chess_boards(bbs, board_str.data);
-  str_free(&board_str);
-  vec_freeref(&moves);
+
+  if (game.valid && bbs->hash == game.hash && strview_eq(start, game.start)) {
+    // Same game: take back the moves after the common prefix
+    size_t common = 0;
+    const char *next = cursor;
+    while (common < game.plies && str_next_word(&next, &word) &&
+           strview_eq(word, game.notation[common])) {
+      cursor = next;
+      common++;
+    }
+    while (game.plies > common) {
+      __game_pop(bbs);
+    }
+  } else {
+    // Parsed into a copy, so that a bad FEN leaves the position as it was
+    ChessBitboards parsed;
+    FenState state;
+    enum FenError error = bb_parse_fen(&parsed, &state, fen, NULL);
+    if (error != FEN_OK) {
+      fprintf(out, "info string invalid fen (%s)\n",
+              bb_fen_error_string(error));
+      return;
+    }
+    *bbs = parsed;
+    game.state = state;
+    game.plies = 0;
+    game.valid = true;
+    memcpy(game.start, start.data, start.len);
+    game.start[start.len] = '\0';
+  }
+
+  while (str_next_word(&cursor, &word)) {
+    if (!__game_push(bbs, word)) {
+      fprintf(out, "info string illegal move %.*s\n", (int)word.len,
+              word.data);
+      break;
+    }
+  }
+  game.hash = bbs->hash;
+
+  // Positions since the last capture or pawn move can repeat in the search
+  size_t reversible = game.state.halfmove_clock < game.plies
+                          ? game.state.halfmove_clock
+                          : game.plies;
+  search_set_history(game.keys + game.plies - reversible, reversible);
+}
+
+//
+// Search Output
+
+/// Time between two "info currmove" lines during a search.
+#define INFO_INTERVAL_MS 1000
+
+/// Write a search progress report as a UCI "info" line.
+void __print_info(const SearchInfo *info, void *data) {
+  FILE *out = data;
+  fprintf(out, "info depth %u seldepth %u", info->depth, info->seldepth);
+  if (info->complete) {
+    if (info->mate != 0) {
+      fprintf(out, " score mate %d", info->mate);
+    } else {
+      fprintf(out, " score cp %d", info->score);
+    }
+  }
+  fprintf(out, " nodes %llu nps %llu hashfull %u time %llu", info->nodes,
+          info->nps, info->hashfull, info->time_ms);
+
+  char notation[MOVE_NOTATION_SIZE];
+  if (info->complete) {
+    fputs(" pv", out);
+    for (unsigned int i = 0; i < info->pv_len; i++) {
+      engine_move_notation(info->pv[i], notation);
+      fprintf(out, " %s", notation);
+    }
+  } else {
+    engine_move_notation(info->currmove, notation);
+    fprintf(out, " currmove %s currmovenumber %u", notation,
+            info->currmovenumber);
+  }
+  fputc('\n', out);
+  // Shown while the search runs, not once it returns
+  fflush(out);
 }
 
-void handle_go(Vec *tokens, ChessBitboards *bbs, MagicInfo *magic,
-               char *response, const int MAX_RESPONSE) {
+/**
+ * @brief Handle "go [depth N] [movetime N] [wtime N] [btime N] [turn N]".
+ * The search is reported with "info" lines as it runs, then "bestmove".
+ *
+ * @param args: The rest of the command line after "go".
+ */
+void handle_go(const char *args, ChessBitboards *bbs, FILE *out) {
   size_t depth = 6;
   size_t movetime = ULONG_MAX;
   size_t wtime = ULONG_MAX;
   size_t btime = ULONG_MAX;
-  enum PieceColor turn = WHITE;
+  enum PieceColor turn = game.state.turn;
 
-  int i;
-  // NOTE: using strtoul can enable unexpected results if negative values are
-  // passed.
-  if ((i = vec_indexof(tokens, STRING, "depth")) != -1) {
-    depth = strtoul(vec_get(tokens, i + 1), NULL, 10);
-  }
-  if ((i = vec_indexof(tokens, STRING, "movetime")) != -1) {
-    movetime = strtoul(vec_get(tokens, i + 1), NULL, 10);
-  }
-  if ((i = vec_indexof(tokens, STRING, "wtime")) != -1) {
-    wtime = strtoul(vec_get(tokens, i + 1), NULL, 10);
-  }
-  if ((i = vec_indexof(tokens, STRING, "btime")) != -1) {
-    btime = strtoul(vec_get(tokens, i + 1), NULL, 10);
-  }
-  if ((i = vec_indexof(tokens, STRING, "turn")) != -1) {
-    turn = strtol(vec_get(tokens, i + 1), NULL, 10);
+  // One pass over the options
+  const char *cursor = args;
+  StrView word;
+  while (str_next_word(&cursor, &word)) {
+    if (strview_eq(word, "depth")) {
+      depth = __next_number(&cursor, depth);
+    } else if (strview_eq(word, "movetime")) {
+      movetime = __next_number(&cursor, movetime);
+    } else if (strview_eq(word, "wtime")) {
+      wtime = __next_number(&cursor, wtime);
+    } else if (strview_eq(word, "btime")) {
+      btime = __next_number(&cursor, btime);
+    } else if (strview_eq(word, "turn")) {
+      // Non-standard override of the FEN's side to move, for older frontends
+      turn = __next_number(&cursor, turn);
+    }
   }
 
   // Check if the current player is already in checkmate/stalemate
-  int already_over = engine_check_game_over(bbs, magic, turn);
+  int already_over = engine_check_game_over(bbs, turn);
   if (already_over == 1) {
-    snprintf(response, MAX_RESPONSE, "gameover checkmate\n");
+    fprintf(out, "gameover checkmate\n");
     return;
   } else if (already_over == 2) {
-    snprintf(response, MAX_RESPONSE, "gameover stalemate\n");
+    fprintf(out, "gameover stalemate\n");
     return;
   }
 
-  EvalResult eval_res = search(bbs, magic, depth, turn);
-  String chess_not = move_info_to_chess_notation(eval_res.best_move);
-  engine_move(bbs, GET_FROM_POS(eval_res.best_move),
-              GET_TO_POS(eval_res.best_move)); // TODO: remove?
+  EvalResult eval_res =
+      search_iterative(bbs, depth, turn, INFO_INTERVAL_MS, __print_info, out);
+  char chess_not[MOVE_NOTATION_SIZE];
+  engine_move_notation(eval_res.best_move, chess_not);
 
-  // Check if the opponent is now in checkmate or stalemate
+  // Check if the opponent is then in checkmate or stalemate. The move is made
+  // on a copy: the position stays the one of the last "position" command.
+  ChessBitboards after;
+  engine_make_copy(bbs, &after, eval_res.best_move);
   enum PieceColor opponent = (turn == WHITE) ? BLACK : WHITE;
-  int game_over = engine_check_game_over(bbs, magic, opponent);
+  int game_over = engine_check_game_over(&after, opponent);
 
+  EvalCacheStats cache = search_eval_cache_stats();
+  if (cache.probes > 0) {
+    fprintf(out, "info string eval cache hits %llu / %llu\n", cache.hits,
+            cache.probes);
+  }
   if (game_over == 1) {
-    snprintf(response, MAX_RESPONSE, "bestmove %s\ngameover checkmate\n",
-             chess_not.data);
+    fprintf(out, "bestmove %s\ngameover checkmate\n", chess_not);
   } else if (game_over == 2) {
-    snprintf(response, MAX_RESPONSE, "bestmove %s\ngameover stalemate\n",
-             chess_not.data);
+    fprintf(out, "bestmove %s\ngameover stalemate\n", chess_not);
   } else {
-    snprintf(response, MAX_RESPONSE, "bestmove %s\n", chess_not.data);
+    fprintf(out, "bestmove %s\n", chess_not);
+  }
+}
+
+/**
+ * @brief Handle the (non-standard) "bench [depth]" command: perft over the
+ * bench positions once per slider backend, one line per backend.
+ *
+ * @param args: The rest of the command line after "bench".
+ */
+void handle_bench(const char *args, FILE *out) {
+  unsigned int depth = __next_number(&args, 4);
+
+  const enum SliderBackend BACKENDS[3] = {SLIDERS_MAGIC, SLIDERS_PEXT,
+                                          SLIDERS_OBSTRUCTION};
+  fprintf(out, "bench cpu %s\n", engine_cpu_level());
+  for (unsigned int b = 0; b < 3; b++) {
+    BenchResult result;
+    if (!engine_bench(depth, BACKENDS[b], &result)) {
+      fprintf(out, "bench backend %s unsupported\n", result.backend);
+      continue;
+    }
+    fprintf(out,
+            "bench backend %s depth %u nodes %llu time %.0f ms nps %.0f\n",
+            result.backend, depth, result.nodes, result.ms, result.nps);
   }
-  // printf("DEBUG: best_move raw = %u, notation = %s, flags = %x\n",
-  //      eval_res.best_move, chess_not.data, eval_res.best_move & 0xF000);
+}
 
-  printf("Best Score: %d\n", eval_res.eval);
-  str_free(&chess_not);
+/// Commands understood by process_uci_command().
+enum UciCommand {
+  UCI_UNKNOWN,
+  UCI_UCI,
+  UCI_POSITION,
+  UCI_GO,
+  UCI_BENCH,
+  UCI_QUIT,
+  UCI_DBG_PRINT_WHITE,
+  UCI_DBG_PRINT_BLACK,
+};
+
+/// Look a command keyword up, by its length first so that at most two
+/// comparisons are made.
+enum UciCommand __command_of(StrView word) {
+  switch (word.len) {
+  case 2:
+    return strview_eq(word, "go") ? UCI_GO : UCI_UNKNOWN;
+  case 3:
+    return strview_eq(word, "uci") ? UCI_UCI : UCI_UNKNOWN;
+  case 4:
+    return strview_eq(word, "quit") ? UCI_QUIT : UCI_UNKNOWN;
+  case 5:
+    return strview_eq(word, "bench") ? UCI_BENCH : UCI_UNKNOWN;
+  case 8:
+    return strview_eq(word, "position") ? UCI_POSITION : UCI_UNKNOWN;
+  case 15:
+    return strview_eq(word, "dbg_print_white")   ? UCI_DBG_PRINT_WHITE
+           : strview_eq(word, "dbg_print_black") ? UCI_DBG_PRINT_BLACK
+                                                 : UCI_UNKNOWN;
+  }
+  return UCI_UNKNOWN;
 }
 
 /**
- * @brief Process a UCI command from a String object.
+ * @brief Process a UCI command line. The line is split into words in place,
+ * without copying it or allocating.
  *
- * @param cmd: The UCI command as a String
+ * @param cmd: The UCI command line (any length, a trailing newline is allowed).
  * @param bbs: An existing ChessBitboards reference.
- * @param magic: An existing MagicInfo reference.
- * @param response: The buffer to write the response.
- * @param MAX_RESPONSE: The max size of the response buffer.
+ * @param out: The stream the response is written to, line by line as it is
+ * produced (not flushed).
  * @return Returns -1 to simulate a "break" if in a loop, returns 0 otherwise.
  */
-int process_uci_command(String *cmd, ChessBitboards *bbs, MagicInfo *magic,
-                        char *response, const int MAX_RESPONSE) {
-  memset(response, 0, MAX_RESPONSE * sizeof(char));
-  Vec tokens = str_split(cmd);
-  char *first_token = (char *)vec_get(&tokens, 0);
-  if (str_eq(first_token, "quit")) {
-    vec_free(&tokens);
-    str_free(cmd);
+int process_uci_command(const char *cmd, ChessBitboards *bbs, FILE *out) {
+  const char *args = cmd;
+  StrView word;
+  if (!str_next_word(&args, &word)) {
+    return 0; // blank line
+  }
+
+  switch (__command_of(word)) {
+  case UCI_QUIT:
     return -1;
-  } else if (str_eq(first_token, "uci")) {
-    handle_uci_init(response, MAX_RESPONSE);
-  } else if (str_eq(first_token, "position")) {
-    handle_position(&tokens, bbs, response, MAX_RESPONSE);
-  } else if (str_eq(first_token, "go")) {
-    handle_go(&tokens, bbs, magic, response, MAX_RESPONSE);
-  } else if (str_eq(first_token, "dbg_print_white")) {
+  case UCI_UCI:
+    handle_uci_init(out);
+    break;
+  case UCI_POSITION:
+    handle_position(args, bbs, out);
+    break;
+  case UCI_GO:
+    handle_go(args, bbs, out);
+    break;
+  case UCI_BENCH:
+    handle_bench(args, out);
+    break;
+  case UCI_DBG_PRINT_WHITE:
     // NOTE: NOT FOR USE IN WASM
-    bb_pretty_print(bbs->white_pieces);
-  } else if (str_eq(first_token, "dbg_print_black")) {
+    bb_pretty_print(bbs->occupancy[COLOR_INDEX(WHITE)]);
+    break;
+  case UCI_DBG_PRINT_BLACK:
     // NOTE: NOT FOR USE IN WASM
-    bb_pretty_print(bbs->black_pieces);
-  } else {
-    snprintf(response, MAX_RESPONSE, "Unknown command: %s", cmd->data);
+    bb_pretty_print(bbs->occupancy[COLOR_INDEX(BLACK)]);
+    break;
+  case UCI_UNKNOWN:
+    fprintf(out, "Unknown command: %s\n", cmd);
+    break;
   }
-  vec_free(&tokens);
-  str_free(cmd);
   return 0;
 }
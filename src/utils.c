@@ -65,6 +65,40 @@ void str_read_from_stdin(String *str, unsigned long maxlen) {
   strncpy(str->data, buffer, str->len);
 }
 
+/// Read a whole line (of any length) from a file into a String, without the
+/// newline. The String's buffer, of capacity *cap, is reused and only grows
+/// when a longer line comes in. Returns false at the end of the file.
+bool str_read_line(String *str, size_t *cap, FILE *file) {
+  if (str->data == NULL) {
+    *cap = 0;
+  }
+  size_t len = 0;
+  int c;
+  do {
+    if (len + 1 >= *cap) {
+      size_t new_cap = *cap ? *cap * 2 : 256;
+      char *new_data = (char *)realloc(str->data, new_cap);
+      if (!new_data) {
+        fprintf(stderr, "Cannot read a line. Reallocation issue.\n");
+        exit(1);
+      }
+      str->data = new_data;
+      *cap = new_cap;
+    }
+    c = getc(file);
+    if (c != EOF && c != '\n') {
+      str->data[len++] = c;
+    }
+  } while (c != EOF && c != '\n');
+
+  if (len > 0 && str->data[len - 1] == '\r') {
+    len--;
+  }
+  str->data[len] = '\0';
+  str->len = len;
+  return c != EOF || len > 0;
+}
+
 /// Check if a string equals another string literal
 bool str_eq(char *str, const char *other) { return !strcmp(str, other); }
 
@@ -130,6 +164,27 @@ Vec str_split(String *str) {
   return words;
 }
 
+/// Get the next whitespace-separated word of a string as a view into it and
+/// advance *cursor past the word. Returns false when no word is left.
+bool str_next_word(const char **cursor, StrView *word) {
+  const char *p = *cursor;
+  while (isspace((unsigned char)*p)) {
+    p++;
+  }
+  const char *start = p;
+  while (*p != '\0' && !isspace((unsigned char)*p)) {
+    p++;
+  }
+  *cursor = p;
+  *word = (StrView){.data = start, .len = p - start};
+  return word->len > 0;
+}
+
+/// Check if a StrView equals a string literal
+bool strview_eq(StrView view, const char *other) {
+  return strncmp(view.data, other, view.len) == 0 && other[view.len] == '\0';
+}
+
 /// Replace a String's contents with another string.
 /// This is useful if a string is intended to be mutable.
 void str_replace(String *str, char *new_str, size_t maxlen) {
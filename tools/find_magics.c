@@ -0,0 +1,526 @@
+#include "bitboard.h"
+#include "engine.h"
+#include "magic_info.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Finds rook and bishop black magics and writes them, with their shifts, arena
+// offsets and the arena size, as a ready-to-compile src/magic_info.c.
+//
+// Black magics index by ((occupied | ~mask) * magic) >> shift, so the index of
+// every occupancy is offset by ~mask * magic and the used entries of a table
+// need not start at 0 or reach its end. Once all magics are found, the tables
+// are packed into the arena: a table may start inside another one as long as
+// every entry they share holds the same moves (or is unused by one of them),
+// so tables with free entries at their ends or in between interleave.
+//
+// Every square is an independent work item with its own PRNG stream derived
+// from the seed, so the output only depends on the options and not on the
+// number of threads or on scheduling.
+//
+// Usage: find_magics <output.c> [--seed N] [--threads N] [--fixed]
+//                    [--shrink TRIES] [--span TRIES]
+//   --fixed   Use 12-bit rook and 9-bit bishop indices on every square
+//             instead of the blocker mask size.
+//   --shrink  Additionally try TRIES magics with one index bit less per
+//             square, keeping the smaller table when one is found.
+//   --span    Try TRIES more magics per square at its final index size and
+//             keep the one whose used entries span the fewest slots.
+
+#define MAX_INDEX_BITS 12
+#define MAX_TRIES 100000000ULL
+#define DEFAULT_SEED 0x1f2e3d4c5b6a7988ULL
+
+/// One square of one slider.
+typedef struct {
+  bool rook;
+  unsigned int square;
+  BITBOARD mask;
+  unsigned int num_occupancies;
+  BITBOARD *occupancies; // every subset of the mask
+  BITBOARD *attacks;     // the moves for each subset
+  // Results
+  BITBOARD magic;
+  unsigned int bits;
+  BITBOARD *table;   // 1 << bits entries, 0 where unused
+  unsigned int low;  // first used entry of the table
+  unsigned int high; // last used entry
+  unsigned int offset;
+} MagicWork;
+
+typedef struct {
+  MagicWork *work;
+  unsigned int num_work;
+  unsigned int next; // next work item to claim
+  unsigned long long seed;
+  bool fixed;
+  unsigned long long shrink_tries;
+  unsigned long long span_tries;
+} FinderState;
+
+/// xorshift64* step.
+static inline unsigned long long __xorshift(unsigned long long *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/// splitmix64, used to derive one well-mixed PRNG state per work item.
+static unsigned long long __splitmix(unsigned long long x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+/**
+ * @brief Try random sparse black magics for one square with a fixed index
+ * size.
+ *
+ * Collisions are checked in a table stamped with the attempt number, so no
+ * attempt has to clear it.
+ *
+ * @param work: The square to find a magic for.
+ * @param bits: The number of index bits.
+ * @param max_span: The largest distance allowed between the first and the
+ * last used entry; a magic is dropped as soon as its entries spread wider.
+ * @param tries: The number of magics left to try; decremented by every magic
+ * tried.
+ * @param rng: The PRNG state of this square.
+ * @param epochs: 1 << MAX_INDEX_BITS stamps (all zero on the first call).
+ * @param epoch: The last stamp used in `epochs`; on success, the stamp of the
+ * entries the magic uses.
+ * @param moves: 1 << MAX_INDEX_BITS entries, the moves seen per index.
+ * @return The magic, or 0 if none was found.
+ */
+BITBOARD __search_magic(const MagicWork *work, unsigned int bits,
+                        unsigned int max_span, unsigned long long *tries,
+                        unsigned long long *rng,
+                        unsigned int *epochs, unsigned int *epoch,
+                        BITBOARD *moves) {
+  const unsigned int SHIFT = 64 - bits;
+  const BITBOARD NOT_MASK = ~work->mask;
+  while (*tries > 0) {
+    (*tries)--;
+    // Few set bits make good magics; the top bit is kept clear so that every
+    // magic is a valid (signed) long long literal in magic_info.c.
+    BITBOARD magic =
+        __xorshift(rng) & __xorshift(rng) & __xorshift(rng) & ~(1ULL << 63);
+    if (__builtin_popcountll((work->mask * magic) & 0xFF00000000000000ULL) <
+        6) {
+      continue;
+    }
+
+    (*epoch)++;
+    bool ok = true;
+    unsigned int low = ~0U;
+    unsigned int high = 0;
+    for (unsigned int i = 0; i < work->num_occupancies; i++) {
+      unsigned int index = ((work->occupancies[i] | NOT_MASK) * magic) >> SHIFT;
+      low = index < low ? index : low;
+      high = index > high ? index : high;
+      if (high - low > max_span) {
+        ok = false;
+        break;
+      }
+      if (epochs[index] != *epoch) {
+        epochs[index] = *epoch;
+        moves[index] = work->attacks[i];
+      } else if (moves[index] != work->attacks[i]) {
+        ok = false;
+        break;
+      }
+    }
+    if (ok) {
+      return magic;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Find the first and last entry a successful search used.
+ *
+ * @param bits: The number of index bits of the search.
+ * @param epochs: The stamps of the search.
+ * @param epoch: The stamp of the entries the magic uses.
+ * @param low: Set to the first used entry.
+ * @return The last used entry.
+ */
+unsigned int __used_range(unsigned int bits, const unsigned int *epochs,
+                          unsigned int epoch, unsigned int *low) {
+  unsigned int high = 0;
+  *low = 1U << bits;
+  for (unsigned int i = 0; i < 1U << bits; i++) {
+    if (epochs[i] == epoch) {
+      *low = i < *low ? i : *low;
+      high = i;
+    }
+  }
+  return high;
+}
+
+/**
+ * @brief Keep the moves of a successful search as the square's table.
+ */
+void __keep_table(MagicWork *work, BITBOARD magic, unsigned int bits,
+                  const unsigned int *epochs, unsigned int epoch,
+                  const BITBOARD *moves) {
+  work->magic = magic;
+  work->bits = bits;
+  work->high = __used_range(bits, epochs, epoch, &work->low);
+  for (unsigned int i = 0; i < 1U << bits; i++) {
+    work->table[i] = epochs[i] == epoch ? moves[i] : 0;
+  }
+}
+
+/// Worker thread: claims squares until none are left.
+void *__find_magics_thread(void *arg) {
+  FinderState *state = arg;
+  unsigned int *epochs = calloc(1U << MAX_INDEX_BITS, sizeof(unsigned int));
+  BITBOARD *moves = malloc((1U << MAX_INDEX_BITS) * sizeof(BITBOARD));
+  unsigned int epoch = 0;
+
+  while (1) {
+    unsigned int w = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED);
+    if (w >= state->num_work) {
+      break;
+    }
+    MagicWork *work = &state->work[w];
+    unsigned long long rng = __splitmix(state->seed ^ __splitmix(w + 1));
+
+    unsigned int bits = work->rook ? 12 : 9;
+    if (!state->fixed) {
+      bits = __builtin_popcountll(work->mask);
+    }
+    unsigned long long tries = MAX_TRIES;
+    BITBOARD magic = __search_magic(work, bits, 1U << bits, &tries, &rng,
+                                    epochs, &epoch, moves);
+    if (magic == 0) {
+      fprintf(stderr, "no magic found for %s square %u\n",
+              work->rook ? "rook" : "bishop", work->square);
+      exit(1);
+    }
+    __keep_table(work, magic, bits, epochs, epoch, moves);
+
+    while (state->shrink_tries > 0 && bits > 1) {
+      tries = state->shrink_tries;
+      magic = __search_magic(work, bits - 1, 1U << bits, &tries, &rng, epochs,
+                             &epoch, moves);
+      if (magic == 0) {
+        break;
+      }
+      bits--;
+      __keep_table(work, magic, bits, epochs, epoch, moves);
+    }
+
+    // Narrower tables leave more room at their ends for the packing
+    tries = state->span_tries;
+    while (work->high > work->low &&
+           (magic = __search_magic(work, bits, work->high - work->low - 1,
+                                   &tries, &rng, epochs, &epoch, moves)) != 0) {
+      __keep_table(work, magic, bits, epochs, epoch, moves);
+    }
+  }
+
+  free(moves);
+  free(epochs);
+  return NULL;
+}
+
+/**
+ * @brief Set up the occupancies and reference moves of every square. The
+ * PEXT tables index the moves by subset number, in the same order as the
+ * occupancies are enumerated here.
+ */
+void __init_work(MagicWork *work) {
+  BoardTables *tables = malloc(sizeof(BoardTables));
+  BITBOARD *arena = malloc(PEXT_ARENA_SIZE * sizeof(BITBOARD));
+  MagicInfo magic_info = init_magic_info();
+  engine_build_tables(tables, arena, &magic_info, SLIDERS_PEXT);
+
+  for (unsigned int w = 0; w < 128; w++) {
+    bool rook = w < 64;
+    const MagicEntry *entry = rook ? &tables->rook_magics[w % 64]
+                                   : &tables->bishop_magics[w % 64];
+    work[w].rook = rook;
+    work[w].square = w % 64;
+    work[w].mask = entry->mask;
+    work[w].num_occupancies = 1U << __builtin_popcountll(entry->mask);
+    work[w].occupancies = malloc(work[w].num_occupancies * sizeof(BITBOARD));
+    work[w].attacks = malloc(work[w].num_occupancies * sizeof(BITBOARD));
+    work[w].table = calloc(1U << MAX_INDEX_BITS, sizeof(BITBOARD));
+
+    // Carry-rippler: enumerate every subset of the mask
+    BITBOARD occupancy = 0;
+    for (unsigned int i = 0; i < work[w].num_occupancies; i++) {
+      work[w].occupancies[i] = occupancy;
+      work[w].attacks[i] = entry->attacks[i];
+      occupancy = (occupancy - entry->mask) & entry->mask;
+    }
+  }
+
+  free(arena);
+  free(tables);
+}
+
+/**
+ * @brief Pack the tables into the arena. Wider tables are placed first, each
+ * at the lowest offset where it agrees with everything placed before it.
+ *
+ * @param work: The 128 squares (magics found).
+ * @return The arena size needed (end of the last used entry).
+ */
+unsigned int __pack_tables(MagicWork *work) {
+  // Every table fits at the end, so the arena never grows past this
+  const unsigned int CAPACITY = 129 << MAX_INDEX_BITS;
+  BITBOARD *arena = calloc(CAPACITY, sizeof(BITBOARD));
+  unsigned int *used = malloc((1U << MAX_INDEX_BITS) * sizeof(unsigned int));
+  unsigned int end = 0;
+
+  // Stable order: by span of the used entries, then rooks before bishops,
+  // then square
+  MagicWork *order[128];
+  for (unsigned int w = 0; w < 128; w++) {
+    unsigned int o = w;
+    while (o > 0 && order[o - 1]->high - order[o - 1]->low <
+                        work[w].high - work[w].low) {
+      order[o] = order[o - 1];
+      o--;
+    }
+    order[o] = &work[w];
+  }
+
+  for (unsigned int o = 0; o < 128; o++) {
+    MagicWork *w = order[o];
+    unsigned int num_used = 0;
+    for (unsigned int i = w->low; i <= w->high; i++) {
+      if (w->table[i] != 0) {
+        used[num_used++] = i;
+      }
+    }
+
+    unsigned int offset = 0;
+    while (1) {
+      bool fits = true;
+      for (unsigned int u = 0; u < num_used; u++) {
+        BITBOARD placed = arena[offset + used[u]];
+        if (placed != 0 && placed != w->table[used[u]]) {
+          fits = false;
+          break;
+        }
+      }
+      if (fits) {
+        break;
+      }
+      offset++;
+    }
+
+    for (unsigned int u = 0; u < num_used; u++) {
+      arena[offset + used[u]] = w->table[used[u]];
+    }
+    w->offset = offset;
+    if (offset + w->high + 1 > end) {
+      end = offset + w->high + 1;
+    }
+  }
+
+  free(used);
+  free(arena);
+  return end;
+}
+
+/// Write 64 magics in the layout of magic_info.c.
+void __write_magics(FILE *out, const char *name, const MagicWork *work) {
+  fprintf(out, "  unsigned long long %s[64] = {", name);
+  for (unsigned int i = 0; i < 64; i++) {
+    char number[24];
+    snprintf(number, sizeof(number), "%llu%s", work[i].magic,
+             i == 63 ? "};" : ",");
+    fprintf(out, "%s%-*s", i % 3 == 0 ? "\n      " : " ",
+            i % 3 == 2 || i == 63 ? 0 : 20, number);
+  }
+  fprintf(out, "\n");
+}
+
+/// Write 64 unsigned ints (shifts or offsets), `per_line` to a line.
+void __write_uints(FILE *out, const char *name, const unsigned int *values,
+                   unsigned int per_line) {
+  fprintf(out, "  unsigned int %s[64] = {", name);
+  for (unsigned int i = 0; i < 64; i++) {
+    fprintf(out, "%s%u%s", i % per_line == 0 ? "\n      " : " ", values[i],
+            i == 63 ? "};\n" : ",");
+  }
+}
+
+/// Write the magics of one slider (`prefix` is "r" or "b").
+void __write_slider(FILE *out, const char *prefix, const MagicWork *work) {
+  char name[32];
+  unsigned int shifts[64];
+  unsigned int offsets[64];
+  for (unsigned int i = 0; i < 64; i++) {
+    shifts[i] = 64 - work[i].bits;
+    offsets[i] = work[i].offset;
+  }
+  snprintf(name, sizeof(name), "%s_magic_buffer", prefix);
+  __write_magics(out, name, work);
+  snprintf(name, sizeof(name), "%s_shift_buffer", prefix);
+  __write_uints(out, name, shifts, 16);
+  snprintf(name, sizeof(name), "%s_offset_buffer", prefix);
+  __write_uints(out, name, offsets, 8);
+}
+
+/// Write src/magic_info.c.
+void __write_magic_info(FILE *out, const MagicWork *work, const char *options,
+                        unsigned int arena_size) {
+  fprintf(out,
+          "#include \"magic_info.h\"\n"
+          "\n"
+          "void __set_magic_info_from_array(unsigned long long *magics,\n"
+          "                                 unsigned int *shifts,\n"
+          "                                 unsigned int *offsets,\n"
+          "                                 unsigned long long *magic_buffer,\n"
+          "                                 unsigned int *shift_buffer,\n"
+          "                                 unsigned int *offset_buffer) {\n"
+          "  for (unsigned int i = 0; i < 64; i++) {\n"
+          "    magics[i] = magic_buffer[i];\n"
+          "    shifts[i] = shift_buffer[i];\n"
+          "    offsets[i] = offset_buffer[i];\n"
+          "  }\n"
+          "}\n"
+          "\n"
+          "/**\n"
+          " * @brief Initialize the *_MAGICS, *_SHIFTS and *_OFFSETS arrays.\n"
+          " */\n"
+          "MagicInfo init_magic_info() {\n"
+          "  // Generated by tools/find_magics.c (make magics) with\n"
+          "  // %s.\n"
+          "  // Tables may overlap as long as the entries they share agree\n"
+          "  // (engine_setup() asserts this).\n"
+          "\n"
+          "  MagicInfo magic_info;\n"
+          "\n"
+          "  //\n"
+          "  // Rook info\n",
+          options);
+  __write_slider(out, "r", work);
+  fprintf(out, "\n"
+               "  __set_magic_info_from_array(\n"
+               "      magic_info.ROOK_MAGICS, magic_info.ROOK_SHIFTS,\n"
+               "      magic_info.ROOK_OFFSETS, r_magic_buffer, "
+               "r_shift_buffer,\n"
+               "      r_offset_buffer);\n"
+               "\n"
+               "  //\n"
+               "  // Bishop info\n");
+  __write_slider(out, "b", work + 64);
+  fprintf(out, "\n"
+               "  __set_magic_info_from_array(\n"
+               "      magic_info.BISHOP_MAGICS, magic_info.BISHOP_SHIFTS,\n"
+               "      magic_info.BISHOP_OFFSETS, b_magic_buffer, "
+               "b_shift_buffer,\n"
+               "      b_offset_buffer);\n"
+               "\n"
+               "  magic_info.ARENA_SIZE = %u;\n"
+               "\n"
+               "  return magic_info;\n"
+               "}\n",
+          arena_size);
+}
+
+/// Print the table sizes of one slider.
+void __report(const char *name, const MagicWork *work) {
+  unsigned long long entries = 0;
+  unsigned long long span = 0;
+  unsigned long long used = 0;
+  for (unsigned int i = 0; i < 64; i++) {
+    entries += 1ULL << work[i].bits;
+    span += work[i].high - work[i].low + 1;
+    for (unsigned int j = 0; j < 1U << work[i].bits; j++) {
+      used += work[i].table[j] != 0;
+    }
+  }
+  printf("%-7s entries %7llu (%7.1f kB)  span %7llu  used %7llu\n", name,
+         entries, entries * sizeof(BITBOARD) / 1024.0, span, used);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr,
+            "usage: %s <output.c> [--seed N] [--threads N] [--fixed] "
+            "[--shrink TRIES] [--span TRIES]\n",
+            argv[0]);
+    return 1;
+  }
+
+  FinderState state = {0};
+  state.seed = DEFAULT_SEED;
+  unsigned int num_threads = 4;
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--fixed") == 0) {
+      state.fixed = true;
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      state.seed = strtoull(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      num_threads = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--shrink") == 0 && i + 1 < argc) {
+      state.shrink_tries = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--span") == 0 && i + 1 < argc) {
+      state.span_tries = strtoull(argv[++i], NULL, 10);
+    } else {
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (num_threads == 0) {
+    num_threads = 1;
+  }
+
+  MagicWork work[128];
+  __init_work(work);
+  state.work = work;
+  state.num_work = 128;
+
+  pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+  for (unsigned int t = 0; t < num_threads; t++) {
+    pthread_create(&threads[t], NULL, __find_magics_thread, &state);
+  }
+  for (unsigned int t = 0; t < num_threads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  free(threads);
+
+  unsigned int arena_size = __pack_tables(work);
+  __report("rooks", work);
+  __report("bishops", work + 64);
+  printf("arena   entries %7u (%7.1f kB)\n", arena_size,
+         arena_size * sizeof(BITBOARD) / 1024.0);
+
+  char options[128];
+  snprintf(options, sizeof(options), "seed 0x%llx, %s shifts%s", state.seed,
+           state.fixed ? "fixed" : "minimal",
+           state.shrink_tries ? ", shrunk" : "");
+  if (state.span_tries) {
+    snprintf(options + strlen(options), sizeof(options) - strlen(options),
+             ", span tries %llu", state.span_tries);
+  }
+  FILE *out = fopen(argv[1], "w");
+  if (out == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  __write_magic_info(out, work, options, arena_size);
+  fclose(out);
+  printf("wrote %s\n", argv[1]);
+
+  for (unsigned int w = 0; w < 128; w++) {
+    free(work[w].occupancies);
+    free(work[w].attacks);
+    free(work[w].table);
+  }
+  return 0;
+}
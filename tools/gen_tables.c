@@ -0,0 +1,127 @@
+#include "bitboard.h"
+#include "engine.h"
+#include "magic_info.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+//
+// Emits the engine's lookup tables as const C arrays, so that an engine built
+// with GENERATED_TABLES links them in instead of computing them at startup.
+// The tables are built with the same engine_build_tables() the runtime path
+// uses. Building the PEXT tables does not need a BMI2 CPU, only using them
+// does.
+//
+// Usage: gen_tables <output.c>
+
+/**
+ * @brief Write a bitboard array as a C initializer, four entries per line.
+ *
+ * @param out: The file to write to.
+ * @param values: The bitboards to write.
+ * @param count: The number of bitboards.
+ */
+void __write_bitboards(FILE *out, const BITBOARD *values, unsigned int count) {
+  for (unsigned int i = 0; i < count; i++) {
+    fprintf(out, "%s0x%016llxULL,", i % 4 == 0 ? "    " : " ", values[i]);
+    if (i % 4 == 3 || i == count - 1) {
+      fprintf(out, "\n");
+    }
+  }
+}
+
+/**
+ * @brief Write the slider entries of one piece type as a C initializer.
+ *
+ * @param out: The file to write to.
+ * @param entries: The 64 entries to write.
+ * @param arena: The arena the entries point into.
+ * @param arena_name: The name of the arena in the generated file.
+ */
+void __write_entries(FILE *out, const MagicEntry *entries,
+                     const BITBOARD *arena, const char *arena_name) {
+  fprintf(out, "    {\n");
+  for (unsigned int i = 0; i < 64; i++) {
+    fprintf(out, "        {0x%016llxULL, 0x%016llxULL, %s + %ld, %u},\n",
+            entries[i].mask, entries[i].magic, arena_name,
+            (long)(entries[i].attacks - arena), entries[i].shift);
+  }
+  fprintf(out, "    },\n");
+}
+
+/**
+ * @brief Build the tables for a backend and write them (and their arena).
+ *
+ * @param out: The file to write to.
+ * @param magic_info: The magics the tables are built from.
+ * @param backend: The slider backend to build the tables for.
+ * @param prefix: The name prefix of the generated arrays.
+ */
+void __write_backend(FILE *out, const MagicInfo *magic_info,
+                     enum SliderBackend backend, const char *prefix) {
+  BoardTables *tables = malloc(sizeof(BoardTables));
+  const unsigned int ARENA_SIZE = engine_arena_size(magic_info, backend);
+  BITBOARD *arena = malloc(ARENA_SIZE * sizeof(BITBOARD));
+  engine_build_tables(tables, arena, magic_info, backend);
+
+  char arena_name[64];
+  snprintf(arena_name, sizeof(arena_name), "GENERATED_%s_ARENA", prefix);
+  fprintf(out,
+          "static const BITBOARD %s[%u] __attribute__((aligned(64))) = {\n",
+          arena_name, ARENA_SIZE);
+  __write_bitboards(out, arena, ARENA_SIZE);
+  fprintf(out, "};\n\n");
+
+  fprintf(out, "const BoardTables GENERATED_%s_TABLES = {\n", prefix);
+  fprintf(out, "    {\n");
+  __write_bitboards(out, tables->knight_moves, 64);
+  fprintf(out, "    },\n    {\n");
+  __write_bitboards(out, tables->king_moves, 64);
+  fprintf(out, "    },\n    {\n");
+  for (unsigned int c = 0; c < 2; c++) {
+    fprintf(out, "    {\n");
+    __write_bitboards(out, tables->pawn_captures[c], 64);
+    fprintf(out, "    },\n");
+  }
+  fprintf(out, "    },\n");
+  __write_entries(out, tables->rook_magics, arena, arena_name);
+  __write_entries(out, tables->bishop_magics, arena, arena_name);
+  fprintf(out, "    {\n");
+  for (unsigned int i = 0; i < 64; i++) {
+    fprintf(out, "        {");
+    for (unsigned int l = 0; l < 4; l++) {
+      fprintf(out, "{0x%016llxULL, 0x%016llxULL}%s", tables->lines[i][l].lower,
+              tables->lines[i][l].upper, l == 3 ? "},\n" : ", ");
+    }
+  }
+  fprintf(out, "    },\n");
+  fprintf(out, "};\n");
+
+  free(arena);
+  free(tables);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <output.c>\n", argv[0]);
+    return 1;
+  }
+  FILE *out = fopen(argv[1], "w");
+  if (out == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  MagicInfo magic_info = init_magic_info();
+  fprintf(out, "// Generated by tools/gen_tables.c. Do not edit.\n\n"
+               "#include \"generated_tables.h\"\n\n");
+  __write_backend(out, &magic_info, SLIDERS_MAGIC, "MAGIC");
+  fprintf(out, "\n#if defined(__x86_64__)\n\n");
+  __write_backend(out, &magic_info, SLIDERS_PEXT, "PEXT");
+  fprintf(out, "\n#endif\n");
+
+  if (fclose(out) != 0) {
+    perror(argv[1]);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,512 @@
+#include "bitboard.h"
+#include "eval.h"
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Texel tuning of the piece-square tables in src/eval.c.
+//
+// `pack` reads labelled positions, one per line: a FEN followed by the result
+// of the game it comes from, bare, in brackets or quoted, or as the first
+// operand of an EPD opcode (c9 "1-0"; as in the usual EPD sets). 1-0, 0-1,
+// 1/2-1/2 and ½-½ are read, and so are the scores 1.0, 0.0 and 0.5. Lines
+// without one of them are skipped. It writes the rest as PackedPositions.
+//
+// `tune` loads a packed file and minimises the mean squared error between
+// the results and sigmoid(K * eval / 400) by gradient descent (Adam). The
+// eval is the tapered piece-square score, which is linear in the table
+// entries. Each position is therefore stored once as its coefficients: the
+// table entries of its pieces (signed by color) and its phase. An epoch is
+// one pass over these short lists, split across threads by position, with
+// no board or full evaluation involved. K is fitted to the starting tables
+// first unless given. The tuned tables, middlegame and endgame for every
+// piece, are written as C source to paste over the tables in src/eval.c.
+//
+// Usage: tune_tables pack <positions.txt> <positions.bin>
+//        tune_tables tune <positions.bin> <output.c> [--epochs N]
+//                    [--threads N] [--rate R] [--k K]
+
+#define PACKED_FILE_MAGIC "IPTUNE01"
+#define MAX_LINE 512
+#define MAX_THREADS 256
+
+/// Table entries: [PieceType - 1][row][column] as in src/eval.c (row 0 is the
+/// 8th rank from white's side, column 0 the a-file).
+#define NUM_ENTRIES (6 * 64)
+/// Set in a coefficient when the piece is black (it counts negatively).
+#define BLACK_COEFFICIENT 0x8000
+
+//
+// Packing
+
+/// Spellings of a game result, as in EPD sets ("1-0") or as the score of the
+/// position ("1.0"), with the label each stands for.
+static const struct {
+  const char *token;
+  int result;
+} RESULT_TOKENS[] = {
+    {"1-0", 2}, {"1.0", 2}, {"0-1", 0}, {"0.0", 0}, {"1/2-1/2", 1}, {"0.5", 1},
+    {"\xc2\xbd-\xc2\xbd", 1}, // "½-½" in UTF-8
+};
+
+/**
+ * @brief Read the result of a game right after the FEN on a line of a
+ * labelled position file. The result is the first token there, either bare,
+ * in brackets ("[1.0]") or in quotes. An EPD opcode before it ("c9 \"1-0\";")
+ * is skipped, so the result is the opcode's first operand.
+ *
+ * @param rest: The rest of the line after the FEN.
+ * @return 2 for a white win, 1 for a draw, 0 for a black win, -1 if the token
+ * is not one of RESULT_TOKENS.
+ */
+int __parse_result(const char *rest) {
+  rest += strspn(rest, " \t");
+  if (isalpha((unsigned char)*rest)) {
+    while (isalnum((unsigned char)*rest) || *rest == '_') {
+      rest++;
+    }
+    rest += strspn(rest, " \t");
+  }
+
+  // Delimit the token
+  size_t length;
+  if (*rest == '[' || *rest == '"') {
+    const char *close = strchr(rest + 1, *rest == '[' ? ']' : '"');
+    if (close == NULL) {
+      return -1;
+    }
+    rest++;
+    length = close - rest;
+  } else {
+    length = strcspn(rest, " \t\r\n;");
+  }
+
+  for (size_t i = 0; i < sizeof(RESULT_TOKENS) / sizeof(RESULT_TOKENS[0]);
+       i++) {
+    if (strlen(RESULT_TOKENS[i].token) == length &&
+        strncmp(rest, RESULT_TOKENS[i].token, length) == 0) {
+      return RESULT_TOKENS[i].result;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Parse the FEN at the start of a line of a labelled position file. A
+ * bare result right after the en passant field ("... - 1-0") reads as bad
+ * move clocks, so the first four fields are then parsed on their own.
+ *
+ * @param bbs: The ChessBitboards object to fill.
+ * @param state: Filled with the other fields.
+ * @param line: The line (restored before returning).
+ * @param rest: Set to the rest of the line after the FEN.
+ * @return true if the FEN was read.
+ */
+bool __parse_labelled_fen(ChessBitboards *bbs, FenState *state, char *line,
+                          const char **rest) {
+  enum FenError error = bb_parse_fen(bbs, state, line, rest);
+  if (error != FEN_BAD_CLOCKS) {
+    return error == FEN_OK;
+  }
+
+  char *end = line + strspn(line, " \t");
+  for (unsigned int field = 0; field < 4; field++) {
+    end += strspn(end, " \t");
+    end += strcspn(end, " \t\r\n");
+  }
+  char saved = *end;
+  *end = '\0';
+  error = bb_parse_fen(bbs, state, line, NULL);
+  *end = saved;
+  *rest = end;
+  return error == FEN_OK;
+}
+
+/// `tune_tables pack`: labelled FENs to a packed file.
+int __pack(const char *in_path, const char *out_path) {
+  FILE *in = fopen(in_path, "r");
+  FILE *out = fopen(out_path, "wb");
+  if (in == NULL || out == NULL) {
+    fprintf(stderr, "could not open %s or %s\n", in_path, out_path);
+    return 1;
+  }
+
+  uint64_t count = 0, skipped = 0;
+  fwrite(PACKED_FILE_MAGIC, 1, 8, out);
+  fwrite(&count, sizeof(count), 1, out); // patched below
+
+  char line[MAX_LINE];
+  ChessBitboards bbs;
+  FenState state;
+  while (fgets(line, sizeof(line), in)) {
+    const char *rest;
+    PackedPosition packed;
+    if (!__parse_labelled_fen(&bbs, &state, line, &rest)) {
+      skipped++;
+      continue;
+    }
+    int result = __parse_result(rest);
+    if (result < 0 || !eval_pack(&bbs, &packed)) {
+      skipped++;
+      continue;
+    }
+    unsigned char label = result;
+    fwrite(&packed, sizeof(packed), 1, out);
+    fwrite(&label, 1, 1, out);
+    count++;
+  }
+
+  fseek(out, 8, SEEK_SET);
+  fwrite(&count, sizeof(count), 1, out);
+  fclose(in);
+  if (fclose(out) != 0) {
+    fprintf(stderr, "could not write %s\n", out_path);
+    return 1;
+  }
+  printf("packed %llu positions (%llu lines skipped)\n",
+         (unsigned long long)count, (unsigned long long)skipped);
+  return 0;
+}
+
+//
+// Coefficients
+
+/// Every position of a packed file as coefficients.
+typedef struct {
+  size_t count;
+  uint32_t *first;        // index of each position's first coefficient
+  uint16_t *coefficients; // table entry | BLACK_COEFFICIENT for black pieces
+  int16_t *material;      // material balance, which is not tuned
+  uint8_t *phase;         // game phase, capped at PHASE_MAX
+  float *result;          // 1 white win, 0.5 draw, 0 black win
+} Dataset;
+
+/// Table entry of a piece code on a square (see NUM_ENTRIES).
+unsigned int __entry(unsigned char code, unsigned int sq) {
+  unsigned int rank = sq / 8;
+  unsigned int row = PIECE_CODE_COLOR_INDEX(code) ? rank : 7 - rank;
+  return (PIECE_CODE_TYPE(code) - 1) * 64 + row * 8 + (7 - sq % 8);
+}
+
+/// Load a packed file into coefficients.
+bool __load(const char *path, Dataset *data) {
+  FILE *in = fopen(path, "rb");
+  char magic[8];
+  uint64_t count;
+  if (in == NULL || fread(magic, 1, 8, in) != 8 ||
+      memcmp(magic, PACKED_FILE_MAGIC, 8) != 0 ||
+      fread(&count, sizeof(count), 1, in) != 1) {
+    fprintf(stderr, "%s is not a packed position file\n", path);
+    return false;
+  }
+
+  data->count = count;
+  data->first = malloc((count + 1) * sizeof(uint32_t));
+  data->coefficients = malloc(count * 32 * sizeof(uint16_t));
+  data->material = malloc(count * sizeof(int16_t));
+  data->phase = malloc(count * sizeof(uint8_t));
+  data->result = malloc(count * sizeof(float));
+  if (!data->first || !data->coefficients || !data->material ||
+      !data->phase || !data->result) {
+    fprintf(stderr, "could not allocate %llu positions\n",
+            (unsigned long long)count);
+    return false;
+  }
+
+  uint32_t len = 0;
+  for (size_t i = 0; i < count; i++) {
+    PackedPosition packed;
+    unsigned char label;
+    if (fread(&packed, sizeof(packed), 1, in) != 1 ||
+        fread(&label, 1, 1, in) != 1) {
+      fprintf(stderr, "%s is truncated\n", path);
+      return false;
+    }
+
+    int material = 0, phase = 0;
+    data->first[i] = len;
+    BITBOARD occupied = packed.occupancy;
+    for (unsigned int k = 0; occupied; k++) {
+      unsigned int sq = POP_LSB(occupied);
+      unsigned char code = (packed.codes[k / 2] >> (4 * (k % 2))) & 15;
+      bool black = PIECE_CODE_COLOR_INDEX(code);
+      int value = EVAL_PIECE_VALUES[PIECE_CODE_TYPE(code)];
+      material += black ? -value : value;
+      phase += EVAL_PHASE[code];
+      data->coefficients[len++] =
+          __entry(code, sq) | (black ? BLACK_COEFFICIENT : 0);
+    }
+    data->material[i] = material;
+    data->phase[i] = phase < PHASE_MAX ? phase : PHASE_MAX;
+    data->result[i] = label / 2.0f;
+  }
+  data->first[count] = len;
+  fclose(in);
+  return true;
+}
+
+//
+// Tuning
+
+/// The tuned values: table entries of both halves.
+typedef struct {
+  double mg[NUM_ENTRIES];
+  double eg[NUM_ENTRIES];
+} Params;
+
+/// One thread's share of an epoch.
+typedef struct {
+  const Dataset *data;
+  const Params *params;
+  double k;
+  size_t begin, end;
+  bool gradient; // also accumulate the gradient
+  // Results
+  double error;
+  Params grad;
+} EpochJob;
+
+/// The sigmoid of the search score, as an expected result.
+static inline double __sigmoid(double k, double eval) {
+  return 1.0 / (1.0 + exp(-k * eval * log(10.0) / 400.0));
+}
+
+void *__epoch_thread(void *arg) {
+  EpochJob *job = arg;
+  const Dataset *data = job->data;
+  const double *mg = job->params->mg;
+  const double *eg = job->params->eg;
+  job->error = 0;
+  memset(&job->grad, 0, sizeof(job->grad));
+
+  for (size_t i = job->begin; i < job->end; i++) {
+    const uint16_t *c = data->coefficients + data->first[i];
+    unsigned int n = data->first[i + 1] - data->first[i];
+    double mg_sum = 0, eg_sum = 0;
+    for (unsigned int j = 0; j < n; j++) {
+      unsigned int e = c[j] & ~BLACK_COEFFICIENT;
+      double sign = c[j] & BLACK_COEFFICIENT ? -1.0 : 1.0;
+      mg_sum += sign * mg[e];
+      eg_sum += sign * eg[e];
+    }
+    double mg_weight = data->phase[i] / (double)PHASE_MAX;
+    double eval =
+        data->material[i] + mg_sum * mg_weight + eg_sum * (1 - mg_weight);
+    double s = __sigmoid(job->k, eval);
+    double diff = s - data->result[i];
+    job->error += diff * diff;
+    if (!job->gradient) {
+      continue;
+    }
+
+    // d(diff^2)/d(eval), up to the constant 2 * K * ln(10) / 400
+    double slope = diff * s * (1 - s);
+    for (unsigned int j = 0; j < n; j++) {
+      unsigned int e = c[j] & ~BLACK_COEFFICIENT;
+      double signed_slope = c[j] & BLACK_COEFFICIENT ? -slope : slope;
+      job->grad.mg[e] += signed_slope * mg_weight;
+      job->grad.eg[e] += signed_slope * (1 - mg_weight);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief One pass over the dataset.
+ *
+ * @param grad: If not NULL, filled with the gradient of the error.
+ * @return The mean squared error.
+ */
+double __epoch(const Dataset *data, const Params *params, double k,
+               unsigned int num_threads, Params *grad) {
+  EpochJob *jobs = malloc(num_threads * sizeof(EpochJob));
+  pthread_t threads[MAX_THREADS];
+  for (unsigned int t = 0; t < num_threads; t++) {
+    jobs[t] = (EpochJob){.data = data,
+                         .params = params,
+                         .k = k,
+                         .begin = data->count * t / num_threads,
+                         .end = data->count * (t + 1) / num_threads,
+                         .gradient = grad != NULL};
+    pthread_create(&threads[t], NULL, __epoch_thread, &jobs[t]);
+  }
+
+  double error = 0;
+  if (grad) {
+    memset(grad, 0, sizeof(*grad));
+  }
+  double scale = 2.0 * k * log(10.0) / 400.0 / data->count;
+  for (unsigned int t = 0; t < num_threads; t++) {
+    pthread_join(threads[t], NULL);
+    error += jobs[t].error;
+    for (unsigned int e = 0; grad && e < NUM_ENTRIES; e++) {
+      grad->mg[e] += jobs[t].grad.mg[e] * scale;
+      grad->eg[e] += jobs[t].grad.eg[e] * scale;
+    }
+  }
+  free(jobs);
+  return error / data->count;
+}
+
+/// Fit K to the current values by ternary search (the error is unimodal in
+/// K).
+double __fit_k(const Dataset *data, const Params *params,
+               unsigned int num_threads) {
+  double low = 0.05, high = 5.0;
+  for (unsigned int i = 0; i < 40; i++) {
+    double a = low + (high - low) / 3, b = high - (high - low) / 3;
+    if (__epoch(data, params, a, num_threads, NULL) <
+        __epoch(data, params, b, num_threads, NULL)) {
+      high = b;
+    } else {
+      low = a;
+    }
+  }
+  return (low + high) / 2;
+}
+
+//
+// Output
+
+static const char *TABLE_NAMES[6] = {"pawn", "bishop", "knight",
+                                     "rook", "queen",  "king"};
+static const char *TABLE_TITLES[6] = {"Pawns", "Bishops", "Knights",
+                                      "Rooks", "Queens",  "King"};
+
+/// Write one table as a C initializer.
+void __write_table(FILE *out, const double *values, unsigned int type,
+                   const char *half) {
+  fprintf(out, "// %s (%s)\nstatic const int %s_%s_table[8][8] = {\n",
+          TABLE_TITLES[type - 1], strcmp(half, "mg") ? "endgame" : "middlegame",
+          TABLE_NAMES[type - 1], half);
+  for (unsigned int row = 0; row < 8; row++) {
+    fprintf(out, "    {");
+    for (unsigned int col = 0; col < 8; col++) {
+      fprintf(out, "%s%d", col ? ", " : "",
+              (int)lround(values[(type - 1) * 64 + row * 8 + col]));
+    }
+    fprintf(out, "}%s\n", row == 7 ? "};\n" : ",");
+  }
+}
+
+bool __write_tables(const char *path, const Params *params, size_t count,
+                    double k, double error_before, double error_after) {
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    return false;
+  }
+  fprintf(out,
+          "// Tuned by tools/tune_tables.c on %zu positions (K %.3f, mean "
+          "squared\n// error %.6f -> %.6f). Replaces the tables in "
+          "src/eval.c.\n\n",
+          count, k, error_before, error_after);
+  for (unsigned int type = PAWN; type <= KING; type++) {
+    __write_table(out, params->mg, type, "mg");
+    __write_table(out, params->eg, type, "eg");
+  }
+  fprintf(out, "/// Tables by piece type.\n"
+               "static const int (*const MG_TABLES[8])[8] = {\n"
+               "    NULL, pawn_mg_table, bishop_mg_table, knight_mg_table,\n"
+               "    rook_mg_table, queen_mg_table, king_mg_table, NULL};\n"
+               "static const int (*const EG_TABLES[8])[8] = {\n"
+               "    NULL, pawn_eg_table, bishop_eg_table, knight_eg_table,\n"
+               "    rook_eg_table, queen_eg_table, king_eg_table, NULL};\n");
+  return fclose(out) == 0;
+}
+
+/// `tune_tables tune`: fit the tables to a packed file.
+int __tune(const char *in_path, const char *out_path, int argc, char **argv) {
+  unsigned int epochs = 100, num_threads = 4;
+  double rate = 1.0, k = 0;
+  for (int i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "--epochs") == 0 && i + 1 < argc) {
+      epochs = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      num_threads = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+      rate = strtod(argv[++i], NULL);
+    } else if (strcmp(argv[i], "--k") == 0 && i + 1 < argc) {
+      k = strtod(argv[++i], NULL);
+    } else {
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+  num_threads = num_threads < 1             ? 1
+                : num_threads > MAX_THREADS ? MAX_THREADS
+                                            : num_threads;
+
+  Dataset data;
+  if (!__load(in_path, &data) || data.count == 0) {
+    return 1;
+  }
+
+  // Start from the current tables
+  eval_init();
+  Params params;
+  for (unsigned int type = PAWN; type <= KING; type++) {
+    for (unsigned int sq = 0; sq < 64; sq++) {
+      unsigned char code = PIECE_CODE(type, WHITE);
+      unsigned int e = __entry(code, sq);
+      params.mg[e] = EVAL_MG[code][sq] - EVAL_PIECE_VALUES[type];
+      params.eg[e] = EVAL_EG[code][sq] - EVAL_PIECE_VALUES[type];
+    }
+  }
+
+  if (k <= 0) {
+    k = __fit_k(&data, &params, num_threads);
+  }
+  double error_before = __epoch(&data, &params, k, num_threads, NULL);
+  printf("positions %zu K %.3f error %.6f\n", data.count, k, error_before);
+
+  // Adam
+  const double BETA1 = 0.9, BETA2 = 0.999, EPSILON = 1e-8;
+  Params grad, m = {0}, v = {0};
+  double *p = (double *)&params, *g = (double *)&grad;
+  double *pm = (double *)&m, *pv = (double *)&v;
+  double error = error_before;
+  for (unsigned int epoch = 1; epoch <= epochs; epoch++) {
+    error = __epoch(&data, &params, k, num_threads, &grad);
+    double correction1 = 1 - pow(BETA1, epoch);
+    double correction2 = 1 - pow(BETA2, epoch);
+    for (unsigned int i = 0; i < 2 * NUM_ENTRIES; i++) {
+      pm[i] = BETA1 * pm[i] + (1 - BETA1) * g[i];
+      pv[i] = BETA2 * pv[i] + (1 - BETA2) * g[i] * g[i];
+      p[i] -= rate * (pm[i] / correction1) /
+              (sqrt(pv[i] / correction2) + EPSILON);
+    }
+    if (epoch % 10 == 0 || epoch == epochs) {
+      printf("epoch %u error %.6f\n", epoch, error);
+    }
+  }
+  double error_after = __epoch(&data, &params, k, num_threads, NULL);
+
+  if (!__write_tables(out_path, &params, data.count, k, error_before,
+                      error_after)) {
+    fprintf(stderr, "could not write %s\n", out_path);
+    return 1;
+  }
+  printf("error %.6f -> %.6f, tables written to %s\n", error_before,
+         error_after, out_path);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc >= 4 && strcmp(argv[1], "pack") == 0) {
+    return __pack(argv[2], argv[3]);
+  }
+  if (argc >= 4 && strcmp(argv[1], "tune") == 0) {
+    return __tune(argv[2], argv[3], argc - 4, argv + 4);
+  }
+  fprintf(stderr,
+          "usage: %s pack <positions.txt> <positions.bin>\n"
+          "       %s tune <positions.bin> <output.c> [--epochs N] "
+          "[--threads N] [--rate R] [--k K]\n",
+          argv[0], argv[0]);
+  return 1;
+}
@@ -1,32 +1,77 @@
+// fopencookie()
+#define _GNU_SOURCE
 #include "bitboard.h"
 #include "engine.h"
 #include "uci.h"
 #include "magic_info.h"
+#include "search.h"
 #include <emscripten.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define DEFAULT_FEN "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
 
-#define MAX_RESPONSE 1024
-static char response[MAX_RESPONSE];
+#define TT_SIZE_MB 16
+// The evaluation cache only pays for itself in front of the network; the
+// classical evaluation costs about as much as a cache miss.
+#ifdef NNUE_EVAL
+#define EVAL_CACHE_SIZE_KB 64
+#else
+#define EVAL_CACHE_SIZE_KB 0
+#endif
+
+// The response to the last command. The buffer and the stream writing into
+// it are kept across commands; the buffer only grows when a longer response
+// comes in.
+static char *response = NULL;
+static size_t response_len = 0;
+static size_t response_cap = 0;
+static FILE *response_out = NULL;
 
 static ChessBitboards bbs;
-static MagicInfo magic;
 
-static BITBOARD *rook_move_table[64];
-static BITBOARD *bishop_move_table[64];
+/// Append written bytes to the response, doubling the buffer when they do not
+/// fit (with room for the null terminator). Returns 0 if it cannot grow.
+ssize_t __write_response(void *cookie, const char *buf, size_t size) {
+  (void)cookie;
+  if (response_len + size + 1 > response_cap) {
+    size_t new_cap = response_cap ? response_cap : 256;
+    while (response_len + size + 1 > new_cap) {
+      new_cap *= 2;
+    }
+    char *new_data = (char *)realloc(response, new_cap);
+    if (!new_data) {
+      return 0;
+    }
+    response = new_data;
+    response_cap = new_cap;
+  }
+  memcpy(response + response_len, buf, size);
+  response_len += size;
+  return size;
+}
 
 EMSCRIPTEN_KEEPALIVE
 void wasm_init() {
+  MagicInfo magic = init_magic_info();
+  engine_setup(&magic);
   bb_init_chess_boards(&bbs, DEFAULT_FEN);
-  magic = init_magic_info();
-  engine_setup(&bbs, rook_move_table, bishop_move_table, &magic);
-  bbs.rook_move_table = rook_move_table;
-  bbs.bishop_move_table = bishop_move_table;
+  search_init(TT_SIZE_MB, EVAL_CACHE_SIZE_KB);
+  if (!response_out) {
+    cookie_io_functions_t io = {.write = __write_response};
+    response_out = fopencookie(NULL, "w", io);
+  }
 }
 
 EMSCRIPTEN_KEEPALIVE
 const char *wasm_process_uci_command(const char *cmd) {
-  String cmd_str = str_create(cmd);
-  process_uci_command(&cmd_str, &bbs, &magic, response, MAX_RESPONSE);
+  response_len = 0;
+  process_uci_command(cmd, &bbs, response_out);
+  fflush(response_out);
+  if (!response) {
+    return "";
+  }
+  response[response_len] = '\0';
   return response;
 }